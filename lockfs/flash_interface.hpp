@@ -8,13 +8,30 @@ interface against.
 */
 #pragma once
 
+#include <array>
 #include <concepts>
 #include <cstdint>
+#include <optional>
 #include <span>
 
 namespace LockFs
 {
 
+// Storage::Tag if it has one, else uint8_t. A wider tag (e.g. uint16_t)
+// allows more files, with a sparse Context::headers table so the RAM
+// needed doesn't grow with the tag range. All ones is never a valid tag.
+template<typename T>
+struct TagOf
+{
+    using type = uint8_t;
+};
+template<typename T>
+    requires requires { typename T::Tag; }
+struct TagOf<T>
+{
+    using type = T::Tag;
+};
+
 template<typename T>
 concept Storage = requires (
         T t,
@@ -23,7 +40,7 @@ concept Storage = requires (
         T::BlockSize blockSize,
         std::span<const uint8_t> src,
         std::span<uint8_t> dest,
-        uint8_t tag,
+        TagOf<T>::type tag,
         T::Checksum checksum)
 {
     typename T::FlashAddr;
@@ -51,4 +68,208 @@ concept Storage = requires (
     { t.verifyChecksum(addr, blockSize, checksum) } -> std::same_as<bool>;
 };
 
+// One read of a batch: dest.size() bytes from addr into dest
+template<typename FlashAddr>
+struct ReadRequest
+{
+    FlashAddr addr;
+    std::span<uint8_t> dest;
+};
+
+// Optional, for storage where each command has a setup cost (e.g. QSPI)
+// and so can do several small reads in one transaction. LockFs uses it
+// when available, e.g. to fetch block headers in batches.
+template<typename T>
+concept VectoredStorage = Storage<T> && requires (
+        T t,
+        std::span<const ReadRequest<typename T::FlashAddr>> requests)
+{
+    // Do all the reads, returns false on failure.
+    { t.flashReadv(requests) } -> std::same_as<bool>;
+};
+
+// One program of a batch: src to addr
+template<typename FlashAddr>
+struct WriteRequest
+{
+    FlashAddr addr;
+    std::span<const uint8_t> src;
+};
+
+// Optional, for storage which can program or erase several blocks at
+// once (e.g. blocks on separate chips, see StripedStorage). LockFs uses it
+// to finish and to erase blocks in batches.
+template<typename T>
+concept BatchStorage = Storage<T> && requires (
+        T t,
+        std::span<const WriteRequest<typename T::FlashAddr>> writes,
+        std::span<const typename T::FlashAddr> blocks)
+{
+    // Do all the programs/erases, returns false on failure.
+    { t.flashWritev(writes) } -> std::same_as<bool>;
+    { t.flashErasev(blocks) } -> std::same_as<bool>;
+};
+
+// Optional, for storage whose blocks go round several devices, block i on
+// device i % stripes() (see StripedStorage). LockFs then takes each block
+// of a file from the device after its previous block's where it can.
+template<typename T>
+concept InterleavedStorage = Storage<T> && requires ()
+{
+    { T::stripes() } -> std::convertible_to<size_t>;
+};
+
+// Optional, for memory mapped (e.g. execute-in-place) flash where data can
+// be used in place rather than copied out with flashRead.
+template<typename T>
+concept MappedStorage = Storage<T> && requires (
+        T t,
+        T::FlashAddr addr,
+        T::FlashAddr size)
+{
+    // View of size bytes from addr, empty on failure
+    { t.flashMap(addr, size) } -> std::same_as<std::span<const uint8_t>>;
+};
+
+// Optional, reserves two blocks to checkpoint the mounted state in, so that
+// loadAll only has to read the headers of the current files' blocks. LockFs
+// adds a record to the newest as each file is committed, and when it is
+// full erases and rewrites the other, so they must never be locked.
+template<typename T>
+concept IndexedStorage = Storage<T> && requires (T t)
+{
+    { t.indexBlocks() } -> std::same_as<std::array<typename T::FlashAddr, 2>>;
+};
+
+// Optional, for an index bigger than a block (its tag table grows with the
+// number of files, and more room means fewer rewrites): each copy takes
+// indexSpan() blocks from its index block, which must not overlap the
+// other's and are never locked either
+template<typename T>
+concept SpannedIndexStorage = IndexedStorage<T> && requires (T t)
+{
+    { t.indexSpan() } -> std::convertible_to<typename T::FlashAddr>;
+};
+
+// Optional, checksum which can be computed over the data as it is
+// written, so that finishing a block doesn't need to read it back.
+// Must give the same result as computeChecksum.
+template<typename T>
+concept IncrementalChecksum = Storage<T> && requires (
+        T t,
+        T::ChecksumState state,
+        std::span<const uint8_t> data)
+{
+    typename T::ChecksumState;
+    { t.checksumInit() } -> std::same_as<typename T::ChecksumState>;
+    // Add data to the state
+    { t.checksumUpdate(state, data) } -> std::same_as<void>;
+    { t.checksumFinal(state) } -> std::same_as<typename T::Checksum>;
+};
+
+// Optional, for flash where each program operation costs about the same
+// however little of a page it writes (e.g. NOR). LockFs then buffers
+// writes and only programs whole pages (pages don't cross blocks).
+template<typename T>
+concept PagedStorage = Storage<T> && requires ()
+{
+    { T::pageSize() } -> std::same_as<typename T::FlashAddr>;
+};
+
+// Optional, chooses how block headers are serialised: a HeaderLayout (see
+// layout.hpp) giving the byte order and the order of the fields, e.g. to
+// match images made by other tools. Otherwise DefaultLayout.
+template<typename T>
+concept LaidOutStorage = Storage<T> && requires ()
+{
+    typename T::HeaderLayout;
+};
+
+// Where a RangeLockStorage can protect blocks
+enum class LockFrom : uint8_t
+{
+    // Any runs of units
+    Anywhere,
+    // Only a power of two number of units from the bottom (address 0) or
+    // the top of the flash, e.g. the block protect bits of SPI NOR
+    Bottom,
+    Top,
+};
+
+struct LockGranularity
+{
+    LockFrom from;
+    // Blocks per unit of protection, ranges start and end on units
+    uint32_t unit = 1;
+    // Ranges that can be protected at once (at least one), only one from
+    // the bottom or top
+    uint32_t maxRanges = 1;
+};
+
+// Optional, for flash which protects ranges of blocks (e.g. with a status
+// register write, which takes milliseconds) rather than a block at a
+// time. LockFs then locks as few ranges as cover the blocks it would
+// have locked with flashLock. Blocks they cover which didn't need locking
+// can't be programmed or erased until reboot either.
+template<typename T>
+concept RangeLockStorage = Storage<T> && requires (
+        T t,
+        T::FlashAddr addr,
+        T::FlashAddr size)
+{
+    { T::lockGranularity() } -> std::same_as<LockGranularity>;
+    // Lock size bytes from addr, whole units (the last may be cut short
+    // by the end of the flash)
+    { t.flashLockRange(addr, size) } -> std::same_as<bool>;
+};
+
+// A region of the flash, size bytes erased eraseSize at a time
+template<typename FlashAddr>
+struct Sectors
+{
+    FlashAddr size;
+    FlashAddr eraseSize;
+};
+
+// Optional, for flash whose erase size differs across it (e.g. 4KiB boot
+// sectors at one end and 64KiB sectors elsewhere, or 4KiB sub-sector
+// erases only in some regions). maxBlockSize() is then the smallest erase
+// size, blocks are still all that size, and regions with bigger sectors
+// are erased a whole sector at a time once none of its blocks are in use.
+template<typename T>
+concept SectoredStorage = Storage<T> && requires (
+        T t,
+        T::FlashAddr addr,
+        T::FlashAddr size)
+{
+    // Regions in order from address 0, covering the flash, each erase
+    // size a multiple of maxBlockSize() and each region a multiple of
+    // its erase size
+    { T::sectors()[0] } -> std::convertible_to<Sectors<typename T::FlashAddr>>;
+    { T::sectors().size() } -> std::convertible_to<size_t>;
+    // Erase the sector at addr, size being its region's erase size (only
+    // called for regions erasing more than a block)
+    { t.flashEraseSector(addr, size) } -> std::same_as<bool>;
+};
+
+// Optional, for flash which programs and erases in the background (e.g.
+// DMA SPI) so the CPU is free until it is done. LockFs then also has
+// state machines (writeAsync, finishWriteAsync, eraseAsync) which submit
+// an operation and return, to be advanced again on completion (from a
+// poll loop or the completion callback). One operation at a time.
+template<typename T>
+concept AsyncStorage = Storage<T> && requires (
+        T t,
+        std::span<const uint8_t> src,
+        T::FlashAddr addr)
+{
+    // Start the operation, returns false if it can't be started. src
+    // must stay valid until it completes.
+    { t.flashWriteAsync(src, addr) } -> std::same_as<bool>;
+    { t.flashEraseAsync(addr) } -> std::same_as<bool>;
+    // {} while the last operation is in progress, then its result (like
+    // flashWrite/flashErase)
+    { t.flashPoll() } -> std::same_as<std::optional<bool>>;
+};
+
 };
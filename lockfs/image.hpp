@@ -0,0 +1,186 @@
+/**
+
+# LockFS image builder
+
+Lays out a complete LockFs flash image on the host, e.g. for a bulk
+programmer in the factory rather than streaming every file through the
+device. It runs the same LockFs code as the device over a RAM image, so
+the headers, checksums and flags are what the device would have written.
+
+`Format` describes the device's storage: `FlashAddr`, `BlockSize`,
+`Checksum` (and optionally `Tag`, `HeaderLayout`, `indexBlocks`,
+`indexSpan`),
+`maxBlockSize()`, `size()`, and `checksum(data)` giving the same result as
+the device's `computeChecksum`.
+
+Adding files only notes which blocks need checksums. `seal` then computes
+them in parts through a `Dispatch` (see striped.hpp), which may run the
+parts on separate threads, writes them into the headers and mounts the
+sealed image again. `writeIndex` then writes the index from it.
+
+*/
+#pragma once
+
+#include "lockfs.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace LockFs
+{
+
+template<typename Format>
+struct ImageStorage : Format
+{
+    using FlashAddr = Format::FlashAddr;
+    using BlockSize = Format::BlockSize;
+    using Checksum = Format::Checksum;
+    using Tag = TagOf<Format>::type;
+
+    // A block's data, whose checksum is left for ImageBuilder::seal
+    struct Deferred
+    {
+        FlashAddr addr;
+        BlockSize blockSize;
+    };
+
+    std::vector<uint8_t> backing = std::vector<uint8_t>(this->size(), 0xFF);
+    bool defer = true;
+    std::vector<Deferred> deferred{};
+
+    bool flashRead(FlashAddr address, std::span<uint8_t> dest)
+    {
+        std::copy_n(backing.begin() + address, dest.size(), dest.begin());
+        return true;
+    }
+
+    bool flashWrite(std::span<const uint8_t> src, FlashAddr address)
+    {
+        for (size_t i = 0; i < src.size(); ++i)
+        {
+            backing[address + i] &= src[i];
+        }
+        return true;
+    }
+
+    bool flashErase(FlashAddr block)
+    {
+        std::fill_n(backing.begin() + block, this->maxBlockSize(), 0xFF);
+        return true;
+    }
+
+    // Locking is up to the device
+    bool flashLock(FlashAddr address, Tag tag) { return true; }
+    bool flashLockFreeze() { return true; }
+
+    std::span<const uint8_t> data(FlashAddr addr, BlockSize blockSize) const
+    {
+        return std::span{backing}.subspan(addr, blockSize);
+    }
+
+    // While deferring, all ones to be filled in by seal
+    Checksum computeChecksum(FlashAddr addr, BlockSize blockSize)
+    {
+        if (defer)
+        {
+            deferred.push_back({.addr = addr, .blockSize = blockSize});
+            return Serialisation::init<Checksum>(0xFF);
+        }
+        return this->checksum(data(addr, blockSize));
+    }
+
+    bool verifyChecksum(FlashAddr addr, BlockSize blockSize, Checksum expected)
+    {
+        return this->checksum(data(addr, blockSize)) == expected;
+    }
+};
+
+template<typename Format>
+struct ImageBuilder
+{
+    using Storage = ImageStorage<Format>;
+    using Fs = LockFs<Storage>;
+    using FlashAddr = Fs::FlashAddr;
+    using Tag = Fs::Tag;
+
+    Storage storage;
+    Fs fs{.s = &storage};
+    std::vector<typename Fs::RamHeader> headers;
+    std::vector<typename Fs::BlockInfo> blocks = std::vector<typename Fs::BlockInfo>(fs.blockCount());
+    std::vector<typename Fs::Reservation> writers = std::vector<typename Fs::Reservation>(1);
+    std::vector<uint32_t> freeMap = std::vector<uint32_t>(fs.freeMapWords());
+    typename Fs::Context ctx{
+        .headers = headers,
+        .blocks  = blocks,
+        .writers = writers,
+        .freeMap = freeMap,
+        .sparse  = true,
+    };
+
+    // Blank image with room for this many files
+    ImageBuilder(const Format & format, size_t files)
+        : storage{format}
+        , headers(files)
+    {
+        // Can't fail, the image is blank
+        fs.loadAll(ctx);
+    }
+    // The Context points into the vectors
+    ImageBuilder(const ImageBuilder &) = delete;
+    ImageBuilder & operator=(const ImageBuilder &) = delete;
+
+    // Returns false if it doesn't fit, or there is already a file with
+    // the tag (an image has only one revision of each)
+    bool add(Tag tag, std::span<const uint8_t> data)
+    {
+        const auto * file = fs.fileHeader(ctx, tag);
+        if (file != nullptr && !file->current.erased())
+        {
+            return false;
+        }
+        auto rh = fs.startWrite(ctx, tag, data.size());
+        return rh.has_value() && fs.write(*rh, data) && fs.finishWrite(ctx, *rh);
+    }
+
+    // Fills in the checksums, dispatch(parts, job) running job(0) ..
+    // job(parts - 1), then mounts the image again (the context still has
+    // the placeholder checksums).
+    // Returns false if it doesn't mount. Files added after this are
+    // checksummed straight away.
+    template<typename Dispatch>
+    bool seal(Dispatch && dispatch, size_t parts)
+    {
+        using Header = Fs::Header;
+        using Checksum = Fs::Checksum;
+        storage.defer = false;
+        dispatch(parts, [&](size_t part)
+        {
+            for (size_t i = part; i < storage.deferred.size(); i += parts)
+            {
+                const auto [addr, blockSize] = storage.deferred[i];
+                const FlashAddr header = addr - Header::size;
+                Fs::Codec::template store<Field::Checksum, Checksum>(
+                    std::span{storage.backing}.subspan(header).template first<Header::size>(),
+                    storage.checksum(storage.data(addr, blockSize))
+                );
+            }
+        });
+        storage.deferred.clear();
+        return fs.scan(ctx) && fs.lock(ctx);
+    }
+
+    // After seal, writes the index from the sealed headers (with
+    // IndexedStorage, does nothing otherwise). Returns false on failure,
+    // e.g. if it doesn't fit.
+    bool writeIndex()
+    {
+        return fs.writeIndex(ctx);
+    }
+
+    std::span<const uint8_t> image() const { return storage.backing; }
+};
+
+};
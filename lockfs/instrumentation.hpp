@@ -0,0 +1,124 @@
+/**
+
+# LockFS instrumentation
+
+Optional policy for `LockFs` to count what it does on the hot paths and
+trace its operations. The default, `NoInstrumentation`, compiles out.
+
+*/
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+
+namespace LockFs
+{
+
+// Operations traced with begin/end events
+enum class Event : uint8_t
+{
+    LoadAll,
+    StartWrite,
+    Write,
+    FinishWrite,
+};
+
+enum class Counter : uint8_t
+{
+    HeaderReads,
+    HeaderWrites,
+    // Data bytes (not headers) programmed by write
+    BytesProgrammed,
+    // Block checksums computed or verified
+    Checksums,
+    // Blocks looked at and passed over while looking for free blocks
+    // (startWrite) or the next reserved block (write)
+    BlocksSkipped,
+    // flashLock calls
+    Locks,
+};
+
+template<typename T>
+concept Instrumentation = requires (T t, Counter counter, size_t n, Event event)
+{
+    { t.count(counter, n) } -> std::same_as<void>;
+    { t.begin(event) } -> std::same_as<void>;
+    { t.end(event) } -> std::same_as<void>;
+};
+
+struct NoInstrumentation
+{
+    constexpr void count(Counter, size_t) {}
+    constexpr void begin(Event) {}
+    constexpr void end(Event) {}
+};
+
+// Snapshot of CountingInstrumentation
+struct Counters
+{
+    size_t headerReads = 0;
+    size_t headerWrites = 0;
+    size_t bytesProgrammed = 0;
+    size_t checksums = 0;
+    size_t blocksSkipped = 0;
+    size_t locks = 0;
+};
+
+struct CountingInstrumentation
+{
+    Counters counters{};
+    // Optional, called at the beginning and end of each traced operation
+    void (*trace)(Event event, bool begin) = nullptr;
+
+    void count(Counter counter, size_t n)
+    {
+        switch (counter)
+        {
+        case Counter::HeaderReads: counters.headerReads += n; break;
+        case Counter::HeaderWrites: counters.headerWrites += n; break;
+        case Counter::BytesProgrammed: counters.bytesProgrammed += n; break;
+        case Counter::Checksums: counters.checksums += n; break;
+        case Counter::BlocksSkipped: counters.blocksSkipped += n; break;
+        case Counter::Locks: counters.locks += n; break;
+        }
+    }
+
+    void begin(Event event)
+    {
+        if (trace != nullptr)
+        {
+            trace(event, true);
+        }
+    }
+
+    void end(Event event)
+    {
+        if (trace != nullptr)
+        {
+            trace(event, false);
+        }
+    }
+};
+
+static_assert(Instrumentation<NoInstrumentation>);
+static_assert(Instrumentation<CountingInstrumentation>);
+
+// Traces an operation for the scope it is in
+template<Instrumentation T>
+struct Traced
+{
+    T & instrument;
+    Event event;
+
+    Traced(T & instrument, Event event) : instrument(instrument), event(event)
+    {
+        instrument.begin(event);
+    }
+    ~Traced()
+    {
+        instrument.end(event);
+    }
+};
+
+};
@@ -0,0 +1,234 @@
+/**
+
+# LockFS header layout
+
+Compile-time description of the serialised block header: the byte order
+and the order of its fields (their widths come from the storage's
+`Checksum`, `BlockSize` and `Tag`). `HeaderCodec` turns it into loads and stores
+at fixed offsets, so decoding a header is a handful of byte shuffles
+rather than a stream walked field by field.
+
+A storage picks a layout by defining `HeaderLayout` (see
+`LaidOutStorage`), otherwise it gets `DefaultLayout`.
+
+*/
+#pragma once
+
+#include "endian.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace LockFs
+{
+
+enum class Field : uint8_t
+{
+    Tag,
+    Flags,
+    Revision,
+    BlockSize,
+    Checksum,
+    EraseCount,
+    Position,
+};
+
+template<std::endian Endianness, Field... Order>
+struct HeaderLayout
+{
+    static constexpr std::endian endianness = Endianness;
+    static constexpr std::array<Field, sizeof...(Order)> order{Order...};
+
+    // Every field exactly once
+    static_assert(order.size() == 7);
+    static_assert(
+        []()
+        {
+            for (const Field field : order)
+            {
+                if (std::count(order.begin(), order.end(), field) != 1)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }()
+    );
+};
+
+using DefaultLayout = HeaderLayout<
+    std::endian::little,
+    Field::Tag,
+    Field::Flags,
+    Field::Revision,
+    Field::BlockSize,
+    Field::Checksum,
+    Field::EraseCount,
+    Field::Position
+>;
+
+template<typename Layout, typename Checksum, typename BlockSize, typename Tag = uint8_t>
+struct HeaderCodec
+{
+    using Endian = Serialisation::Endian<Layout::endianness>;
+
+    static constexpr size_t width(Field field)
+    {
+        switch (field)
+        {
+        case Field::BlockSize: return sizeof(BlockSize);
+        case Field::Checksum: return sizeof(Checksum);
+        case Field::EraseCount: return sizeof(uint32_t);
+        case Field::Position: return sizeof(uint16_t);
+        case Field::Tag: return sizeof(Tag);
+        default: return sizeof(uint8_t);
+        }
+    }
+
+    static constexpr size_t offset(Field field)
+    {
+        size_t ret = 0;
+        for (size_t i = 0; Layout::order[i] != field; ++i)
+        {
+            ret += width(Layout::order[i]);
+        }
+        return ret;
+    }
+
+    static constexpr size_t size =
+        offset(Layout::order.back()) + width(Layout::order.back());
+
+    template<Field F, typename T>
+    static constexpr T load(std::span<const uint8_t, size> buf)
+    {
+        static_assert(sizeof(T) == width(F));
+        return Endian::template load<T>(buf.template subspan<offset(F), sizeof(T)>());
+    }
+
+    template<Field F, typename T>
+    static constexpr void store(std::span<uint8_t, size> buf, T value)
+    {
+        static_assert(sizeof(T) == width(F));
+        Endian::template store<T>(buf.template subspan<offset(F), sizeof(T)>(), value);
+    }
+
+    // Header is anything with the fields of LockFs::Header. The erase
+    // count is stored inverted, so never programmed reads as 0.
+    template<typename Header>
+    static constexpr Header decode(std::span<const uint8_t, size> buf)
+    {
+        Header ret{};
+        ret.tag        = load<Field::Tag, Tag>(buf);
+        ret.flags      = load<Field::Flags, uint8_t>(buf);
+        ret.revision   = load<Field::Revision, uint8_t>(buf);
+        ret.blockSize  = load<Field::BlockSize, BlockSize>(buf);
+        ret.checksum   = load<Field::Checksum, Checksum>(buf);
+        ret.eraseCount = ~load<Field::EraseCount, uint32_t>(buf);
+        ret.position   = load<Field::Position, uint16_t>(buf);
+        return ret;
+    }
+
+    template<typename Header>
+    static constexpr void encode(const Header & header, std::span<uint8_t, size> buf)
+    {
+        store<Field::Tag, Tag>(buf, header.tag);
+        store<Field::Flags, uint8_t>(buf, header.flags);
+        store<Field::Revision, uint8_t>(buf, header.revision);
+        store<Field::BlockSize, BlockSize>(buf, header.blockSize);
+        store<Field::Checksum, Checksum>(buf, header.checksum);
+        store<Field::EraseCount, uint32_t>(buf, ~header.eraseCount);
+        store<Field::Position, uint16_t>(buf, header.position);
+    }
+
+    // Headers packed back to back in bufs (at least size * out.size())
+    template<typename Header>
+    static constexpr void decode(std::span<const uint8_t> bufs, std::span<Header> out)
+    {
+        for (size_t i = 0; i < out.size(); ++i)
+        {
+            out[i] = decode<Header>(bufs.subspan(i * size).template first<size>());
+        }
+    }
+};
+
+namespace Test
+{
+    template<typename Checksum, typename BlockSize, typename Tag>
+    struct Header
+    {
+        Checksum checksum;
+        BlockSize blockSize;
+        Tag tag;
+        uint8_t flags;
+        uint8_t revision;
+        uint32_t eraseCount;
+        uint16_t position;
+
+        constexpr bool operator==(const Header &) const = default;
+    };
+
+    // Encoding then decoding gives the same header back
+    template<typename Layout, typename Checksum, typename BlockSize, typename Tag = uint8_t>
+    constexpr bool roundTrips()
+    {
+        using Codec = HeaderCodec<Layout, Checksum, BlockSize, Tag>;
+        const Header<Checksum, BlockSize, Tag> header{
+            .checksum   = static_cast<Checksum>(0x89ABCDEF),
+            .blockSize  = static_cast<BlockSize>(0x1234),
+            .tag        = static_cast<Tag>(0x3456),
+            .flags      = 0x78,
+            .revision   = 0x9A,
+            .eraseCount = 0x01020304,
+            .position   = 0x0506,
+        };
+        std::array<uint8_t, Codec::size> buf{};
+        Codec::encode(header, buf);
+        return Codec::template decode<Header<Checksum, BlockSize, Tag>>(buf) == header;
+    }
+
+    using Reversed = HeaderLayout<
+        std::endian::big,
+        Field::Position,
+        Field::EraseCount,
+        Field::Checksum,
+        Field::BlockSize,
+        Field::Revision,
+        Field::Flags,
+        Field::Tag
+    >;
+};
+
+static_assert(Test::roundTrips<DefaultLayout, uint8_t, uint8_t>());
+static_assert(Test::roundTrips<DefaultLayout, uint8_t, uint16_t>());
+static_assert(Test::roundTrips<DefaultLayout, uint32_t, uint16_t>());
+static_assert(Test::roundTrips<Test::Reversed, uint8_t, uint8_t>());
+static_assert(Test::roundTrips<Test::Reversed, uint16_t, uint32_t>());
+static_assert(Test::roundTrips<DefaultLayout, uint8_t, uint16_t, uint16_t>());
+static_assert(Test::roundTrips<Test::Reversed, uint8_t, uint16_t, uint32_t>());
+
+static_assert(HeaderCodec<DefaultLayout, uint8_t, uint16_t>::size == 12);
+static_assert(HeaderCodec<DefaultLayout, uint8_t, uint16_t>::offset(Field::Checksum) == 5);
+static_assert(HeaderCodec<Test::Reversed, uint8_t, uint16_t>::offset(Field::Checksum) == 6);
+static_assert(HeaderCodec<DefaultLayout, uint8_t, uint16_t, uint16_t>::offset(Field::Flags) == 2);
+// Fixed offsets, in the given byte order
+static_assert(
+    []()
+    {
+        std::array<uint8_t, 12> buf{};
+        HeaderCodec<Test::Reversed, uint8_t, uint16_t>::store<Field::BlockSize, uint16_t>(buf, 0x0102);
+        return buf[7] == 0x01 && buf[8] == 0x02;
+    }()
+);
+static_assert(
+    []()
+    {
+        const std::array<uint8_t, 12> buf{0, 0, 0, 0x34, 0x12, 0, 0, 0, 0, 0, 0, 0};
+        return HeaderCodec<DefaultLayout, uint8_t, uint16_t>::load<Field::BlockSize, uint16_t>(buf);
+    }() == 0x1234
+);
+
+};
@@ -1,23 +1,88 @@
 #pragma once
 
+#include "endian.hpp"
 #include "flash_interface.hpp"
+#include "instrumentation.hpp"
+#include "layout.hpp"
+#include "lz.hpp"
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
-#include <cstdint>
 #include <optional>
 #include <span>
+#include <utility>
 
 namespace LockFs
 {
-    template<Storage Storage>
+    // Storage::ChecksumState if it has IncrementalChecksum, else empty
+    template<typename Storage>
+    struct ChecksumStateOf
+    {
+        struct type {};
+    };
+    template<IncrementalChecksum Storage>
+    struct ChecksumStateOf<Storage>
+    {
+        using type = Storage::ChecksumState;
+    };
+
+    // Storage::HeaderLayout if it has LaidOutStorage, else DefaultLayout
+    template<typename Storage>
+    struct HeaderLayoutOf
+    {
+        using type = DefaultLayout;
+    };
+    template<LaidOutStorage Storage>
+    struct HeaderLayoutOf<Storage>
+    {
+        using type = Storage::HeaderLayout;
+    };
+
+    // Buffer for a page of Storage if it has PagedStorage, else empty
+    template<typename Storage>
+    struct PageBufferOf
+    {
+        struct type {};
+    };
+    template<PagedStorage Storage>
+    struct PageBufferOf<Storage>
+    {
+        struct type
+        {
+            std::array<uint8_t, Storage::pageSize()> data;
+            typename Storage::FlashAddr size = 0;
+        };
+    };
+
+    template<Storage Storage, Instrumentation Instrument = NoInstrumentation>
     struct LockFs
     {
         using BlockSize = Storage::BlockSize;
         using FlashAddr = Storage::FlashAddr;
         using Checksum = Storage::Checksum;
+        using Tag = TagOf<Storage>::type;
+        using ChecksumState = ChecksumStateOf<Storage>::type;
+        using PageBuffer = PageBufferOf<Storage>::type;
+        using Codec = HeaderCodec<typename HeaderLayoutOf<Storage>::type, Checksum, BlockSize, Tag>;
 
         Storage * s;
+        // With IncrementalChecksum, still read each block back to verify
+        // its checksum once it is written
+        bool verifyBlocks = false;
+        // Reserve the least worn free blocks (by erase count), rather
+        // than just the next free ones
+        bool levelWear = true;
+        // With RangeLockStorage, tags of files which are rarely updated
+        // (e.g. firmware), placed from the end of the flash it protects
+        // from (the bottom if it can protect anywhere) so that fewer
+        // ranges cover them. Wear isn't levelled for them.
+        bool (*longLived)(Tag tag) = nullptr;
+        // Counts and traces the hot paths, compiled out by default
+        [[no_unique_address]] Instrument instrument{};
+
+        // Number of headers read per transaction with VectoredStorage
+        static constexpr size_t headerBatch = 16;
 
         // Serialised
         struct Header
@@ -27,27 +92,57 @@ namespace LockFs
             // size of the 64KiB block (after header), not user specified
             BlockSize blockSize;
             // User specified
-            uint8_t tag;
+            Tag tag;
             // Flag (erased, continuation), not user specified
             // TODO: Finished/closed flag?
             uint8_t flags;
             // Counter when uploading a newer version, not user specified
             uint8_t revision;
+            // Times the block has been erased (that we know of), programmed
+            // by eraseStep straight after erasing and kept by every later
+            // header write. Serialised inverted so never-programmed reads
+            // as 0. Not part of blank(), a counted block is still free.
+            uint32_t eraseCount;
+            // Index of the block in its file, set when reserving it
+            uint16_t position;
 
             // Serialised size
-            static constexpr FlashAddr size =
-                sizeof(Header::tag) +
-                sizeof(Header::flags) +
-                sizeof(Header::revision) +
-                sizeof(Header::blockSize) +
-                sizeof(Header::checksum);
+            static constexpr FlashAddr size = Codec::size;
 
-            // Bits for flags
+            // Bits for flags (flash programming can only clear bits):
+            // ERASED_BIT cleared as each block is sealed, except the start
+            // block's, which finishWrite clears along with its
+            // CONTINUATION_BIT to commit the file
             static constexpr uint8_t ERASED_BIT = 0x80;
             static constexpr uint8_t CONTINUATION_BIT = 0x40;
+            // Cleared on the header of an index block, whose tag stays all
+            // ones until it is stale (see invalidateIndex)
+            static constexpr uint8_t INDEX_BIT = 0x20;
+            // Cleared on every block of a patch revision (see startPatch)
+            static constexpr uint8_t PATCH_BIT = 0x10;
+            // Cleared on every block of a compressed file (see startWrite),
+            // whose blockSize is then the size decoded
+            static constexpr uint8_t COMPRESSED_BIT = 0x08;
+            // Cleared by scrubStep on a finished block whose checksum
+            // doesn't match, which is then kept (locked, never erased)
+            static constexpr uint8_t BAD_BIT = 0x04;
+            // Cleared on the header of a packed block (see writePacked),
+            // and on the records of the files in it as they are committed
+            static constexpr uint8_t PACKED_BIT = 0x02;
+            // Cleared on flash as soon as any other flag is (encode and
+            // decode flip it, so it reads as set). The older header format,
+            // without eraseCount and position, left it set: it then reads
+            // as cleared (see legacy).
+            static constexpr uint8_t FORMAT_BIT = 0x01;
 
             // Returns {} on failure to read
             static std::optional<Header> read(Storage & s, const FlashAddr address);
+            // Reads the header at each address into out (at least as
+            // long), batching the reads if the storage supports it.
+            // Returns false on failure to read.
+            static bool read(Storage & s, std::span<const FlashAddr> addresses, std::span<Header> out);
+            static Header decode(std::span<const uint8_t, size> buf);
+            void encode(std::span<uint8_t, size> buf) const;
             // Returns false on failure to write
             bool write(Storage & s, FlashAddr address) const;
 
@@ -61,13 +156,159 @@ namespace LockFs
                 return flags & CONTINUATION_BIT;
             }
 
+            constexpr bool index() const
+            {
+                return !(flags & INDEX_BIT);
+            }
+
+            constexpr bool patch() const
+            {
+                return !(flags & PATCH_BIT);
+            }
+
+            constexpr bool compressed() const
+            {
+                return !(flags & COMPRESSED_BIT);
+            }
+
+            constexpr bool bad() const
+            {
+                return !(flags & BAD_BIT);
+            }
+
+            constexpr bool packed() const
+            {
+                return !(flags & PACKED_BIT);
+            }
+
+            // Flags programmed in the older format (or cut off while being
+            // programmed)
+            constexpr bool legacy() const
+            {
+                return !(flags & FORMAT_BIT);
+            }
+
+            // Nothing written yet (unlike erased, also not reserved)
+            constexpr bool blank() const
+            {
+                return
+                    checksum == Serialisation::init<Checksum>(0xFF) &&
+                    blockSize == Serialisation::init<BlockSize>(0xFF) &&
+                    tag == Serialisation::init<Tag>(0xFF) &&
+                    flags == 0xFF &&
+                    revision == 0xFF;
+            }
+
             constexpr bool newerThan(const Header & other) const
             {
                 int8_t distance = revision - other.revision;
                 return distance > 0;
             }
+
+            // Header of a freshly erased block, only recording its wear
+            static constexpr Header erasedBlock(uint32_t eraseCount)
+            {
+                return Header{
+                    .checksum   = Serialisation::init<Checksum>(0xFF),
+                    .blockSize  = Serialisation::init<BlockSize>(0xFF),
+                    .tag        = Serialisation::init<Tag>(0xFF),
+                    .flags      = 0xFF,
+                    .revision   = 0xFF,
+                    .eraseCount = eraseCount,
+                    .position   = 0xFFFF,
+                };
+            }
+        };
+
+        // Not serialised, compact copy of a block's header built by
+        // loadAll so that later passes don't need to re-read flash
+        struct BlockInfo
+        {
+            BlockSize blockSize;
+            Tag tag;
+            uint8_t flags;
+            uint8_t revision;
+            // From the header, per block wear (see also wear)
+            uint32_t eraseCount;
+            uint16_t position;
+            // Part of the newest revision of its tag
+            bool live;
+            // Locked by loadAll (so until reboot, even once stale)
+            bool locked = false;
+            // Reserved by a write in progress
+            bool reserved = false;
+            // Header not read yet, mounted from the index (see
+            // Context::partial). Then only bad() is known.
+            bool unread = false;
+
+            constexpr bool erased() const
+            {
+                return flags & Header::ERASED_BIT;
+            }
+
+            constexpr bool index() const
+            {
+                return !(flags & Header::INDEX_BIT);
+            }
+
+            constexpr bool patch() const
+            {
+                return !(flags & Header::PATCH_BIT);
+            }
+
+            constexpr bool compressed() const
+            {
+                return !(flags & Header::COMPRESSED_BIT);
+            }
+
+            constexpr bool bad() const
+            {
+                return !(flags & Header::BAD_BIT);
+            }
+
+            constexpr bool packed() const
+            {
+                return !(flags & Header::PACKED_BIT);
+            }
+
+            // Finished block of some file
+            constexpr bool file() const
+            {
+                return !erased() && !index() && !packed();
+            }
+
+            // See Header::blank (we don't keep the checksum)
+            constexpr bool blank() const
+            {
+                return
+                    blockSize == Serialisation::init<BlockSize>(0xFF) &&
+                    tag == Serialisation::init<Tag>(0xFF) &&
+                    flags == 0xFF &&
+                    revision == 0xFF;
+            }
+
+            static constexpr BlockInfo erasedBlock(uint32_t eraseCount)
+            {
+                return BlockInfo{
+                    .blockSize  = Serialisation::init<BlockSize>(0xFF),
+                    .tag        = Serialisation::init<Tag>(0xFF),
+                    .flags      = 0xFF,
+                    .revision   = 0xFF,
+                    .eraseCount = eraseCount,
+                    .position   = 0xFFFF,
+                    .live       = false,
+                };
+            }
         };
 
+        // Run of count blocks from first (not wrapping around)
+        struct Extent
+        {
+            FlashAddr first;
+            FlashAddr count;
+        };
+        static constexpr size_t maxExtents = 4;
+
         // Not serialised
         struct RamHeader
         {
@@ -75,44 +316,662 @@ namespace LockFs
             FlashAddr startBlock;
             FlashAddr currentBlock;
             FlashAddr size;
+            // Blocks in the file, and if it is a patch the oldest
+            // revision it keeps blocks of (set by lock/committed)
+            uint16_t positions;
+            uint8_t base;
+            // From the context while writing, to follow the blocks
+            // startWrite reserved without reading their headers (and
+            // update them as they are sealed)
+            std::span<BlockInfo> blocks;
+            // The first runs of blocks startWrite reserved, for write to
+            // follow (after those, it looks for the rest in blocks)
+            std::array<Extent, maxExtents> extents;
+            uint8_t extentCount;
+            // Run with currentBlock in
+            uint8_t extent;
+            // Compressing, data buffered to go in the next block, and
+            // whether the current block is done with
+            std::span<uint8_t> buffer;
+            FlashAddr buffered;
+            bool blockDone;
+            // Over the data written to currentBlock so far
+            [[no_unique_address]] ChecksumState checksumState;
+            // Written data not yet programmed, up to the end of its page
+            [[no_unique_address]] PageBuffer page;
+        };
 
-#if 0
-            struct Iter
-            {
-                struct value_type
-                {
-                    FlashAddr block;
-                    FlashAddr blockSize;
-                };
-                using difference_type_t = std::ptrdiff_t;
-
-                RamHeader * rh;
-                FlashAddr block;
+        // Not serialised, position in a file being streamed out by read
+        struct Reader
+        {
+            // From the context, to follow the file's blocks without
+            // reading their headers
+            std::span<const BlockInfo> blocks;
+            Tag tag;
+            uint8_t revision;
+            FlashAddr currentBlock;
+            // Into the data of currentBlock
+            FlashAddr offset;
+            // Left in the file
+            FlashAddr remaining;
+            // Of currentBlock, a patch is followed by position rather
+            // than by revision
+            uint16_t position;
+            bool patch;
+            // Compressed, decodedBlock (if not past the end of the flash)
+            // is decoded in buffer
+            bool compressed;
+            std::span<uint8_t> buffer;
+            FlashAddr decodedBlock;
+        };
 
-                Iter & operator++();
-                Iter operator++(int);
-                value_type operator*() const
-                {
-                    return std::span{block, rh->current.blockSize};
-                }
-            };
-            static_assert(std::input_iterator<Iter>);
-#endif
+        // Blocks reserved by a write in progress, from startWrite until
+        // finishWrite (or the next loadAll)
+        struct Reservation
+        {
+            Tag tag;
+            uint8_t revision;
+            FlashAddr startBlock;
+            // One past the last reserved block, may have wrapped around
+            FlashAddr endBlock;
+            bool active = false;
         };
 
         struct Context
         {
+            // Indexed by tag, or if sparse the first headerCount are the
+            // tags with files (or a write started), sorted by tag. Use
+            // fileHeader to look one up either way.
             std::span<RamHeader> headers;
+            // One entry per block, at least blockCount() long
+            std::span<BlockInfo> blocks;
+            // One per write that can be in progress at once (each for a
+            // different tag)
+            std::span<Reservation> writers;
+            // Bit per block, set while it is blank and free to reserve
+            // (never for index blocks), at least freeMapWords() long.
+            // Built by loadAll so startWrite doesn't read headers.
+            std::span<uint32_t> freeMap;
+            // Optional (may be empty), bit per block found bad by
+            // scrubStep, at least freeMapWords() long. Rebuilt by loadAll
+            // from the headers, without verifying them again.
+            std::span<uint32_t> badMap = {};
             std::optional<FlashAddr> nextFreeBlock;
+            // With IndexedStorage, the newest index written or found
+            // (even if it turned out to be stale) so the next one goes in
+            // the other index block with a newer revision
+            std::optional<FlashAddr> indexBlock;
+            uint8_t indexRevision;
+            // Where the next record goes in the newest index, while it is
+            // up to date and has room (else the next change rewrites it)
+            std::optional<FlashAddr> indexEnd;
+            // The next free block the newest index recorded, until a write
+            // claims it. A write starting anywhere else would leave the
+            // index looking up to date, so it records the move first.
+            std::optional<FlashAddr> indexedFree;
+            // Mounted from the index, only the headers of the current
+            // files' blocks (and the next free one) have been read, the
+            // others are unread until loadRest
+            bool partial = false;
+            // The packed block writePacked adds records to, and where the
+            // next goes. Only one opened since loadAll, which locks the
+            // others (if any of their files are current).
+            std::optional<FlashAddr> packedBlock;
+            FlashAddr packedEnd = 0;
+            // For wide tags, RAM grows with the number of files rather
+            // than the tag range
+            bool sparse = false;
+            size_t headerCount = 0;
         };
 
-        // Fills the headers in the context (indexed by tag) and returns true if successful
+        // Entry for the tag in the context's headers, or nullptr if there
+        // is none (tag out of range, or not in the sparse table)
+        RamHeader * fileHeader(const Context & context, Tag tag) const;
+        // As fileHeader, but adds an entry (with no finished revision)
+        // to a sparse table if needed. nullptr if it is full.
+        RamHeader * addFileHeader(Context & context, Tag tag) const;
+        // Headers in use, all of them unless sparse
+        std::span<RamHeader> fileHeaders(const Context & context) const;
+
+        // Header::read/write, counted by the instrumentation
+        std::optional<Header> readHeader(FlashAddr address);
+        bool readHeaders(std::span<const FlashAddr> addresses, std::span<Header> out);
+        bool writeHeader(const Header & hdr, FlashAddr address);
+        // Writes hdrs[i] to addresses[i] (at most headerBatch), in one go
+        // with BatchStorage
+        bool writeHeaders(std::span<const FlashAddr> addresses, std::span<const Header> hdrs);
+        // Erases the blocks, in one go with BatchStorage
+        bool eraseBlocks(std::span<const FlashAddr> addresses);
+
+        constexpr FlashAddr blockCount() const
+        {
+            return s->size() / s->maxBlockSize();
+        }
+
+        constexpr size_t freeMapWords() const
+        {
+            return (blockCount() + 31) / 32;
+        }
+
+        // Fills the headers in the context (indexed by tag) and the block
+        // summaries, then locks the newest revisions. Reads each header
+        // once, or with IndexedStorage, if the newest index is up to date,
+        // only those of the current files' blocks (see Context::partial).
+        // Returns true if successful, false too if the finished blocks are
+        // in the older header format (see Header::FORMAT_BIT).
         bool loadAll(Context & context);
+        // Steps of loadAll, except that lock also works out the sizes.
+        // loadIndex follows each file in the index's tag table from its
+        // start block, and checks that the next free block it recorded is
+        // still blank.
+        bool scan(Context & context);
+        bool loadIndex(Context & context);
+        bool lock(Context & context);
+        // Reads the headers loadIndex left unread, keeping what lock
+        // worked out. Writing, erasing and scrubbing do this first, until
+        // then freeCount, wear and findFree only know of the blocks read.
+        // Returns false on failure to read.
+        bool loadRest(Context & context);
+        // Reads the headers at the addresses (at most headerBatch) into
+        // out, and into their summaries keeping the locks and bad marks
+        // already there. Returns false on failure to read.
+        bool loadBlocks(Context & context, std::span<const FlashAddr> addresses, std::span<Header> out);
+        // For loadIndex, fills in the file's header from its start block
+        // and reads the headers of its blocks. Returns false if they
+        // don't match the tag table.
+        bool loadFile(Context & context, RamHeader & file);
+        // With RangeLockStorage, the fewest ranges the storage can protect
+        // that cover the blocks to lock (live or bad) and the fewest other
+        // blocks, never the index blocks. With LockFrom::Bottom or Top
+        // only units from the end up to the first with free blocks and
+        // nothing to lock, stopping short of the index and leaving some
+        // free blocks, the blocks past it unprotected (though still never
+        // erased). Calls
+        // out(addr, size) for each in address order and returns how many
+        // there are.
+        template<typename Out>
+        FlashAddr planLocks(const Context & context, Out && out) const
+            requires RangeLockStorage<Storage>;
 
-        // Note: only one write in progress at a time for now.
-        std::optional<RamHeader> startWrite(Context headers, uint8_t tag, FlashAddr size);
+        // Writes to different tags can be interleaved, up to the number
+        // of context writers. The blocks of each are told apart by the
+        // reserved flag of the summaries, so leftovers of an unfinished
+        // write (same tag and revision) aren't picked up.
+        // Each block is finished as it is sealed, and finishWrite only
+        // programs the start block's header to commit. Sealed blocks of
+        // an unfinished write are never part of a committed revision, the
+        // next write skipping past their revision.
+        // Both update the context to match what they wrote.
+        // Given a buffer (which must stay valid until finishWrite) the
+        // file is compressed, as much of the buffer as fits going in each
+        // block. Blocks are compressed on their own, so a reader only
+        // needs a buffer as big to decode one at a time. startWrite
+        // reserves blocks for the data not compressing at all, those not
+        // needed are left to eraseStep.
+        std::optional<RamHeader> startWrite(
+            Context & context,
+            Tag tag,
+            FlashAddr size,
+            std::span<uint8_t> buffer = {}
+        );
         bool write(RamHeader & header, std::span<const uint8_t> data);
-        bool finishWrite(RamHeader & header);
+        bool finishWrite(Context & context, RamHeader & header);
+        // Starts a new revision of a committed file which only programs
+        // the blocks that changed, keeping the others where they are.
+        // changed are their positions (ascending), and the data written
+        // is theirs in order, each blockDataSize() but the last. The last
+        // block, and any past the end of the current revision, are
+        // always written. Finished by finishWrite as usual, until then
+        // (or on power loss) the current revision stays. Fails while
+        // blocks sealed by an unfinished write of the next revision are
+        // still around, until eraseStep has erased them.
+        std::optional<RamHeader> startPatch(
+            Context & context,
+            const RamHeader & file,
+            FlashAddr size,
+            std::span<const uint16_t> changed
+        );
+        // Writes a whole small file (at most packedCapacity()) as a record
+        // in a packed block, so that small files share blocks. A record
+        // is a header like a block's (its blockSize the file's size, and
+        // checksum over just its data) then the data, after the last one
+        // in the block. The data is programmed first, then the header,
+        // then the header's flags to commit it, so on power loss the
+        // previous revision stays. A packed block is live (so locked, and
+        // never erased) while any of its files are current. Doesn't
+        // compress, and a packed file can't be patched.
+        bool writePacked(Context & context, Tag tag, std::span<const uint8_t> data);
+        constexpr FlashAddr packedCapacity() const
+        {
+            return blockDataSize() - Header::size;
+        }
+        // startWrite, or startPatch if base is set
+        std::optional<RamHeader> reserve(
+            Context & context,
+            Tag tag,
+            FlashAddr size,
+            const RamHeader * base,
+            std::span<const uint16_t> changed,
+            std::span<uint8_t> buffer
+        );
+        // Revision for the next write of the tag, past those of blocks
+        // sealed by unfinished writes (which look finished), or {} if
+        // there is none (always for a patch, see startPatch)
+        std::optional<uint8_t> nextRevision(
+            const Context & context,
+            Tag tag,
+            const RamHeader & file,
+            bool patch
+        ) const;
+        // Takes a free block for writePacked and programs its header
+        bool openPacked(Context & context);
+        // Calls f(addr, header) for each committed record in the packed
+        // block, in order. Returns false on failure to read.
+        template<typename F>
+        bool records(FlashAddr block, F && f);
+        // Marks the packed blocks holding current files live, and the
+        // others not
+        void packedLive(Context & context);
+        // With a patch as the newest revision of the file, marks its
+        // live blocks (the newest at each position, of the revisions
+        // since the last full one) and works out its size
+        void patchLive(Context & context, RamHeader & file);
+        constexpr FlashAddr blockDataSize() const
+        {
+            return s->maxBlockSize() - Header::size;
+        }
+        // Next block reserved for this write after the current one
+        // (moving on to the next extent), or {} if we wrap around
+        std::optional<FlashAddr> nextReserved(RamHeader & header);
+
+        // Free map upkeep, as blocks get reserved or erased
+        void markFree(Context & context, FlashAddr addr, bool free);
+        // Bad map upkeep, if the context has one
+        void markBad(Context & context, FlashAddr addr);
+        // First free block from addr on (wrapping around), or {}
+        std::optional<FlashAddr> findFree(const Context & context, FlashAddr addr) const;
+        // With InterleavedStorage, the first free block on the stripe
+        // (device) from addr on, or {}
+        std::optional<FlashAddr> findFree(const Context & context, FlashAddr addr, size_t stripe) const
+            requires InterleavedStorage<Storage>;
+        // Where a longLived file of blocksNeeded blocks goes from, or {}
+        std::optional<FlashAddr> pinnedStart(const Context & context, FlashAddr blocksNeeded) const;
+        // With SectoredStorage, where a file of blocksNeeded blocks goes
+        // from: the first free block (from the next free one on) in the
+        // biggest sectors it fills, at the start of a sector that is all
+        // free. Failing that, the first with room for it in a sector
+        // that is partly used already, or the start of a free one. {} if
+        // there is none, or without SectoredStorage.
+        std::optional<FlashAddr> placedStart(const Context & context, FlashAddr blocksNeeded) const;
+        // The sector (its blocks) the block is in, with SectoredStorage,
+        // else just the block
+        Extent sectorOf(FlashAddr addr) const;
+        // Records in the index that the next free block is now start
+        // (see Context::indexedFree), see logIndex
+        bool indexFrom(Context & context, FlashAddr start);
+        // Marks the newest index stale by programming its tag (if that
+        // fails, erases both index blocks), so loadAll doesn't trust it.
+        // Returns false if it could still look up to date.
+        bool invalidateIndex(Context & context);
+        FlashAddr freeCount(const Context & context) const;
+
+        // Which free blocks startWrite takes: all those erased fewer than
+        // limit times, and the first atLimit found erased exactly limit
+        // times (without levelWear, the first free ones whatever their
+        // wear)
+        struct WearLimit
+        {
+            uint32_t limit;
+            FlashAddr atLimit;
+
+            constexpr bool take(uint32_t eraseCount) const
+            {
+                return eraseCount < limit || (eraseCount == limit && atLimit > 0);
+            }
+        };
+        WearLimit wearLimit(const Context & context, FlashAddr blocksNeeded) const;
+
+        // Aggregate of the erase counts of all blocks in the summaries
+        struct Wear
+        {
+            uint32_t min;
+            uint32_t max;
+            uint64_t total;
+            FlashAddr blocks;
+        };
+        Wear wear(const Context & context) const;
+        // Writes the checksum and blockSize of the current block, which
+        // unless it is the start block is then finished
+        bool sealBlock(RamHeader & header);
+        // The header to seal the current block with, its summary updated
+        // to match
+        Header sealHeader(RamHeader & header);
+        // Works out the checksum of the current block for sealing it, and
+        // fills in its erase count (so the header is rewritten as it was)
+        bool checksumBlock(RamHeader & header);
+        // Update the context for the start block, and then the whole
+        // file, that finishWrite has committed
+        void finished(Context & context, FlashAddr addr, const Header & hdr);
+        void committed(Context & context, const RamHeader & header, const Header & start);
+        // With PagedStorage, buffers src (to be written at addr) and
+        // programs each page as it fills up
+        bool writePages(RamHeader & header, std::span<const uint8_t> src, FlashAddr addr);
+        // Programs what's buffered of the current page
+        bool flushPage(RamHeader & header);
+        // Compresses what's buffered into the next block (or the current
+        // one if nothing is in it yet) and seals it, keeping what didn't
+        // fit buffered. The whole of its data is checksummed, the end
+        // left erased.
+        bool compressBlock(RamHeader & header);
+
+        // Progress of writeAsync through the data
+        struct AsyncWrite
+        {
+            // Left to write, must stay valid until done
+            std::span<const uint8_t> data;
+            // Header of the full block being sealed
+            std::array<uint8_t, Header::size> buf;
+            bool pending = false;
+            bool sealing = false;
+        };
+
+        // Progress of finishWriteAsync
+        struct AsyncFinish
+        {
+            enum class Stage : uint8_t
+            {
+                Seal,
+                Start,
+            };
+            Stage stage = Stage::Seal;
+            // Header being written
+            Header hdr;
+            FlashAddr addr;
+            std::array<uint8_t, Header::size> buf;
+            bool pending = false;
+        };
+
+        // With AsyncStorage, state machines doing the same as write,
+        // finishWrite and eraseStep (see eraseAsync), which submit at
+        // most one operation per call. They return {} while in progress,
+        // to be called again once it completes, then true when done or
+        // false on failure. Headers are still read synchronously (reads
+        // are quick, it's programming and erasing that are slow) and so
+        // is the index. PagedStorage buffering isn't used, nor is
+        // compression (they fail for a compressed file).
+        std::optional<bool> writeAsync(RamHeader & header, AsyncWrite & op)
+            requires AsyncStorage<Storage>;
+        std::optional<bool> finishWriteAsync(Context & context, RamHeader & header, AsyncFinish & op)
+            requires AsyncStorage<Storage>;
+
+        // Checkpoints the context into the older of the index blocks
+        // (with IndexedStorage, does nothing otherwise): its tag table
+        // (start block, revision and size of each file), the bad blocks,
+        // then a record of the next free block and the open packed
+        // block. This is only a speed up, if it fails (e.g. it doesn't fit
+        // in indexSpan() blocks) loadAll falls back to scanning. With
+        // SectoredStorage the index blocks must be in a region erased a
+        // block at a time, else there is no index.
+        bool writeIndex(Context & context);
+        // Serialised, what the index records of each change after its tag
+        // table, along with the next free block and the open packed
+        // block's end as they are after it
+        struct IndexRecord
+        {
+            enum class Kind : uint8_t
+            {
+                // A file committed (addr its start block, or its record if
+                // packed)
+                File = 0x01,
+                // A block scrubStep found bad
+                Bad = 0x02,
+                // Only the next free block or the packed block moved
+                Moved = 0x03,
+            };
+            Kind kind;
+            Tag tag = Serialisation::init<Tag>(0xFF);
+            FlashAddr addr = Serialisation::init<FlashAddr>(0xFF);
+            uint8_t revision = 0xFF;
+            FlashAddr fileSize = Serialisation::init<FlashAddr>(0xFF);
+            std::optional<FlashAddr> nextFree{};
+            std::optional<FlashAddr> packedEnd{};
+
+            // Serialised size, with a CRC-16 after the fields (each
+            // optional a byte whether it is set, then its value)
+            static constexpr FlashAddr size =
+                4 * sizeof(uint8_t) + sizeof(Tag) + 4 * sizeof(FlashAddr) + sizeof(uint16_t);
+        };
+        // Adds the record (with the context's next free block and packed
+        // block) to the newest index if it is up to date and has room,
+        // else checkpoints the context into the other (which has the
+        // change already). If neither works, makes the index stale.
+        // Returns false only if it could still look up to date.
+        bool logIndex(Context & context, IndexRecord record);
+        // Serialised size of an index's tag table with this many files
+        // and bad blocks
+        FlashAddr indexSize(size_t files, size_t bad) const;
+        // Blocks in each copy of the index
+        constexpr FlashAddr indexSpan() const
+        {
+            if constexpr (SpannedIndexStorage<Storage>)
+            {
+                return s->indexSpan();
+            }
+            return 1;
+        }
+        // Whether every index block can be erased on its own
+        bool indexErasable() const
+        {
+            if constexpr (IndexedStorage<Storage>)
+            {
+                for (const FlashAddr first : s->indexBlocks())
+                {
+                    for (FlashAddr i = 0; i < indexSpan(); ++i)
+                    {
+                        if (sectorOf(first + i * s->maxBlockSize()).count != 1)
+                        {
+                            return false;
+                        }
+                    }
+                }
+            }
+            return true;
+        }
+        constexpr bool isIndexBlock(FlashAddr addr) const
+        {
+            if constexpr (IndexedStorage<Storage>)
+            {
+                const FlashAddr span = indexSpan() * s->maxBlockSize();
+                for (const FlashAddr first : s->indexBlocks())
+                {
+                    if (addr >= first && addr - first < span)
+                    {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+        // Whether the block starts a copy of the index (has its header)
+        constexpr bool isIndexStart(FlashAddr addr) const
+        {
+            if constexpr (IndexedStorage<Storage>)
+            {
+                const auto index = s->indexBlocks();
+                return addr == index[0] || addr == index[1];
+            }
+            return false;
+        }
+
+        // Starts streaming a file found by loadAll (see fileHeader),
+        // returns {} if it has no finished revision. A compressed file
+        // needs a buffer at least as big as it was written with, to
+        // decode a block at a time into.
+        std::optional<Reader> openRead(
+            const Context & context,
+            const RamHeader & file,
+            std::span<uint8_t> buffer = {}
+        ) const;
+        // Fills dest from the file, batching the reads if the storage
+        // supports it. Returns the bytes read, which is less than
+        // dest.size() only at the end of the file, or {} on failure.
+        std::optional<FlashAddr> read(Reader & reader, std::span<uint8_t> dest);
+
+        // Zero-copy version of read, returns the rest of the current
+        // block's data in place (empty at the end of the file), or {} on
+        // failure (always for compressed files)
+        std::optional<std::span<const uint8_t>> map(Reader & reader)
+            requires MappedStorage<Storage>;
+        // The whole file in place, only possible if its data is
+        // contiguous, i.e. it fits in one block (headers separate the
+        // blocks). Otherwise (or on failure) returns {}, use map.
+        std::optional<std::span<const uint8_t>> mapFile(const Context & context, const RamHeader & file)
+            requires MappedStorage<Storage>;
+
+        // Moves the reader on to the next block once it has read all of
+        // the current one, returns false if there is no next block
+        bool advance(Reader & reader) const;
+        // Decodes the reader's current block of a compressed file into
+        // its buffer
+        bool decodeBlock(Reader & reader);
+
+        // Buffers the index, which is bigger than we want on the stack,
+        // through small flash reads/writes. With check, keeps a CRC-16 of
+        // the bytes loaded or stored, so the index is verified as it is
+        // read rather than in a pass of its own.
+        struct IndexStream
+        {
+            Storage & s;
+            FlashAddr addr;
+            FlashAddr end;
+            bool check = false;
+            std::array<uint8_t, 64> buf;
+            size_t pos = 0;
+            size_t len = 0;
+            uint16_t crc = 0xFFFF;
+            // Every byte loaded since the CRC was reset was all ones
+            bool blank = true;
+            bool ok = true;
+
+            template<typename T>
+            void load(T & out);
+            template<typename T>
+            void store(T value);
+            bool flush();
+            void update(uint8_t byte);
+            // A record with its CRC (resetting it first), loadRecord
+            // returns whether it checks out
+            bool loadRecord(IndexRecord & record);
+            void storeRecord(const IndexRecord & record);
+        };
+
+        // Not serialised, progress of eraseStep through the flash
+        struct Eraser
+        {
+            FlashAddr nextBlock = 0;
+            // Stop once this many blocks are blank (ready for startWrite)
+            FlashAddr pool = ~FlashAddr{0};
+        };
+
+        // Erases stale or unfinished blocks for later writes, in small
+        // steps so it can run from an idle loop: at most maxBlocks, and
+        // stopping early once expired() returns true (e.g. at the end of
+        // a time slice) or the pool is full. Skips blocks which are
+        // blank, locked, live, bad or reserved by a write in progress. Each
+        // erased block gets its erase count written back to its header.
+        // With SectoredStorage, a sector of several blocks is erased in
+        // one go once none of them are skipped for anything but being
+        // blank, counting as the blocks it gets back (which may go over
+        // maxBlocks). The index doesn't describe blank or stale blocks, so
+        // erasing leaves it as it is. Returns the number of blocks erased,
+        // or {} on failure.
+        template<typename Expired>
+        std::optional<FlashAddr> eraseStep(
+            Context & context,
+            Eraser & eraser,
+            FlashAddr maxBlocks,
+            Expired && expired
+        );
+        std::optional<FlashAddr> eraseStep(Context & context, Eraser & eraser, FlashAddr maxBlocks)
+        {
+            return eraseStep(context, eraser, maxBlocks, []() { return false; });
+        }
+        // Whether eraseStep would erase the block (on its own)
+        bool erasable(const Context & context, FlashAddr addr) const;
+        // Erases the sector and records its blocks' erase counts, returns
+        // how many of them weren't blank, or {} on failure
+        std::optional<FlashAddr> eraseSector(Context & context, Extent sector)
+            requires SectoredStorage<Storage>;
+
+        // Not serialised, progress of scrubStep through the flash
+        struct Scrubber
+        {
+            FlashAddr nextBlock = 0;
+            // Times it has been all the way through
+            uint32_t passes = 0;
+        };
+
+        // Verifies the checksums of finished blocks in small steps, so it
+        // can run from an idle loop: at most maxBlocks, and stopping early
+        // once expired() returns true. A block which doesn't match is
+        // marked bad in its header and in the context's badMap; it is
+        // locked by later mounts and never erased, so never reused. Its
+        // file stays as it is (reading it gives what is there). The index
+        // records the marks. On flash enforcing locks, a block
+        // locked since mounting can't have its header programmed until
+        // reboot, so its mark is only in the index: a mount which scans
+        // (without IndexedStorage, or with a stale index) loses it until
+        // scrubbing finds it again. Returns the number of blocks found
+        // bad, or {} on failure.
+        template<typename Expired>
+        std::optional<FlashAddr> scrubStep(
+            Context & context,
+            Scrubber & scrubber,
+            FlashAddr maxBlocks,
+            Expired && expired
+        );
+        std::optional<FlashAddr> scrubStep(Context & context, Scrubber & scrubber, FlashAddr maxBlocks)
+        {
+            return scrubStep(context, scrubber, maxBlocks, []() { return false; });
+        }
+        // Whether the block was found bad (by the context's badMap if it
+        // has one, else the summaries)
+        bool isBad(const Context & context, FlashAddr addr) const;
+
+        // Progress of eraseAsync
+        struct AsyncErase
+        {
+            FlashAddr block;
+            // Blocks looked at since the last erase
+            FlashAddr checked = 0;
+            // Header recording the erase count of the erased block
+            std::array<uint8_t, Header::size> buf;
+            bool pending = false;
+            bool recording = false;
+        };
+
+        // With AsyncStorage, eraseStep as a state machine (see writeAsync),
+        // done once the pool is full or there is nothing left to erase.
+        // Sectors of several blocks are left to eraseStep.
+        std::optional<bool> eraseAsync(Context & context, Eraser & eraser, AsyncErase & op)
+            requires AsyncStorage<Storage>;
+
+        // Next block after the given one with this tag and revision
+        // according to the summaries, or {} if we wrap around
+        std::optional<FlashAddr> nextBlock(
+            std::span<const BlockInfo> blocks,
+            FlashAddr block,
+            Tag tag,
+            uint8_t revision
+        ) const;
+        // Live block of the file at the position, looking from the given
+        // block on (wrapping around), or {} if there is none
+        std::optional<FlashAddr> positionBlock(
+            std::span<const BlockInfo> blocks,
+            FlashAddr from,
+            Tag tag,
+            uint16_t position
+        ) const;
     };
 };
 
@@ -5,6 +5,7 @@
 
 #include <algorithm>
 #include <array>
+#include <bit>
 #include <cassert>
 #include <cstdint>
 #include <iterator>
@@ -12,67 +13,306 @@
 
 using namespace Serialisation;
 
-template<LockFs::Storage Storage>
-std::optional<typename LockFs::LockFs<Storage>::Header>
-LockFs::LockFs<Storage>::Header::read(Storage & s, const FlashAddr address)
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+typename LockFs::LockFs<Storage, Instrument>::Header
+LockFs::LockFs<Storage, Instrument>::Header::decode(std::span<const uint8_t, Header::size> buf)
+{
+    Header ret = Codec::template decode<Header>(buf);
+    if (ret.flags != 0xFF)
+    {
+        ret.flags ^= FORMAT_BIT;
+    }
+    return ret;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::Header>
+LockFs::LockFs<Storage, Instrument>::Header::read(Storage & s, const FlashAddr address)
 {
     std::array<uint8_t, Header::size> buf;
     if (s.flashRead(address, buf))
     {
-        size_t i = 0;
-        auto ret = Header{};
-        EL::Stream stream{buf};
-        stream.load(ret.tag);
-        stream.load(ret.flags);
-        stream.load(ret.revision);
-        stream.load(ret.blockSize);
-        stream.load(ret.checksum);
-        return ret;
+        return decode(buf);
     }
     return std::optional<Header>{};
 }
 
-template<LockFs::Storage Storage>
-bool LockFs::LockFs<Storage>::Header::write(Storage & s, FlashAddr address) const
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::Header::read(
+    Storage & s,
+    std::span<const FlashAddr> addresses,
+    std::span<Header> out
+)
+{
+    assert(out.size() >= addresses.size());
+    if constexpr (VectoredStorage<Storage>)
+    {
+        // Back to back, to decode in one go
+        std::array<uint8_t, Header::size * headerBatch> bufs;
+        std::array<ReadRequest<FlashAddr>, headerBatch> requests;
+        while (addresses.size() > 0)
+        {
+            const size_t n = std::min(addresses.size(), headerBatch);
+            for (size_t i = 0; i < n; ++i)
+            {
+                requests[i] = {.addr = addresses[i], .dest = std::span{bufs}.subspan(i * Header::size, Header::size)};
+            }
+            if (!s.flashReadv(std::span{requests}.first(n)))
+            {
+                return false;
+            }
+            Codec::decode(std::span<const uint8_t>{bufs}, out.first(n));
+            for (Header & hdr : out.first(n))
+            {
+                if (hdr.flags != 0xFF)
+                {
+                    hdr.flags ^= FORMAT_BIT;
+                }
+            }
+            addresses = addresses.subspan(n);
+            out = out.subspan(n);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < addresses.size(); ++i)
+        {
+            const auto hdr = read(s, addresses[i]);
+            if (!hdr.has_value())
+            {
+                return false;
+            }
+            out[i] = *hdr;
+        }
+    }
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+void LockFs::LockFs<Storage, Instrument>::Header::encode(std::span<uint8_t, Header::size> buf) const
+{
+    Header hdr = *this;
+    if (hdr.flags != 0xFF)
+    {
+        hdr.flags ^= FORMAT_BIT;
+    }
+    Codec::encode(hdr, buf);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::Header::write(Storage & s, FlashAddr address) const
 {
     std::array<uint8_t, Header::size> buf;
-    size_t i = 0;
-    auto iter = std::begin(buf);
-    EL::Stream stream{buf};
-    stream.store(tag);
-    stream.store(flags);
-    stream.store(revision);
-    stream.store(blockSize);
-    stream.store(checksum);
+    encode(buf);
     return s.flashWrite(buf, address);
 }
 
-template<LockFs::Storage Storage>
-bool LockFs::LockFs<Storage>::loadAll(LockFs::Context & context)
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::Header>
+LockFs::LockFs<Storage, Instrument>::readHeader(FlashAddr address)
+{
+    instrument.count(Counter::HeaderReads, 1);
+    return Header::read(*s, address);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::readHeaders(
+    std::span<const FlashAddr> addresses,
+    std::span<LockFs::Header> out
+)
+{
+    instrument.count(Counter::HeaderReads, addresses.size());
+    return Header::read(*s, addresses, out);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::writeHeader(const LockFs::Header & hdr, FlashAddr address)
+{
+    instrument.count(Counter::HeaderWrites, 1);
+    return hdr.write(*s, address);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::writeHeaders(
+    std::span<const FlashAddr> addresses,
+    std::span<const LockFs::Header> hdrs
+)
+{
+    assert(addresses.size() <= headerBatch && hdrs.size() >= addresses.size());
+    if constexpr (BatchStorage<Storage>)
+    {
+        std::array<uint8_t, Header::size * headerBatch> bufs;
+        std::array<WriteRequest<FlashAddr>, headerBatch> requests;
+        for (size_t i = 0; i < addresses.size(); ++i)
+        {
+            const auto buf = std::span{bufs}.subspan(i * Header::size).template first<Header::size>();
+            hdrs[i].encode(buf);
+            requests[i] = {.addr = addresses[i], .src = buf};
+        }
+        instrument.count(Counter::HeaderWrites, addresses.size());
+        return addresses.empty() || s->flashWritev(std::span{requests}.first(addresses.size()));
+    }
+    else
+    {
+        for (size_t i = 0; i < addresses.size(); ++i)
+        {
+            if (!writeHeader(hdrs[i], addresses[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::eraseBlocks(std::span<const FlashAddr> addresses)
+{
+    if constexpr (BatchStorage<Storage>)
+    {
+        return addresses.empty() || s->flashErasev(addresses);
+    }
+    else
+    {
+        for (const FlashAddr addr : addresses)
+        {
+            if (!s->flashErase(addr))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::loadAll(LockFs::Context & context)
+{
+    const Traced traced{instrument, Event::LoadAll};
+    if (context.blocks.size() < blockCount() || context.freeMap.size() < freeMapWords())
+    {
+        return false;
+    }
+    // Summaries are reloaded without their reserved flags
+    for (Reservation & writer : context.writers)
+    {
+        writer.active = false;
+    }
+    if (!loadIndex(context) && !scan(context))
+    {
+        return false;
+    }
+    return lock(context);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+typename LockFs::LockFs<Storage, Instrument>::RamHeader *
+LockFs::LockFs<Storage, Instrument>::fileHeader(const LockFs::Context & context, Tag tag) const
+{
+    if (!context.sparse)
+    {
+        return tag < context.headers.size() ? &context.headers[tag] : nullptr;
+    }
+    const auto headers = context.headers.first(context.headerCount);
+    const auto it = std::ranges::lower_bound(headers, tag, {}, [](const RamHeader & rh) { return rh.current.tag; });
+    return it != headers.end() && it->current.tag == tag ? &*it : nullptr;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+typename LockFs::LockFs<Storage, Instrument>::RamHeader *
+LockFs::LockFs<Storage, Instrument>::addFileHeader(LockFs::Context & context, Tag tag) const
+{
+    if (RamHeader * rh = fileHeader(context, tag); rh != nullptr)
+    {
+        return rh;
+    }
+    if (!context.sparse || context.headerCount == context.headers.size())
+    {
+        return nullptr;
+    }
+    // Keeping it sorted, we expect thousands of files at most
+    const auto headers = context.headers.first(context.headerCount);
+    const auto it = std::ranges::lower_bound(headers, tag, {}, [](const RamHeader & rh) { return rh.current.tag; });
+    std::move_backward(it, headers.end(), headers.end() + 1);
+    *it = RamHeader{.current = {.tag = tag, .flags = Header::ERASED_BIT}};
+    ++context.headerCount;
+    return &*it;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::span<typename LockFs::LockFs<Storage, Instrument>::RamHeader>
+LockFs::LockFs<Storage, Instrument>::fileHeaders(const LockFs::Context & context) const
+{
+    return context.sparse ? context.headers.first(context.headerCount) : context.headers;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::scan(LockFs::Context & context)
 {
     std::optional<FlashAddr> freeBlockRunStart{};
-    for (RamHeader & rh : context.headers)
+    context.nextFreeBlock.reset();
+    context.indexEnd.reset();
+    context.indexedFree.reset();
+    context.partial = false;
+    context.headerCount = 0;
+    for (RamHeader & rh : fileHeaders(context))
     {
         rh.current.flags = Header::ERASED_BIT;
     }
-    // Read
-    for (FlashAddr i = 0; i < (s->size() / s->maxBlockSize()); ++i)
+    // Finished blocks in the older header format and this one
+    FlashAddr legacy = 0;
+    FlashAddr current = 0;
+    // Read, only place we touch the flash headers
+    std::array<FlashAddr, headerBatch> addresses;
+    std::array<Header, headerBatch> batch;
+    for (FlashAddr i = 0; i < blockCount(); ++i)
     {
         const FlashAddr addr = i * s->maxBlockSize();
-        const auto hdr = Header::read(*s, addr);
-        if (!hdr.has_value())
+        if (i % headerBatch == 0)
         {
-            // TODO: Bad blocks? Or just out of bounds
-            return false;
+            const size_t n = std::min<FlashAddr>(headerBatch, blockCount() - i);
+            for (size_t j = 0; j < n; ++j)
+            {
+                addresses[j] = addr + j * s->maxBlockSize();
+            }
+            if (!readHeaders(std::span{addresses}.first(n), batch))
+            {
+                // TODO: Bad blocks? Or just out of bounds
+                return false;
+            }
         }
-        if (hdr->erased())
+        const Header * hdr = &batch[i % headerBatch];
+        context.blocks[i] = BlockInfo{
+            .blockSize  = hdr->blockSize,
+            .tag        = hdr->tag,
+            .flags      = hdr->flags,
+            .revision   = hdr->revision,
+            .eraseCount = hdr->eraseCount,
+            .position   = hdr->position,
+            .live       = false,
+        };
+        if (isIndexBlock(addr))
+        {
+            // Never free, nor part of a file. Only the first block of each
+            // copy has a header.
+            context.blocks[i] = BlockInfo{
+                .blockSize  = 0,
+                .tag        = init<Tag>(0xFF),
+                .flags      = static_cast<uint8_t>(~(Header::ERASED_BIT | Header::INDEX_BIT)),
+                .revision   = 0xFF,
+                .eraseCount = isIndexStart(addr) ? hdr->eraseCount : 0,
+                .position   = 0xFFFF,
+                .live       = false,
+            };
+        }
+        else if (hdr->blank())
         {
             // By using the last free block, we make it more likely
             // that we cycle through the flash rather than just swapping
             // betweek two values
             freeBlockRunStart = freeBlockRunStart.value_or(addr);
         }
-        else if (hdr->tag < context.headers.size())
+        else
         {
             // End of run
             if (freeBlockRunStart.has_value())
@@ -80,21 +320,55 @@ bool LockFs::LockFs<Storage>::loadAll(LockFs::Context & context)
                 context.nextFreeBlock = freeBlockRunStart;
                 freeBlockRunStart.reset();
             }
+            // Cut off while its flags were programmed (or all in the older
+            // format, see the end), taken as unfinished
+            if (!hdr->erased() && hdr->legacy())
+            {
+                ++legacy;
+                batch[i % headerBatch].flags |= Header::ERASED_BIT;
+                context.blocks[i].flags = hdr->flags;
+            }
+            else if (!hdr->erased())
+            {
+                ++current;
+            }
 
-            const auto tag = hdr->tag;
-            if (hdr->continuation())
+            // Sizes are summed up in the lock pass, once we know the
+            // newest revision
+            if (!hdr->erased() && !hdr->index() && !hdr->continuation())
             {
-                context.headers[tag].size += hdr->blockSize;
+                RamHeader * rh = addFileHeader(context, hdr->tag);
+                // More files than a sparse table has room for, it must
+                // hold them all or some would be left unlocked
+                if (rh == nullptr && context.sparse)
+                {
+                    return false;
+                }
+                if (rh != nullptr && (rh->current.erased() || hdr->newerThan(rh->current)))
+                {
+                    rh->current = *hdr;
+                    rh->startBlock = addr;
+                    rh->currentBlock = addr;
+                }
             }
-            else
+            // The files in a packed block are found from its records
+            else if (!hdr->erased() && hdr->packed())
             {
-                if (context.headers[tag].current.erased() ||
-                    hdr->newerThan(context.headers[tag].current))
+                bool full = false;
+                const bool read = records(addr, [&](FlashAddr record, const Header & file)
                 {
-                    context.headers[tag].current = *hdr;
-                    context.headers[tag].startBlock = addr;
-                    context.headers[tag].currentBlock = addr;
-                    context.headers[tag].size = hdr->blockSize;
+                    RamHeader * rh = addFileHeader(context, file.tag);
+                    full = full || (rh == nullptr && context.sparse);
+                    if (rh != nullptr && (rh->current.erased() || file.newerThan(rh->current)))
+                    {
+                        rh->current = file;
+                        rh->startBlock = record;
+                        rh->currentBlock = record;
+                    }
+                });
+                if (!read || full)
+                {
+                    return false;
                 }
             }
         }
@@ -105,187 +379,3041 @@ bool LockFs::LockFs<Storage>::loadAll(LockFs::Context & context)
         context.nextFreeBlock = freeBlockRunStart;
         freeBlockRunStart.reset();
     }
-    // Lock
-    for (FlashAddr i = 0; i < (s->size() / s->maxBlockSize()); ++i)
+    // Written in the older format, which would be misread
+    return legacy == 0 || current > 0;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::lock(LockFs::Context & context)
+{
+    // Lock, using only the summaries
+    bool patches = false;
+    for (RamHeader & rh : fileHeaders(context))
+    {
+        // A packed file's size is in its record
+        const bool packed = !rh.current.erased() && rh.current.packed();
+        rh.size = packed ? rh.current.blockSize : 0;
+        rh.positions = packed;
+        patches = patches || (!rh.current.erased() && rh.current.patch());
+    }
+    // Packed blocks are only added to until reboot
+    context.packedBlock.reset();
+    std::ranges::fill(context.freeMap.first(freeMapWords()), 0);
+    if (!context.badMap.empty())
     {
-        const FlashAddr addr = i * s->maxBlockSize();
-        const auto hdr = Header::read(*s, addr);
+        std::ranges::fill(context.badMap.first(freeMapWords()), 0);
+    }
+    for (FlashAddr i = 0; i < blockCount(); ++i)
+    {
+        BlockInfo & info = context.blocks[i];
+        info.live = false;
+        info.locked = false;
+        if (info.blank() && !isIndexBlock(i * s->maxBlockSize()))
+        {
+            markFree(context, i * s->maxBlockSize(), true);
+        }
+        if (info.bad())
+        {
+            markBad(context, i * s->maxBlockSize());
+        }
+        RamHeader * rh = info.file() ? fileHeader(context, info.tag) : nullptr;
         if (
-            hdr.has_value() &&
-            !hdr->erased() &&
-            hdr->tag == context.headers[i].current.tag &&
-            hdr->revision == context.headers[i].current.revision
+            rh != nullptr &&
+            !rh->current.erased() &&
+            !rh->current.patch() &&
+            !rh->current.packed() &&
+            info.revision == rh->current.revision
         )
         {
-            if (!s->flashLock(addr, hdr->tag))
+            info.live = true;
+            rh->size += info.blockSize;
+            rh->positions = std::max<uint16_t>(rh->positions, info.position + 1);
+        }
+    }
+    // Patches keep blocks of older revisions
+    if (patches)
+    {
+        for (RamHeader & rh : fileHeaders(context))
+        {
+            if (!rh.current.erased() && rh.current.patch())
             {
-                return false;
+                patchLive(context, rh);
             }
         }
     }
-    return s->flashLockFreeze();
-}
-
-template<LockFs::Storage Storage>
-std::optional<typename LockFs::LockFs<Storage>::RamHeader>
-LockFs::LockFs<Storage>::startWrite(LockFs::Context context, uint8_t tag, FlashAddr size)
-{
-    // To write (reserving blocks so that multiple writes can be in
-    // progress):
-    // - (checksum in write)
-    // - (blockSize in write)
-    // - tag
-    // - revision
-    // - (flags in finishWrite)
-    const uint8_t revision = context.headers[tag].current.erased() ? 0 :
-        (context.headers[tag].current.tag + 1);
-    // Out of space
-    if (!context.nextFreeBlock.has_value())
+    packedLive(context);
+    // Bad blocks too, so nothing erases them
+    for (BlockInfo & info : context.blocks.first(blockCount()))
     {
-        return {};
+        info.locked = info.live || info.bad();
     }
-    RamHeader header{
-        .current = {
-            .checksum  = init<decltype(Header::checksum)>(0xFF),
-            .blockSize = init<decltype(Header::blockSize)>(0xFF),
-            .tag       = tag,
-            .flags     = init<decltype(Header::flags)>(0xFF),
-            .revision  = revision,
-        },
-        .startBlock = context.nextFreeBlock.value(),
-        .currentBlock = context.nextFreeBlock.value(),
-        .size = size,
-    };
-    // Reserve blocks
-    while (header.size > 0)
+    if constexpr (RangeLockStorage<Storage>)
     {
-        const auto maybe = Header::read(*s, header.currentBlock);
-        if (maybe.has_value() && maybe->erased())
+        // Whatever else the ranges cover can't be written until reboot
+        // either
+        bool ok = true;
+        planLocks(context, [&](FlashAddr addr, FlashAddr size)
+        {
+            for (FlashAddr block = addr; block < addr + size; block += s->maxBlockSize())
+            {
+                context.blocks[block / s->maxBlockSize()].locked = true;
+                markFree(context, block, false);
+            }
+            instrument.count(Counter::Locks, 1);
+            ok = ok && s->flashLockRange(addr, size);
+        });
+        if (!ok)
         {
-            header.current.write(*s, header.currentBlock);
-            const FlashAddr dataSize = s->maxBlockSize() - Header::size;
-            header.size -= std::min<FlashAddr>(dataSize, header.size);
+            return false;
         }
-        header.currentBlock = (header.currentBlock + s->maxBlockSize()) % s->size();
-        // Out of space
-        if (header.currentBlock == header.startBlock)
+        if (context.nextFreeBlock.has_value())
         {
-            return {};
+            context.nextFreeBlock = findFree(context, *context.nextFreeBlock);
         }
     }
-    header.size = size;
-    header.currentBlock = header.startBlock;
-    header.current.blockSize = 0;
-    context.headers[tag] = header;
-    return header;
+    else
+    {
+        for (FlashAddr i = 0; i < blockCount(); ++i)
+        {
+            const BlockInfo & info = context.blocks[i];
+            if (info.locked)
+            {
+                instrument.count(Counter::Locks, 1);
+                if (!s->flashLock(i * s->maxBlockSize(), info.tag))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return s->flashLockFreeze();
 }
 
-template<LockFs::Storage Storage>
-bool LockFs::LockFs<Storage>::write(LockFs::RamHeader & header, std::span<const uint8_t> data)
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::loadRest(LockFs::Context & context)
 {
-    while (data.size() > 0)
+    if (!context.partial)
     {
-        if (header.current.blockSize < s->maxBlockSize() - Header::size)
+        return true;
+    }
+    std::array<FlashAddr, headerBatch> addresses;
+    std::array<Header, headerBatch> batch;
+    size_t n = 0;
+    for (FlashAddr i = 0; i <= blockCount(); ++i)
+    {
+        if (i < blockCount() && context.blocks[i].unread)
         {
-            // Add data to current block, if it becomes full, write header
-            // Note: Header::blockSize doesn't count header size so we
-            // add it in
-            const auto begin = header.current.blockSize + Header::size;
-            const size_t blockRemaining = s->maxBlockSize() - begin;
-            const size_t toWrite = std::min(data.size(), blockRemaining);
-            const auto end = begin + toWrite;
-            header.current.blockSize += decltype(Header::blockSize)(toWrite);
-            // Split data
-            std::span src = data.first(toWrite);
-            data = data.subspan(toWrite);
-            if (!s->flashWrite(src, header.currentBlock + begin))
-            {
-                return false;
-            }
+            addresses[n++] = i * s->maxBlockSize();
         }
-        else
+        if (n == 0 || (n < headerBatch && i < blockCount()))
         {
-            // To write:
-            // - checksum
-            // - blockSize
-            // - (tag in startWrite)
-            // - (revision in startWrite)
-            // - (flags in finishWrite)
-            header.current.checksum = s->computeChecksum(
-                header.currentBlock + Header::size,
-                header.current.blockSize
-            );
-            header.current.write(*s, header.currentBlock);
-            // Reset for next block
-            header.current.blockSize = 0;
-
-            // Find a new block
-            for (
-                // Current block is full
-                header.currentBlock += s->maxBlockSize();
-                // Until we have tried everything
-                header.currentBlock != header.startBlock;
-                // Try next block
-                header.currentBlock = (header.currentBlock + s->maxBlockSize()) % s->size()
-            )
+            continue;
+        }
+        if (!loadBlocks(context, std::span{addresses}.first(n), batch))
+        {
+            return false;
+        }
+        // As lock would have, range locks stay
+        for (const FlashAddr addr : std::span{addresses}.first(n))
+        {
+            const BlockInfo & info = context.blocks[addr / s->maxBlockSize()];
+            if (info.blank() && !info.locked)
             {
-                const auto maybe = Header::read(*s, header.currentBlock);
-                if (
-                    maybe.has_value() &&
-                    maybe->erased() &&
-                    maybe->revision == header.current.revision
-                )
-                {
-                    break;
-                }
+                markFree(context, addr, true);
             }
-            // We have ran out of blocks
-            if (header.currentBlock == header.startBlock)
+            if (info.bad())
             {
-                return false;
+                markBad(context, addr);
             }
         }
+        n = 0;
+    }
+    context.partial = false;
+    // Range locks may have covered all the free blocks read before
+    if (!context.nextFreeBlock.has_value())
+    {
+        context.nextFreeBlock = findFree(context, 0);
     }
     return true;
 }
 
-template<LockFs::Storage Storage>
-bool LockFs::LockFs<Storage>::finishWrite(LockFs::RamHeader & header)
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::loadBlocks(
+    LockFs::Context & context,
+    std::span<const FlashAddr> addresses,
+    std::span<LockFs::Header> out
+)
 {
-    // Finish blocks
-    // To write:
-    // - (checksum in write)
-    // - (blockSize in write)
-    // - (tag in write)
-    // - (revision in startWrite)
-    // - flags
-    while (header.currentBlock != header.startBlock)
+    if (!readHeaders(addresses, out))
     {
-        auto maybe = Header::read(*s, header.currentBlock);
-        if (
-            maybe.has_value() &&
-            maybe->erased() &&
-            maybe->revision == header.current.revision
-        )
+        return false;
+    }
+    for (size_t i = 0; i < addresses.size(); ++i)
+    {
+        BlockInfo & info = context.blocks[addresses[i] / s->maxBlockSize()];
+        const bool bad = info.bad();
+        info = BlockInfo{
+            .blockSize  = out[i].blockSize,
+            .tag        = out[i].tag,
+            .flags      = out[i].flags,
+            .revision   = out[i].revision,
+            .eraseCount = out[i].eraseCount,
+            .position   = out[i].position,
+            .live       = false,
+            .locked     = info.locked,
+        };
+        // The index's mark, a locked block's header may not have it
+        if (bad)
+        {
+            info.flags &= static_cast<uint8_t>(~Header::BAD_BIT);
+        }
+    }
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::loadFile(LockFs::Context & context, LockFs::RamHeader & file)
+{
+    const FlashAddr blockSize = s->maxBlockSize();
+    const FlashAddr block = file.startBlock - file.startBlock % blockSize;
+    if (file.startBlock >= s->size() || isIndexBlock(block))
+    {
+        return false;
+    }
+    std::array<FlashAddr, headerBatch> addresses;
+    std::array<Header, headerBatch> batch;
+    // From addr on, as many unread blocks in a row as the rest of the
+    // file needs (at least addr's)
+    FlashAddr have = 0;
+    const auto readFrom = [&](FlashAddr addr)
+    {
+        const FlashAddr want = std::clamp<FlashAddr>(
+            (file.size - have + blockDataSize() - 1) / blockDataSize(),
+            1,
+            headerBatch
+        );
+        size_t n = 0;
+        do
+        {
+            addresses[n++] = addr;
+            addr = (addr + blockSize) % s->size();
+        } while (n < want && context.blocks[addr / blockSize].unread);
+        return loadBlocks(context, std::span{addresses}.first(n), batch);
+    };
+    // A packed file's record, and its block unless another file in it
+    // has read it already
+    const bool packed = block != file.startBlock;
+    std::optional<Header> start{};
+    if (packed)
+    {
+        start = readHeader(file.startBlock);
+        if (!start.has_value() || start->blockSize != file.size)
+        {
+            return false;
+        }
+        if (context.blocks[block / blockSize].unread && !readFrom(block))
+        {
+            return false;
+        }
+    }
+    else if (readFrom(block))
+    {
+        start = batch[0];
+    }
+    // As the index has it, committed
+    if (
+        !start.has_value() ||
+        start->erased() ||
+        start->continuation() ||
+        start->packed() != packed ||
+        start->tag != file.current.tag ||
+        start->revision != file.current.revision
+    )
+    {
+        return false;
+    }
+    file.current = *start;
+    file.currentBlock = file.startBlock;
+    // A patch's blocks are found among older revisions' (see
+    // patchLive), loadIndex reads all the headers for it
+    if (packed || start->patch())
+    {
+        return true;
+    }
+    // Its blocks follow on from the start block, with any others in
+    // between, until they add up to its size
+    FlashAddr addr = block;
+    for (FlashAddr looked = 0; looked < blockCount(); ++looked)
+    {
+        if (context.blocks[addr / blockSize].unread && !readFrom(addr))
+        {
+            return false;
+        }
+        const BlockInfo & info = context.blocks[addr / blockSize];
+        if (info.file() && info.tag == start->tag && info.revision == start->revision)
         {
-            maybe->flags = Header::CONTINUATION_BIT & ~Header::ERASED_BIT;
-            if (!maybe->write(*s, header.currentBlock))
+            if (info.blockSize >= file.size - have)
             {
-                return false;
+                return true;
             }
+            have += info.blockSize;
         }
-        // Note:
-        //     x = (x + (lim - y)) % lim
-        // is the same as
-        //    x = (x - y) % max
-        // except it is always positive (C op% has the sign of the LHS
-        // operand not the RHS operand).
-        header.currentBlock = (header.currentBlock + (s->size() - s->maxBlockSize())) % s->size();
+        addr = (addr + blockSize) % s->size();
     }
-    auto start = Header::read(*s, header.startBlock);
-    assert(start.has_value() && start->erased() && start->revision == header.current.revision);
-    start->flags = static_cast<uint8_t>(~Header::ERASED_BIT);
-    start->write(*s, header.startBlock);
+    return false;
+}
 
-    return true;
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+template<typename Out>
+typename LockFs::LockFs<Storage, Instrument>::FlashAddr
+LockFs::LockFs<Storage, Instrument>::planLocks(const LockFs::Context & context, Out && out) const
+    requires RangeLockStorage<Storage>
+{
+    constexpr LockGranularity granularity = Storage::lockGranularity();
+    const FlashAddr unitSize = granularity.unit * s->maxBlockSize();
+    const FlashAddr units = (blockCount() + granularity.unit - 1) / granularity.unit;
+    const auto needed = [&](FlashAddr unit)
+    {
+        const FlashAddr end = std::min<FlashAddr>((unit + 1) * granularity.unit, blockCount());
+        for (FlashAddr i = unit * granularity.unit; i < end; ++i)
+        {
+            if (context.blocks[i].live || context.blocks[i].bad())
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+    // Index blocks are rewritten, so never locked
+    const auto hasIndex = [&](FlashAddr unit)
+    {
+        const FlashAddr end = std::min<FlashAddr>((unit + 1) * granularity.unit, blockCount());
+        for (FlashAddr i = unit * granularity.unit; i < end; ++i)
+        {
+            if (isIndexBlock(i * s->maxBlockSize()))
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+    const auto emit = [&](FlashAddr first, FlashAddr count)
+    {
+        out(first * unitSize, std::min<FlashAddr>(count * unitSize, s->size() - first * unitSize));
+    };
+    if constexpr (granularity.from != LockFrom::Anywhere)
+    {
+        // One region from the end, over the units pinnedStart clusters
+        // long-lived files in, stopping at the first unit with free
+        // blocks and none to lock (or with index blocks). The region
+        // only takes the free blocks among live ones, live blocks past
+        // it are left unprotected (though still never erased).
+        constexpr bool bottom = granularity.from == LockFrom::Bottom;
+        const auto nth = [&](FlashAddr n)
+        {
+            return bottom ? n : units - n - 1;
+        };
+        // Unread blocks may be free too, once loadRest has read them
+        const auto hasFree = [&](FlashAddr unit, bool unread)
+        {
+            const FlashAddr end = std::min<FlashAddr>((unit + 1) * granularity.unit, blockCount());
+            for (FlashAddr i = unit * granularity.unit; i < end; ++i)
+            {
+                const BlockInfo & info = context.blocks[i];
+                if ((info.blank() || (unread && info.unread)) && !isIndexBlock(i * s->maxBlockSize()))
+                {
+                    return true;
+                }
+            }
+            return false;
+        };
+        FlashAddr run = 0;
+        FlashAddr count = 0;
+        for (; run < units && !hasIndex(nth(run)); ++run)
+        {
+            if (needed(nth(run)))
+            {
+                count = run + 1;
+            }
+            else if (hasFree(nth(run), false))
+            {
+                break;
+            }
+        }
+        // A power of two, rounded up only over stale blocks
+        count = std::min<FlashAddr>(std::bit_ceil(count), std::bit_floor(run));
+        // Leaving some block outside it to write to
+        const auto freeOutside = [&](FlashAddr covered)
+        {
+            for (FlashAddr n = covered; n < units; ++n)
+            {
+                if (hasFree(nth(n), true))
+                {
+                    return true;
+                }
+            }
+            return false;
+        };
+        while (count > 0 && !freeOutside(count))
+        {
+            count /= 2;
+        }
+        if (count == 0)
+        {
+            return 0;
+        }
+        emit(bottom ? 0 : units - count, count);
+        return 1;
+    }
+    else
+    {
+        // Calls f(first, count) for each run of units to lock
+        const auto runs = [&](auto && f)
+        {
+            for (FlashAddr unit = 0; unit < units;)
+            {
+                if (!needed(unit))
+                {
+                    ++unit;
+                    continue;
+                }
+                const FlashAddr first = unit;
+                while (unit < units && needed(unit))
+                {
+                    ++unit;
+                }
+                f(first, unit - first);
+            }
+        };
+        // Gaps over index blocks are never merged over
+        const auto gapLength = [&](FlashAddr end, FlashAddr first)
+        {
+            for (FlashAddr unit = end; unit < first; ++unit)
+            {
+                if (hasIndex(unit))
+                {
+                    return ~FlashAddr{0};
+                }
+            }
+            return first - end;
+        };
+        const auto gapsOver = [&](FlashAddr length)
+        {
+            FlashAddr count = 0;
+            std::optional<FlashAddr> end{};
+            runs([&](FlashAddr first, FlashAddr n)
+            {
+                count += end.has_value() && gapLength(*end, first) > length;
+                end = first + n;
+            });
+            return count;
+        };
+        // Too many runs, so merge them over the shortest gaps: keep the
+        // longest gaps the ranges allow, those over some length and then
+        // as many of exactly that length as are left
+        const FlashAddr keep = granularity.maxRanges - 1;
+        FlashAddr low = 0;
+        FlashAddr high = units;
+        while (low < high)
+        {
+            const FlashAddr mid = low + (high - low) / 2;
+            if (gapsOver(mid) <= keep)
+            {
+                high = mid;
+            }
+            else
+            {
+                low = mid + 1;
+            }
+        }
+        FlashAddr equal = keep - std::min(keep, gapsOver(low));
+        FlashAddr ranges = 0;
+        std::optional<FlashAddr> start{};
+        FlashAddr end = 0;
+        runs([&](FlashAddr first, FlashAddr n)
+        {
+            if (start.has_value())
+            {
+                const FlashAddr gap = gapLength(end, first);
+                const bool split = gap > low || (gap == low && equal > 0);
+                if (split)
+                {
+                    equal -= gap == low;
+                    emit(*start, end - *start);
+                    ++ranges;
+                    start = first;
+                }
+            }
+            else
+            {
+                start = first;
+            }
+            end = first + n;
+        });
+        if (start.has_value())
+        {
+            emit(*start, end - *start);
+            ++ranges;
+        }
+        return ranges;
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+void LockFs::LockFs<Storage, Instrument>::patchLive(LockFs::Context & context, LockFs::RamHeader & file)
+{
+    const Tag tag = file.current.tag;
+    const uint8_t revision = file.current.revision;
+    // How many revisions before this one
+    const auto age = [&](const BlockInfo & info)
+    {
+        return static_cast<uint8_t>(revision - info.revision);
+    };
+    // The patch writes its last block, and the newest full revision
+    // (if it's still around) is as far back as it goes
+    file.positions = 0;
+    uint8_t oldest = 127;
+    for (const BlockInfo & info : context.blocks.first(blockCount()))
+    {
+        if (!info.file() || info.tag != tag || age(info) > oldest)
+        {
+            continue;
+        }
+        if (age(info) == 0)
+        {
+            file.positions = std::max<uint16_t>(file.positions, info.position + 1);
+        }
+        if (!info.patch())
+        {
+            oldest = age(info);
+        }
+    }
+    file.base = static_cast<uint8_t>(revision - oldest);
+    const auto kept = [&](const BlockInfo & info)
+    {
+        return info.file() && info.tag == tag && age(info) <= oldest && info.position < file.positions;
+    };
+    for (BlockInfo & info : context.blocks.first(blockCount()))
+    {
+        info.live = info.live || kept(info);
+    }
+    // Only blocks of patches replace older ones, and there should be
+    // few of them
+    for (const BlockInfo & newer : context.blocks.first(blockCount()))
+    {
+        if (!kept(newer) || !newer.patch())
+        {
+            continue;
+        }
+        for (BlockInfo & older : context.blocks.first(blockCount()))
+        {
+            if (older.live && kept(older) && older.position == newer.position && age(older) > age(newer))
+            {
+                older.live = false;
+            }
+        }
+    }
+    file.size = 0;
+    for (const BlockInfo & info : context.blocks.first(blockCount()))
+    {
+        if (info.live && info.tag == tag && kept(info))
+        {
+            file.size += info.blockSize;
+        }
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::RamHeader>
+LockFs::LockFs<Storage, Instrument>::startWrite(
+    LockFs::Context & context,
+    Tag tag,
+    FlashAddr size,
+    std::span<uint8_t> buffer
+)
+{
+    return reserve(context, tag, size, nullptr, {}, buffer);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::RamHeader>
+LockFs::LockFs<Storage, Instrument>::startPatch(
+    LockFs::Context & context,
+    const LockFs::RamHeader & file,
+    FlashAddr size,
+    std::span<const uint16_t> changed
+)
+{
+    // Nothing to keep blocks of
+    if (file.current.erased() || file.current.packed())
+    {
+        return {};
+    }
+    return reserve(context, file.current.tag, size, &file, changed, {});
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<uint8_t> LockFs::LockFs<Storage, Instrument>::nextRevision(
+    const LockFs::Context & context,
+    Tag tag,
+    const LockFs::RamHeader & file,
+    bool patch
+) const
+{
+    // A patch would keep the sealed blocks too (as part of an older
+    // revision), so it has to wait for them to be erased
+    const uint8_t committed = file.current.erased() ? 0xFF : file.current.revision;
+    const auto sealed = [&](uint8_t revision)
+    {
+        return std::ranges::any_of(
+            context.blocks.first(blockCount()),
+            [&](const BlockInfo & info) { return info.file() && info.tag == tag && info.revision == revision; }
+        );
+    };
+    uint8_t revision = static_cast<uint8_t>(committed + 1);
+    while (sealed(revision))
+    {
+        ++revision;
+        if (patch || revision == committed)
+        {
+            return {};
+        }
+    }
+    return revision;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::RamHeader>
+LockFs::LockFs<Storage, Instrument>::reserve(
+    LockFs::Context & context,
+    Tag tag,
+    FlashAddr size,
+    const LockFs::RamHeader * base,
+    std::span<const uint16_t> changed,
+    std::span<uint8_t> buffer
+)
+{
+    const Traced traced{instrument, Event::StartWrite};
+    // To write (reserving blocks so that multiple writes can be in
+    // progress):
+    // - (checksum in write)
+    // - (blockSize in write)
+    // - tag
+    // - revision
+    // - (flags in write, or finishWrite for the start block)
+    // A free writer slot, and no other write to this tag (it would get
+    // the same revision)
+    Reservation * slot = nullptr;
+    for (Reservation & writer : context.writers)
+    {
+        if (writer.active && writer.tag == tag)
+        {
+            return {};
+        }
+        if (!writer.active && slot == nullptr)
+        {
+            slot = &writer;
+        }
+    }
+    if (slot == nullptr || !loadRest(context))
+    {
+        return {};
+    }
+    // Added now if it is new, so finishing can't run out of room
+    const RamHeader * file = addFileHeader(context, tag);
+    if (file == nullptr)
+    {
+        return {};
+    }
+    const auto next = nextRevision(context, tag, *file, base != nullptr);
+    if (!next.has_value())
+    {
+        return {};
+    }
+    const uint8_t revision = *next;
+    // Compressed blocks hold at most a buffer each (its size must not
+    // look blank), and patches can't be, they rely on where data is
+    const bool compress = !buffer.empty();
+    if (compress && (
+        base != nullptr ||
+        buffer.size() > 0xFFFF ||
+        buffer.size() >= static_cast<FlashAddr>(init<BlockSize>(0xFF))
+    ))
+    {
+        return {};
+    }
+    // At least one block, even for an empty file. Compressing, enough
+    // for the data not compressing at all.
+    const FlashAddr dataSize = blockDataSize();
+    const FlashAddr perBlock = compress ?
+        std::min<FlashAddr>(buffer.size(), Lz::minConsumed(dataSize)) :
+        dataSize;
+    if (perBlock == 0)
+    {
+        return {};
+    }
+    const FlashAddr positions = std::max<FlashAddr>((size + perBlock - 1) / perBlock, 1);
+    if (positions > 0xFFFF)
+    {
+        return {};
+    }
+    // Blocks of a patch that need writing: the changed ones, the last,
+    // and any the base doesn't have full
+    const FlashAddr baseFull = base != nullptr ? base->size / dataSize : 0;
+    const auto rewrite = [&](FlashAddr position)
+    {
+        return
+            base == nullptr ||
+            position + 1 == positions ||
+            position >= baseFull ||
+            std::ranges::binary_search(changed, position);
+    };
+    FlashAddr blocksNeeded = 0;
+    for (FlashAddr position = 0; position < positions; ++position)
+    {
+        blocksNeeded += rewrite(position);
+    }
+    // Out of space
+    if (!context.nextFreeBlock.has_value() || freeCount(context) < blocksNeeded)
+    {
+        return {};
+    }
+    RamHeader header{
+        .current = {
+            .checksum   = init<decltype(Header::checksum)>(0xFF),
+            .blockSize  = init<decltype(Header::blockSize)>(0xFF),
+            .tag        = tag,
+            .flags      = static_cast<uint8_t>(
+                (base != nullptr ? ~Header::PATCH_BIT : 0xFF) &
+                (compress ? ~Header::COMPRESSED_BIT : 0xFF)
+            ),
+            .revision   = revision,
+            .eraseCount = 0,
+            .position   = 0,
+        },
+        .startBlock = context.nextFreeBlock.value(),
+        .currentBlock = context.nextFreeBlock.value(),
+        .size = size,
+        .extentCount = 0,
+        .extent = 0,
+        .buffer = buffer,
+        .buffered = 0,
+        .blockDone = false,
+    };
+    // Reserve blocks from the free map, recording the runs of them. They
+    // are still taken in order from the next free block (or for a
+    // longLived file, from where pinnedStart says), so the file's blocks
+    // follow on from its start block.
+    bool pinned = false;
+    if constexpr (RangeLockStorage<Storage>)
+    {
+        pinned = longLived != nullptr && longLived(tag);
+    }
+    if (pinned)
+    {
+        const auto start = pinnedStart(context, blocksNeeded);
+        if (!start.has_value())
+        {
+            return {};
+        }
+        header.currentBlock = *start;
+    }
+    else
+    {
+        header.currentBlock = placedStart(context, blocksNeeded).value_or(header.currentBlock);
+    }
+    WearLimit wear = pinned ?
+        WearLimit{.limit = ~uint32_t{0}, .atLimit = blocksNeeded} :
+        wearLimit(context, blocksNeeded);
+    // Free blocks that can be passed over and still leave enough
+    [[maybe_unused]] FlashAddr spare = freeCount(context) - blocksNeeded;
+    for (FlashAddr position = 0; position < positions; ++position)
+    {
+        if (!rewrite(position))
+        {
+            continue;
+        }
+        auto addr = findFree(context, header.currentBlock);
+        while (addr.has_value() && !wear.take(context.blocks[*addr / s->maxBlockSize()].eraseCount))
+        {
+            addr = findFree(context, (*addr + s->maxBlockSize()) % s->size());
+        }
+        if (!addr.has_value())
+        {
+            return {};
+        }
+        if constexpr (InterleavedStorage<Storage>)
+        {
+            // Free blocks from the current block up to a, as far as is
+            // needed to tell if there are more than spare
+            const auto passed = [&](FlashAddr a)
+            {
+                FlashAddr count = 0;
+                for (FlashAddr b = header.currentBlock; b != a && count <= spare; b = (b + s->maxBlockSize()) % s->size())
+                {
+                    const FlashAddr i = b / s->maxBlockSize();
+                    count += (context.freeMap[i / 32] >> (i % 32)) & 1;
+                }
+                return count;
+            };
+            // Rather on the device after the previous block's, so the
+            // file's blocks can be read, programmed and erased in
+            // parallel. Still after it, short of where the file starts.
+            const FlashAddr stripe = (header.currentBlock / s->maxBlockSize()) % Storage::stripes();
+            if (!pinned && header.extentCount > 0 && (*addr / s->maxBlockSize()) % Storage::stripes() != stripe)
+            {
+                const auto ahead = [&](FlashAddr a)
+                {
+                    return (a + s->size() - header.currentBlock) % s->size();
+                };
+                const FlashAddr end = ahead(header.extents[0].first);
+                auto other = findFree(context, header.currentBlock, stripe);
+                while (
+                    other.has_value() &&
+                    ahead(*other) < end &&
+                    !wear.take(context.blocks[*other / s->maxBlockSize()].eraseCount)
+                )
+                {
+                    // Not round again
+                    const auto next = findFree(context, (*other + s->maxBlockSize()) % s->size(), stripe);
+                    other = next.has_value() && ahead(*next) > ahead(*other) ? next : std::nullopt;
+                }
+                if (other.has_value() && ahead(*other) < end && passed(*other) <= spare)
+                {
+                    addr = other;
+                }
+            }
+            spare -= std::min(passed(*addr), spare);
+        }
+        instrument.count(Counter::BlocksSkipped, ((*addr + s->size() - header.currentBlock) % s->size()) / s->maxBlockSize());
+        BlockInfo & info = context.blocks[*addr / s->maxBlockSize()];
+        if (info.eraseCount == wear.limit)
+        {
+            --wear.atLimit;
+        }
+        header.current.eraseCount = info.eraseCount;
+        header.current.position = static_cast<uint16_t>(position);
+        if (
+            header.extentCount == 0 &&
+            context.indexedFree.has_value() &&
+            *addr != *context.indexedFree &&
+            !indexFrom(context, *addr)
+        )
+        {
+            return {};
+        }
+        if (*addr == context.indexedFree)
+        {
+            context.indexedFree.reset();
+        }
+        // Claimed now, sealed (checksum and size) once its data is
+        // written: two programs of the header. Claiming it with the seal
+        // instead would leave a block cut off before it with data under
+        // a blank header, which a mount would take for erased and hand
+        // out again to be programmed over.
+        if (!writeHeader(header.current, *addr))
+        {
+            return {};
+        }
+        info = BlockInfo{
+            .blockSize  = header.current.blockSize,
+            .tag        = tag,
+            .flags      = header.current.flags,
+            .revision   = revision,
+            .eraseCount = info.eraseCount,
+            .position   = header.current.position,
+            .live       = false,
+            .reserved   = true,
+        };
+        markFree(context, *addr, false);
+        Extent * last = header.extentCount > 0 ? &header.extents[header.extentCount - 1] : nullptr;
+        if (last != nullptr && *addr == last->first + last->count * s->maxBlockSize())
+        {
+            ++last->count;
+        }
+        else if (header.extentCount < maxExtents)
+        {
+            header.extents[header.extentCount++] = Extent{.first = *addr, .count = 1};
+        }
+        header.currentBlock = (*addr + s->maxBlockSize()) % s->size();
+    }
+    // Next write carries on from the next free block
+    context.nextFreeBlock = findFree(context, pinned ? *context.nextFreeBlock : header.currentBlock);
+    const FlashAddr first = header.extents[0].first;
+    *slot = Reservation{
+        .tag        = tag,
+        .revision   = revision,
+        .startBlock = first,
+        .endBlock   = header.currentBlock,
+        .active     = true,
+    };
+    header.startBlock = first;
+    header.currentBlock = header.startBlock;
+    header.blocks = context.blocks;
+    header.current.blockSize = 0;
+    if constexpr (IncrementalChecksum<Storage>)
+    {
+        header.checksumState = s->checksumInit();
+    }
+    return header;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::write(LockFs::RamHeader & header, std::span<const uint8_t> data)
+{
+    const Traced traced{instrument, Event::Write};
+    if (header.current.compressed())
+    {
+        // A block at a time, as the buffer fills up
+        while (data.size() > 0)
+        {
+            const FlashAddr n = std::min<FlashAddr>(data.size(), header.buffer.size() - header.buffered);
+            std::ranges::copy(data.first(n), header.buffer.begin() + header.buffered);
+            header.buffered += n;
+            data = data.subspan(n);
+            if (header.buffered == header.buffer.size() && !compressBlock(header))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    while (data.size() > 0)
+    {
+        if (header.current.blockSize < s->maxBlockSize() - Header::size)
+        {
+            // Add data to current block, if it becomes full, write header
+            // Note: Header::blockSize doesn't count header size so we
+            // add it in
+            const auto begin = header.current.blockSize + Header::size;
+            const size_t blockRemaining = s->maxBlockSize() - begin;
+            const size_t toWrite = std::min(data.size(), blockRemaining);
+            const auto end = begin + toWrite;
+            header.current.blockSize += decltype(Header::blockSize)(toWrite);
+            // Split data
+            std::span src = data.first(toWrite);
+            data = data.subspan(toWrite);
+            instrument.count(Counter::BytesProgrammed, toWrite);
+            if (!writePages(header, src, header.currentBlock + begin))
+            {
+                return false;
+            }
+            if constexpr (IncrementalChecksum<Storage>)
+            {
+                s->checksumUpdate(header.checksumState, src);
+            }
+        }
+        else
+        {
+            if (!sealBlock(header))
+            {
+                return false;
+            }
+
+            const auto next = nextReserved(header);
+            // We have ran out of blocks
+            if (!next.has_value())
+            {
+                return false;
+            }
+            header.currentBlock = *next;
+        }
+    }
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::nextReserved(LockFs::RamHeader & header)
+{
+    if (header.extent < header.extentCount)
+    {
+        const Extent & extent = header.extents[header.extent];
+        const FlashAddr next = header.currentBlock + s->maxBlockSize();
+        if (next < extent.first + extent.count * s->maxBlockSize())
+        {
+            return next;
+        }
+        if (header.extent + 1 < header.extentCount)
+        {
+            return header.extents[++header.extent].first;
+        }
+        header.extent = header.extentCount;
+    }
+    // Past the recorded runs, other writers' blocks (and leftovers) may
+    // be in between
+    for (
+        FlashAddr addr = (header.currentBlock + s->maxBlockSize()) % s->size();
+        addr != header.startBlock;
+        addr = (addr + s->maxBlockSize()) % s->size()
+    )
+    {
+        const BlockInfo & info = header.blocks[addr / s->maxBlockSize()];
+        if (info.reserved && info.tag == header.current.tag && info.revision == header.current.revision)
+        {
+            return addr;
+        }
+        instrument.count(Counter::BlocksSkipped, 1);
+    }
+    return {};
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+void LockFs::LockFs<Storage, Instrument>::markFree(LockFs::Context & context, FlashAddr addr, bool free)
+{
+    const FlashAddr i = addr / s->maxBlockSize();
+    const uint32_t bit = uint32_t{1} << (i % 32);
+    context.freeMap[i / 32] = free ? (context.freeMap[i / 32] | bit) : (context.freeMap[i / 32] & ~bit);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+void LockFs::LockFs<Storage, Instrument>::markBad(LockFs::Context & context, FlashAddr addr)
+{
+    if (!context.badMap.empty())
+    {
+        const FlashAddr i = addr / s->maxBlockSize();
+        context.badMap[i / 32] |= uint32_t{1} << (i % 32);
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::isBad(const LockFs::Context & context, FlashAddr addr) const
+{
+    const FlashAddr i = addr / s->maxBlockSize();
+    if (context.badMap.empty())
+    {
+        return context.blocks[i].bad();
+    }
+    return context.badMap[i / 32] & (uint32_t{1} << (i % 32));
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::findFree(const LockFs::Context & context, FlashAddr addr) const
+{
+    // A word at a time, the first word again at the end for the bits
+    // before addr
+    const FlashAddr start = addr / s->maxBlockSize();
+    const size_t words = freeMapWords();
+    for (size_t n = 0; n <= words; ++n)
+    {
+        const size_t w = (start / 32 + n) % words;
+        uint32_t word = context.freeMap[w];
+        if (n == 0)
+        {
+            word &= ~uint32_t{0} << (start % 32);
+        }
+        if (word != 0)
+        {
+            return (w * 32 + std::countr_zero(word)) * s->maxBlockSize();
+        }
+    }
+    return {};
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::findFree(const LockFs::Context & context, FlashAddr addr, size_t stripe) const
+    requires InterleavedStorage<Storage>
+{
+    // As findFree, masking each word to the stripe's blocks
+    constexpr size_t stripes = Storage::stripes();
+    const FlashAddr start = addr / s->maxBlockSize();
+    const size_t words = freeMapWords();
+    for (size_t n = 0; n <= words; ++n)
+    {
+        const size_t w = (start / 32 + n) % words;
+        uint32_t mask = 0;
+        for (size_t bit = (stripe + stripes - (w * 32) % stripes) % stripes; bit < 32; bit += stripes)
+        {
+            mask |= uint32_t{1} << bit;
+        }
+        uint32_t word = context.freeMap[w] & mask;
+        if (n == 0)
+        {
+            word &= ~uint32_t{0} << (start % 32);
+        }
+        if (word != 0)
+        {
+            return (w * 32 + std::countr_zero(word)) * s->maxBlockSize();
+        }
+    }
+    return {};
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::pinnedStart(const LockFs::Context & context, FlashAddr blocksNeeded) const
+{
+    if constexpr (RangeLockStorage<Storage>)
+    {
+        // Enough free blocks back from the top that the file ends up in
+        // the topmost ones
+        if constexpr (Storage::lockGranularity().from == LockFrom::Top)
+        {
+            FlashAddr found = 0;
+            for (FlashAddr i = blockCount(); i-- > 0;)
+            {
+                found += (context.freeMap[i / 32] >> (i % 32)) & 1;
+                if (found == blocksNeeded)
+                {
+                    return i * s->maxBlockSize();
+                }
+            }
+            return {};
+        }
+    }
+    return findFree(context, 0);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::placedStart(const LockFs::Context & context, FlashAddr blocksNeeded) const
+{
+    if constexpr (SectoredStorage<Storage>)
+    {
+        // Not in sectors bigger than the file, which would only be
+        // erased once other files in them are stale too
+        const FlashAddr start = context.nextFreeBlock.value_or(0) / s->maxBlockSize();
+        std::optional<FlashAddr> best{};
+        FlashAddr bestCount = 0;
+        for (FlashAddr n = 0; n < blockCount(); ++n)
+        {
+            const FlashAddr i = (start + n) % blockCount();
+            const FlashAddr addr = i * s->maxBlockSize();
+            if (!((context.freeMap[i / 32] >> (i % 32)) & 1))
+            {
+                continue;
+            }
+            const Extent sector = sectorOf(addr);
+            if (sector.count > blocksNeeded || sector.count <= bestCount)
+            {
+                continue;
+            }
+            bool whole = sector.count == 1 || addr == sector.first;
+            for (FlashAddr j = 1; j < sector.count && whole; ++j)
+            {
+                const FlashAddr b = i + j;
+                whole = (context.freeMap[b / 32] >> (b % 32)) & 1;
+            }
+            if (whole)
+            {
+                best = addr;
+                bestCount = sector.count;
+            }
+        }
+        if (best.has_value())
+        {
+            return best;
+        }
+        // Else in a bigger sector already partly used, with room for it,
+        // so that sectors fill up and are erased whole once they are all
+        // stale, rather than each small file taking a fresh one. Failing
+        // that, at the start of a free one.
+        std::optional<FlashAddr> fresh{};
+        for (FlashAddr n = 0; n < blockCount(); ++n)
+        {
+            const FlashAddr i = (start + n) % blockCount();
+            const Extent sector = sectorOf(i * s->maxBlockSize());
+            if (sector.count == 1 || !((context.freeMap[i / 32] >> (i % 32)) & 1))
+            {
+                continue;
+            }
+            const FlashAddr first = sector.first / s->maxBlockSize();
+            FlashAddr room = 0;
+            FlashAddr used = 0;
+            for (FlashAddr b = first; b < first + sector.count; ++b)
+            {
+                const bool free = (context.freeMap[b / 32] >> (b % 32)) & 1;
+                room += free && b >= i;
+                used += !free;
+            }
+            if (used > 0 && room >= blocksNeeded)
+            {
+                return i * s->maxBlockSize();
+            }
+            if (used == 0 && !fresh.has_value())
+            {
+                fresh = sector.first;
+            }
+            // On to the next sector
+            n += first + sector.count - 1 - i;
+        }
+        return fresh;
+    }
+    return {};
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+typename LockFs::LockFs<Storage, Instrument>::Extent
+LockFs::LockFs<Storage, Instrument>::sectorOf(FlashAddr addr) const
+{
+    if constexpr (SectoredStorage<Storage>)
+    {
+        FlashAddr start = 0;
+        for (const auto & region : Storage::sectors())
+        {
+            if (addr < start + region.size)
+            {
+                return Extent{
+                    .first = addr - (addr - start) % region.eraseSize,
+                    .count = region.eraseSize / s->maxBlockSize(),
+                };
+            }
+            start += region.size;
+        }
+    }
+    return Extent{.first = addr, .count = 1};
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::indexFrom(LockFs::Context & context, FlashAddr start)
+{
+    const auto next = std::exchange(context.nextFreeBlock, start);
+    const bool ok = logIndex(context, IndexRecord{.kind = IndexRecord::Kind::Moved});
+    context.nextFreeBlock = next;
+    return ok;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::logIndex(LockFs::Context & context, LockFs::IndexRecord record)
+{
+    if constexpr (!IndexedStorage<Storage>)
+    {
+        return true;
+    }
+    else
+    {
+        record.nextFree = context.nextFreeBlock;
+        record.packedEnd = context.packedBlock.has_value() ? std::optional{context.packedEnd} : std::nullopt;
+        const FlashAddr end = context.indexBlock.value_or(0) + indexSpan() * s->maxBlockSize();
+        if (context.indexEnd.has_value() && end - *context.indexEnd >= IndexRecord::size)
+        {
+            IndexStream stream{
+                .s = *s,
+                .addr = *context.indexEnd,
+                .end = *context.indexEnd + IndexRecord::size,
+                .check = true,
+            };
+            stream.storeRecord(record);
+            if (stream.flush())
+            {
+                *context.indexEnd += IndexRecord::size;
+                context.indexedFree = context.nextFreeBlock;
+                return true;
+            }
+        }
+        // Full, or the record may be half written: the other copy gets
+        // the whole context, change included
+        return writeIndex(context) || invalidateIndex(context);
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::invalidateIndex(LockFs::Context & context)
+{
+    if constexpr (IndexedStorage<Storage>)
+    {
+        context.indexEnd.reset();
+        context.indexedFree.reset();
+        if (!context.indexBlock.has_value())
+        {
+            return true;
+        }
+        auto hdr = readHeader(*context.indexBlock);
+        if (hdr.has_value())
+        {
+            hdr->tag = Tag{};
+            if (writeHeader(*hdr, *context.indexBlock))
+            {
+                return true;
+            }
+        }
+        return eraseBlocks(s->indexBlocks());
+    }
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+typename LockFs::LockFs<Storage, Instrument>::FlashAddr
+LockFs::LockFs<Storage, Instrument>::freeCount(const LockFs::Context & context) const
+{
+    FlashAddr count = 0;
+    for (const uint32_t word : context.freeMap.first(freeMapWords()))
+    {
+        count += std::popcount(word);
+    }
+    return count;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+typename LockFs::LockFs<Storage, Instrument>::WearLimit
+LockFs::LockFs<Storage, Instrument>::wearLimit(const LockFs::Context & context, FlashAddr blocksNeeded) const
+{
+    if (!levelWear)
+    {
+        return WearLimit{.limit = ~uint32_t{0}, .atLimit = blocksNeeded};
+    }
+    // Goes up through the erase counts of the free blocks, a pass per
+    // count, until there are enough (usually only a pass or two, as
+    // levelling keeps the counts close together)
+    uint32_t limit = 0;
+    FlashAddr below = 0;
+    while (true)
+    {
+        std::optional<uint32_t> lowest{};
+        FlashAddr atLowest = 0;
+        for (FlashAddr i = 0; i < blockCount(); ++i)
+        {
+            const uint32_t eraseCount = context.blocks[i].eraseCount;
+            if (!(context.freeMap[i / 32] & (uint32_t{1} << (i % 32))) || eraseCount < limit)
+            {
+                continue;
+            }
+            if (!lowest.has_value() || eraseCount < *lowest)
+            {
+                lowest = eraseCount;
+                atLowest = 0;
+            }
+            atLowest += eraseCount == *lowest;
+        }
+        // Not enough free blocks, startWrite checks that first
+        if (!lowest.has_value())
+        {
+            return WearLimit{.limit = limit, .atLimit = 0};
+        }
+        if (below + atLowest >= blocksNeeded)
+        {
+            return WearLimit{.limit = *lowest, .atLimit = blocksNeeded - below};
+        }
+        below += atLowest;
+        limit = *lowest + 1;
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+typename LockFs::LockFs<Storage, Instrument>::Wear
+LockFs::LockFs<Storage, Instrument>::wear(const LockFs::Context & context) const
+{
+    Wear ret{.min = ~uint32_t{0}, .max = 0, .total = 0, .blocks = blockCount()};
+    for (const BlockInfo & info : context.blocks.first(blockCount()))
+    {
+        ret.min = std::min(ret.min, info.eraseCount);
+        ret.max = std::max(ret.max, info.eraseCount);
+        ret.total += info.eraseCount;
+    }
+    return ret;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::sealBlock(LockFs::RamHeader & header)
+{
+    // To write:
+    // - checksum
+    // - blockSize
+    // - (tag in startWrite)
+    // - (revision in startWrite)
+    // - flags, but for the start block (in finishWrite)
+    if (!flushPage(header) || !checksumBlock(header))
+    {
+        return false;
+    }
+    if (!writeHeader(sealHeader(header), header.currentBlock))
+    {
+        return false;
+    }
+    // Reset for next block
+    header.current.blockSize = 0;
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+typename LockFs::LockFs<Storage, Instrument>::Header
+LockFs::LockFs<Storage, Instrument>::sealHeader(LockFs::RamHeader & header)
+{
+    // Finished straight away, except the start block, whose header
+    // commits the whole file
+    Header sealed = header.current;
+    if (header.currentBlock != header.startBlock)
+    {
+        sealed.flags &= static_cast<uint8_t>(~Header::ERASED_BIT);
+    }
+    BlockInfo & info = header.blocks[header.currentBlock / s->maxBlockSize()];
+    info.blockSize = sealed.blockSize;
+    info.flags = sealed.flags;
+    return sealed;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::checksumBlock(LockFs::RamHeader & header)
+{
+    const FlashAddr data = header.currentBlock + Header::size;
+    const BlockInfo & info = header.blocks[header.currentBlock / s->maxBlockSize()];
+    header.current.eraseCount = info.eraseCount;
+    header.current.position = info.position;
+    // See compressBlock
+    const BlockSize covered = header.current.compressed() ?
+        static_cast<BlockSize>(blockDataSize()) :
+        header.current.blockSize;
+    instrument.count(Counter::Checksums, 1);
+    if constexpr (IncrementalChecksum<Storage>)
+    {
+        header.current.checksum = s->checksumFinal(header.checksumState);
+        header.checksumState = s->checksumInit();
+        if (verifyBlocks)
+        {
+            instrument.count(Counter::Checksums, 1);
+            if (!s->verifyChecksum(data, covered, header.current.checksum))
+            {
+                return false;
+            }
+        }
+    }
+    else
+    {
+        header.current.checksum = s->computeChecksum(data, covered);
+    }
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::writePages(
+    LockFs::RamHeader & header,
+    std::span<const uint8_t> src,
+    FlashAddr addr
+)
+{
+    if constexpr (PagedStorage<Storage>)
+    {
+        while (src.size() > 0)
+        {
+            const FlashAddr pageEnd = (addr / Storage::pageSize() + 1) * Storage::pageSize();
+            const FlashAddr n = std::min<FlashAddr>(src.size(), pageEnd - addr);
+            std::ranges::copy(src.first(n), header.page.data.begin() + header.page.size);
+            header.page.size += n;
+            addr += n;
+            src = src.subspan(n);
+            if (addr == pageEnd)
+            {
+                if (!s->flashWrite(std::span{header.page.data}.first(header.page.size), addr - header.page.size))
+                {
+                    return false;
+                }
+                header.page.size = 0;
+            }
+        }
+        return true;
+    }
+    else
+    {
+        return s->flashWrite(src, addr);
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::flushPage(LockFs::RamHeader & header)
+{
+    if constexpr (PagedStorage<Storage>)
+    {
+        if (header.page.size > 0)
+        {
+            const FlashAddr end = header.currentBlock + Header::size + header.current.blockSize;
+            if (!s->flashWrite(std::span{header.page.data}.first(header.page.size), end - header.page.size))
+            {
+                return false;
+            }
+            header.page.size = 0;
+        }
+    }
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::compressBlock(LockFs::RamHeader & header)
+{
+    if (header.blockDone)
+    {
+        const auto next = nextReserved(header);
+        if (!next.has_value())
+        {
+            return false;
+        }
+        header.currentBlock = *next;
+    }
+    // Programmed in small chunks as it comes out of the compressor
+    const FlashAddr data = header.currentBlock + Header::size;
+    std::array<uint8_t, 32> out;
+    size_t queued = 0;
+    FlashAddr written = 0;
+    bool ok = true;
+    const auto program = [&](std::span<const uint8_t> src, FlashAddr addr)
+    {
+        ok = ok && writePages(header, src, addr);
+        if constexpr (IncrementalChecksum<Storage>)
+        {
+            s->checksumUpdate(header.checksumState, src);
+        }
+    };
+    const auto encoded = Lz::compress(
+        std::span{header.buffer}.first(header.buffered),
+        blockDataSize(),
+        [&](std::span<const uint8_t> bytes)
+        {
+            for (const uint8_t byte : bytes)
+            {
+                out[queued++] = byte;
+                if (queued == out.size())
+                {
+                    program(out, data + written);
+                    written += queued;
+                    queued = 0;
+                }
+            }
+        }
+    );
+    program(std::span{out}.first(queued), data + written);
+    written += queued;
+    instrument.count(Counter::BytesProgrammed, written);
+    // An empty block is fine (an empty file), but otherwise it must make
+    // progress
+    if (!ok || (encoded.consumed == 0 && header.buffered > 0))
+    {
+        return false;
+    }
+    // The checksum covers the erased end too
+    if constexpr (IncrementalChecksum<Storage>)
+    {
+        std::array<uint8_t, 32> erased;
+        erased.fill(0xFF);
+        for (FlashAddr end = written; end < blockDataSize(); )
+        {
+            const FlashAddr n = std::min<FlashAddr>(erased.size(), blockDataSize() - end);
+            s->checksumUpdate(header.checksumState, std::span{erased}.first(n));
+            end += n;
+        }
+    }
+    // flushPage goes by the bytes programmed, the header by those decoded
+    header.current.blockSize = static_cast<BlockSize>(written);
+    if (!flushPage(header))
+    {
+        return false;
+    }
+    header.current.blockSize = static_cast<BlockSize>(encoded.consumed);
+    if (!sealBlock(header))
+    {
+        return false;
+    }
+    std::ranges::copy(
+        std::span{header.buffer}.subspan(encoded.consumed, header.buffered - encoded.consumed),
+        header.buffer.begin()
+    );
+    header.buffered -= static_cast<FlashAddr>(encoded.consumed);
+    header.blockDone = true;
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::finishWrite(LockFs::Context & context, LockFs::RamHeader & header)
+{
+    const Traced traced{instrument, Event::FinishWrite};
+    // Commit, one header program on the start block
+    // To write:
+    // - (checksum in write)
+    // - (blockSize in write)
+    // - (tag in write)
+    // - (revision in startWrite)
+    // - flags
+    // The last block is only partially full, so write hasn't sealed it yet
+    if (header.current.compressed())
+    {
+        while (header.buffered > 0 || !header.blockDone)
+        {
+            if (!compressBlock(header))
+            {
+                return false;
+            }
+        }
+    }
+    else if (header.current.blockSize > 0 && !sealBlock(header))
+    {
+        return false;
+    }
+    auto start = readHeader(header.startBlock);
+    if (!start.has_value())
+    {
+        return false;
+    }
+    assert(start->erased() && start->revision == header.current.revision);
+    start->flags &= static_cast<uint8_t>(~(Header::ERASED_BIT | Header::CONTINUATION_BIT));
+    if (!writeHeader(*start, header.startBlock))
+    {
+        return false;
+    }
+    finished(context, header.startBlock, *start);
+    committed(context, header, *start);
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+void LockFs::LockFs<Storage, Instrument>::finished(LockFs::Context & context, FlashAddr addr, const LockFs::Header & hdr)
+{
+    // The other blocks were finished as they were sealed, and those
+    // reserved in case the data didn't compress are left for eraseStep
+    for (BlockInfo & info : context.blocks.first(blockCount()))
+    {
+        if (info.reserved && info.tag == hdr.tag && info.revision == hdr.revision)
+        {
+            info.reserved = false;
+            info.live = !info.erased();
+        }
+    }
+    context.blocks[addr / s->maxBlockSize()] = BlockInfo{
+        .blockSize  = hdr.blockSize,
+        .tag        = hdr.tag,
+        .flags      = hdr.flags,
+        .revision   = hdr.revision,
+        .eraseCount = hdr.eraseCount,
+        .position   = hdr.position,
+        .live       = true,
+    };
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+void LockFs::LockFs<Storage, Instrument>::committed(
+    LockFs::Context & context,
+    const LockFs::RamHeader & header,
+    const LockFs::Header & start
+)
+{
+    // The previous revision is now stale, or for a patch the blocks it
+    // replaced
+    const Tag tag = header.current.tag;
+    for (BlockInfo & info : context.blocks.first(blockCount()))
+    {
+        if (info.tag == tag && info.revision != start.revision)
+        {
+            info.live = false;
+        }
+    }
+    // Added by startWrite
+    RamHeader & file = *fileHeader(context, tag);
+    file = RamHeader{
+        .current = start,
+        .startBlock = header.startBlock,
+        .currentBlock = header.startBlock,
+        .size = header.size,
+    };
+    if (start.patch())
+    {
+        patchLive(context, file);
+    }
+    else
+    {
+        file.positions = static_cast<uint16_t>(std::max<FlashAddr>((header.size + blockDataSize() - 1) / blockDataSize(), 1));
+    }
+    // The previous revision may have been packed
+    packedLive(context);
+    for (Reservation & writer : context.writers)
+    {
+        if (writer.active && writer.tag == tag && writer.startBlock == header.startBlock)
+        {
+            writer.active = false;
+        }
+    }
+
+    // Only a speed up for the next loadAll, failing makes the index
+    // stale (see logIndex)
+    logIndex(context, IndexRecord{
+        .kind = IndexRecord::Kind::File,
+        .tag = tag,
+        .addr = header.startBlock,
+        .revision = start.revision,
+        .fileSize = header.size,
+    });
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::writePacked(LockFs::Context & context, Tag tag, std::span<const uint8_t> data)
+{
+    const Traced traced{instrument, Event::Write};
+    if (data.size() > packedCapacity())
+    {
+        return false;
+    }
+    // No other write to this tag (it would get the same revision)
+    for (const Reservation & writer : context.writers)
+    {
+        if (writer.active && writer.tag == tag)
+        {
+            return false;
+        }
+    }
+    RamHeader * file = addFileHeader(context, tag);
+    if (file == nullptr || !loadRest(context))
+    {
+        return false;
+    }
+    const auto revision = nextRevision(context, tag, *file, false);
+    if (!revision.has_value())
+    {
+        return false;
+    }
+    // After the last record, or in a new block if it doesn't fit
+    if (
+        context.packedBlock.has_value() &&
+        context.packedEnd + Header::size + data.size() > *context.packedBlock + s->maxBlockSize()
+    )
+    {
+        context.packedBlock.reset();
+    }
+    if (!context.packedBlock.has_value() && !openPacked(context))
+    {
+        return false;
+    }
+    const FlashAddr addr = context.packedEnd;
+    context.packedEnd += Header::size + static_cast<FlashAddr>(data.size());
+
+    // To write:
+    // - data
+    // - header (checksum, blockSize, tag, revision)
+    // - flags (commit)
+    Header record{
+        .checksum   = init<Checksum>(0xFF),
+        .blockSize  = static_cast<BlockSize>(data.size()),
+        .tag        = tag,
+        .flags      = 0xFF,
+        .revision   = *revision,
+        .eraseCount = 0,
+        .position   = 0xFFFF,
+    };
+    bool ok = data.empty() || s->flashWrite(data, addr + Header::size);
+    instrument.count(Counter::BytesProgrammed, data.size());
+    if constexpr (IncrementalChecksum<Storage>)
+    {
+        ChecksumState state = s->checksumInit();
+        s->checksumUpdate(state, data);
+        record.checksum = s->checksumFinal(state);
+    }
+    else
+    {
+        instrument.count(Counter::Checksums, 1);
+        record.checksum = s->computeChecksum(addr + Header::size, record.blockSize);
+    }
+    ok = ok && writeHeader(record, addr);
+    record.flags = static_cast<uint8_t>(~(Header::ERASED_BIT | Header::CONTINUATION_BIT | Header::PACKED_BIT));
+    ok = ok && writeHeader(record, addr);
+    // Nothing more goes after a record which may be half written, nor in
+    // a block without room for another
+    if (!ok || context.packedEnd + Header::size > *context.packedBlock + s->maxBlockSize())
+    {
+        context.packedBlock.reset();
+    }
+    if (!ok)
+    {
+        return false;
+    }
+
+    // The previous revision is now stale
+    for (BlockInfo & info : context.blocks.first(blockCount()))
+    {
+        if (info.file() && info.tag == tag)
+        {
+            info.live = false;
+        }
+    }
+    *file = RamHeader{
+        .current = record,
+        .startBlock = addr,
+        .currentBlock = addr,
+        .size = static_cast<FlashAddr>(data.size()),
+        .positions = 1,
+    };
+    packedLive(context);
+
+    // As for committed
+    logIndex(context, IndexRecord{
+        .kind = IndexRecord::Kind::File,
+        .tag = tag,
+        .addr = addr,
+        .revision = *revision,
+        .fileSize = static_cast<FlashAddr>(data.size()),
+    });
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::openPacked(LockFs::Context & context)
+{
+    // Out of space
+    if (!context.nextFreeBlock.has_value())
+    {
+        return false;
+    }
+    const WearLimit wear = wearLimit(context, 1);
+    auto addr = findFree(context, placedStart(context, 1).value_or(*context.nextFreeBlock));
+    while (addr.has_value() && !wear.take(context.blocks[*addr / s->maxBlockSize()].eraseCount))
+    {
+        addr = findFree(context, (*addr + s->maxBlockSize()) % s->size());
+    }
+    if (!addr.has_value())
+    {
+        return false;
+    }
+    // As for the start block of a write, see Context::indexedFree
+    if (context.indexedFree.has_value() && *addr != *context.indexedFree && !indexFrom(context, *addr))
+    {
+        return false;
+    }
+    if (*addr == context.indexedFree)
+    {
+        context.indexedFree.reset();
+    }
+    BlockInfo & info = context.blocks[*addr / s->maxBlockSize()];
+    const Header hdr{
+        .checksum   = init<Checksum>(0xFF),
+        .blockSize  = static_cast<BlockSize>(blockDataSize()),
+        .tag        = init<Tag>(0xFF),
+        .flags      = static_cast<uint8_t>(~(Header::ERASED_BIT | Header::PACKED_BIT)),
+        .revision   = 0xFF,
+        .eraseCount = info.eraseCount,
+        .position   = 0xFFFF,
+    };
+    if (!writeHeader(hdr, *addr))
+    {
+        return false;
+    }
+    info = BlockInfo{
+        .blockSize  = hdr.blockSize,
+        .tag        = hdr.tag,
+        .flags      = hdr.flags,
+        .revision   = hdr.revision,
+        .eraseCount = hdr.eraseCount,
+        .position   = hdr.position,
+        .live       = false,
+    };
+    markFree(context, *addr, false);
+    context.nextFreeBlock = findFree(context, (*addr + s->maxBlockSize()) % s->size());
+    context.packedBlock = *addr;
+    context.packedEnd = *addr + Header::size;
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+template<typename F>
+bool LockFs::LockFs<Storage, Instrument>::records(FlashAddr block, F && f)
+{
+    const FlashAddr end = block + s->maxBlockSize();
+    for (FlashAddr addr = block + Header::size; addr + Header::size <= end;)
+    {
+        const auto hdr = readHeader(addr);
+        if (!hdr.has_value())
+        {
+            return false;
+        }
+        // The end, or a record cut short by power loss (which is the last
+        // one, the block isn't added to after a reboot)
+        if (hdr->blank() || hdr->blockSize > end - addr - Header::size)
+        {
+            break;
+        }
+        if (!hdr->erased() && hdr->packed())
+        {
+            f(addr, *hdr);
+        }
+        addr += Header::size + hdr->blockSize;
+    }
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+void LockFs::LockFs<Storage, Instrument>::packedLive(LockFs::Context & context)
+{
+    for (BlockInfo & info : context.blocks.first(blockCount()))
+    {
+        if (info.packed())
+        {
+            info.live = false;
+        }
+    }
+    for (const RamHeader & rh : fileHeaders(context))
+    {
+        if (!rh.current.erased() && rh.current.packed())
+        {
+            context.blocks[rh.startBlock / s->maxBlockSize()].live = true;
+        }
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<bool> LockFs::LockFs<Storage, Instrument>::writeAsync(LockFs::RamHeader & header, LockFs::AsyncWrite & op)
+    requires AsyncStorage<Storage>
+{
+    // Compressing goes through write/finishWrite
+    if (header.current.compressed())
+    {
+        return false;
+    }
+    if (op.pending)
+    {
+        const auto result = s->flashPoll();
+        if (!result.has_value())
+        {
+            return {};
+        }
+        op.pending = false;
+        if (!*result)
+        {
+            return false;
+        }
+        if (op.sealing)
+        {
+            op.sealing = false;
+            header.current.blockSize = 0;
+            const auto next = nextReserved(header);
+            // We have ran out of blocks
+            if (!next.has_value())
+            {
+                return false;
+            }
+            header.currentBlock = *next;
+        }
+    }
+    if (op.data.size() == 0)
+    {
+        return true;
+    }
+    // As write, but one operation at a time
+    if (header.current.blockSize < s->maxBlockSize() - Header::size)
+    {
+        const auto begin = header.current.blockSize + Header::size;
+        const size_t toWrite = std::min<size_t>(op.data.size(), s->maxBlockSize() - begin);
+        header.current.blockSize += decltype(Header::blockSize)(toWrite);
+        const std::span src = op.data.first(toWrite);
+        op.data = op.data.subspan(toWrite);
+        if constexpr (IncrementalChecksum<Storage>)
+        {
+            s->checksumUpdate(header.checksumState, src);
+        }
+        instrument.count(Counter::BytesProgrammed, toWrite);
+        if (!s->flashWriteAsync(src, header.currentBlock + begin))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        if (!checksumBlock(header))
+        {
+            return false;
+        }
+        sealHeader(header).encode(op.buf);
+        instrument.count(Counter::HeaderWrites, 1);
+        if (!s->flashWriteAsync(op.buf, header.currentBlock))
+        {
+            return false;
+        }
+        op.sealing = true;
+    }
+    op.pending = true;
+    return {};
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<bool> LockFs::LockFs<Storage, Instrument>::finishWriteAsync(
+    LockFs::Context & context,
+    LockFs::RamHeader & header,
+    LockFs::AsyncFinish & op
+)
+    requires AsyncStorage<Storage>
+{
+    using Stage = AsyncFinish::Stage;
+    // Compressing goes through write/finishWrite
+    if (header.current.compressed())
+    {
+        return false;
+    }
+    if (op.pending)
+    {
+        const auto result = s->flashPoll();
+        if (!result.has_value())
+        {
+            return {};
+        }
+        op.pending = false;
+        if (!*result)
+        {
+            return false;
+        }
+        switch (op.stage)
+        {
+        case Stage::Seal:
+            header.current.blockSize = 0;
+            op.stage = Stage::Start;
+            break;
+        case Stage::Start:
+            finished(context, op.addr, op.hdr);
+            committed(context, header, op.hdr);
+            return true;
+        }
+    }
+    const auto submit = [&](const Header & hdr, FlashAddr addr) -> std::optional<bool>
+    {
+        op.hdr = hdr;
+        op.addr = addr;
+        op.hdr.encode(op.buf);
+        instrument.count(Counter::HeaderWrites, 1);
+        if (!s->flashWriteAsync(op.buf, addr))
+        {
+            return false;
+        }
+        op.pending = true;
+        return {};
+    };
+    // As finishWrite, but one operation at a time
+    if (op.stage == Stage::Seal)
+    {
+        // The last block is only partially full, so write hasn't sealed it yet
+        if (header.current.blockSize > 0)
+        {
+            if (!checksumBlock(header))
+            {
+                return false;
+            }
+            return submit(sealHeader(header), header.currentBlock);
+        }
+        op.stage = Stage::Start;
+    }
+    auto start = readHeader(header.startBlock);
+    if (!start.has_value())
+    {
+        return false;
+    }
+    assert(start->erased() && start->revision == header.current.revision);
+    start->flags &= static_cast<uint8_t>(~(Header::ERASED_BIT | Header::CONTINUATION_BIT));
+    return submit(*start, header.startBlock);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::Reader>
+LockFs::LockFs<Storage, Instrument>::openRead(
+    const LockFs::Context & context,
+    const LockFs::RamHeader & file,
+    std::span<uint8_t> buffer
+) const
+{
+    if (
+        file.current.erased() ||
+        context.blocks.size() < blockCount() ||
+        (file.current.compressed() && buffer.empty())
+    )
+    {
+        return {};
+    }
+    Reader reader{
+        .blocks = context.blocks,
+        .tag = file.current.tag,
+        .revision = file.current.revision,
+        .currentBlock = file.startBlock,
+        .offset = 0,
+        .remaining = file.size,
+        .position = 0,
+        .patch = file.current.patch(),
+        .compressed = file.current.compressed(),
+        .buffer = buffer,
+        .decodedBlock = s->size(),
+    };
+    // A packed file's data follows its record, part way into the block
+    if (file.current.packed())
+    {
+        reader.currentBlock = file.startBlock - file.startBlock % s->maxBlockSize();
+        reader.offset = file.startBlock % s->maxBlockSize();
+    }
+    // A patch may start with a kept block
+    if (reader.patch)
+    {
+        const auto first = positionBlock(context.blocks, file.startBlock, file.current.tag, 0);
+        if (!first.has_value())
+        {
+            return {};
+        }
+        reader.currentBlock = *first;
+    }
+    return reader;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::read(LockFs::Reader & reader, std::span<uint8_t> dest)
+{
+    FlashAddr done = 0;
+    [[maybe_unused]] std::array<ReadRequest<FlashAddr>, headerBatch> requests;
+    [[maybe_unused]] size_t queued = 0;
+    const auto flush = [&]()
+    {
+        if constexpr (VectoredStorage<Storage>)
+        {
+            const bool ok = queued == 0 || s->flashReadv(std::span{requests}.first(queued));
+            queued = 0;
+            return ok;
+        }
+        return true;
+    };
+    while (done < dest.size() && reader.remaining > 0)
+    {
+        if (!advance(reader))
+        {
+            return {};
+        }
+        const BlockInfo & info = reader.blocks[reader.currentBlock / s->maxBlockSize()];
+        const FlashAddr len = std::min<FlashAddr>({
+            static_cast<FlashAddr>(dest.size() - done),
+            info.blockSize - reader.offset,
+            reader.remaining,
+        });
+        const FlashAddr addr = reader.currentBlock + Header::size + reader.offset;
+        if (reader.compressed)
+        {
+            if (reader.decodedBlock != reader.currentBlock && !decodeBlock(reader))
+            {
+                return {};
+            }
+            std::ranges::copy(reader.buffer.subspan(reader.offset, len), dest.begin() + done);
+        }
+        else if constexpr (VectoredStorage<Storage>)
+        {
+            requests[queued++] = {.addr = addr, .dest = dest.subspan(done, len)};
+            if (queued == requests.size() && !flush())
+            {
+                return {};
+            }
+        }
+        else if (!s->flashRead(addr, dest.subspan(done, len)))
+        {
+            return {};
+        }
+        reader.offset += len;
+        reader.remaining -= len;
+        done += len;
+    }
+    if (!flush())
+    {
+        return {};
+    }
+    return done;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<std::span<const uint8_t>> LockFs::LockFs<Storage, Instrument>::map(LockFs::Reader & reader)
+    requires MappedStorage<Storage>
+{
+    if (reader.compressed)
+    {
+        return {};
+    }
+    if (reader.remaining == 0)
+    {
+        return std::span<const uint8_t>{};
+    }
+    if (!advance(reader))
+    {
+        return {};
+    }
+    const BlockInfo & info = reader.blocks[reader.currentBlock / s->maxBlockSize()];
+    const FlashAddr len = std::min<FlashAddr>(info.blockSize - reader.offset, reader.remaining);
+    const auto view = s->flashMap(reader.currentBlock + Header::size + reader.offset, len);
+    if (view.size() != len)
+    {
+        return {};
+    }
+    reader.offset += len;
+    reader.remaining -= len;
+    return view;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<std::span<const uint8_t>> LockFs::LockFs<Storage, Instrument>::mapFile(
+    const LockFs::Context & context,
+    const LockFs::RamHeader & file
+) requires MappedStorage<Storage>
+{
+    auto reader = openRead(context, file);
+    if (!reader.has_value())
+    {
+        return {};
+    }
+    const auto view = map(*reader);
+    if (!view.has_value() || reader->remaining > 0)
+    {
+        return {};
+    }
+    return view;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::advance(LockFs::Reader & reader) const
+{
+    while (reader.offset >= reader.blocks[reader.currentBlock / s->maxBlockSize()].blockSize)
+    {
+        const auto next = reader.patch ?
+            positionBlock(reader.blocks, reader.currentBlock, reader.tag, reader.position + 1) :
+            nextBlock(reader.blocks, reader.currentBlock, reader.tag, reader.revision);
+        // Summaries don't add up to the file size
+        if (!next.has_value())
+        {
+            return false;
+        }
+        reader.currentBlock = *next;
+        reader.offset = 0;
+        ++reader.position;
+    }
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::decodeBlock(LockFs::Reader & reader)
+{
+    const BlockInfo & info = reader.blocks[reader.currentBlock / s->maxBlockSize()];
+    if (info.blockSize > reader.buffer.size())
+    {
+        return false;
+    }
+    // Reading ahead in small chunks, the block only has to be read as
+    // far as it was programmed
+    IndexStream in{
+        .s = *s,
+        .addr = reader.currentBlock + Header::size,
+        .end = reader.currentBlock + s->maxBlockSize(),
+    };
+    const bool ok = Lz::decompress(
+        [&](uint8_t & byte)
+        {
+            in.load(byte);
+            return in.ok;
+        },
+        reader.buffer.first(info.blockSize)
+    );
+    reader.decodedBlock = ok ? reader.currentBlock : s->size();
+    return ok;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::nextBlock(
+    std::span<const BlockInfo> blocks,
+    FlashAddr block,
+    Tag tag,
+    uint8_t revision
+) const
+{
+    for (
+        FlashAddr addr = (block + s->maxBlockSize()) % s->size();
+        addr != block;
+        addr = (addr + s->maxBlockSize()) % s->size()
+    )
+    {
+        const BlockInfo & info = blocks[addr / s->maxBlockSize()];
+        if (info.file() && info.tag == tag && info.revision == revision)
+        {
+            return addr;
+        }
+    }
+    return {};
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::positionBlock(
+    std::span<const BlockInfo> blocks,
+    FlashAddr from,
+    Tag tag,
+    uint16_t position
+) const
+{
+    // Kept blocks are mostly in order, so usually the next one along
+    FlashAddr addr = from;
+    do
+    {
+        const BlockInfo & info = blocks[addr / s->maxBlockSize()];
+        if (info.live && info.tag == tag && info.position == position)
+        {
+            return addr;
+        }
+        addr = (addr + s->maxBlockSize()) % s->size();
+    } while (addr != from);
+    return {};
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+typename LockFs::LockFs<Storage, Instrument>::FlashAddr
+LockFs::LockFs<Storage, Instrument>::indexSize(size_t files, size_t bad) const
+{
+    // Tag table (and its length, the rest of the start headers are read
+    // at mount), bad blocks (and how many) and a CRC-16
+    return
+        2 * sizeof(FlashAddr) +
+        files * (sizeof(Tag) + 2 * sizeof(FlashAddr) + sizeof(uint8_t)) +
+        bad * sizeof(FlashAddr) +
+        sizeof(uint16_t);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::writeIndex(LockFs::Context & context)
+{
+    if constexpr (!IndexedStorage<Storage>)
+    {
+        return true;
+    }
+    else
+    {
+        size_t files = 0;
+        size_t bad = 0;
+        for (const RamHeader & rh : fileHeaders(context))
+        {
+            files += !rh.current.erased();
+        }
+        for (const BlockInfo & info : context.blocks.first(blockCount()))
+        {
+            bad += info.bad();
+        }
+        // Its size goes in the header's blockSize, all ones is blank.
+        // Room for at least the record after it.
+        const FlashAddr size = indexSize(files, bad);
+        if (
+            Header::size + size + IndexRecord::size > indexSpan() * s->maxBlockSize() ||
+            static_cast<uint64_t>(size) >= static_cast<uint64_t>(init<BlockSize>(0xFF)) ||
+            !indexErasable()
+        )
+        {
+            return false;
+        }
+        const auto indexBlocks = s->indexBlocks();
+        const FlashAddr addr = context.indexBlock == indexBlocks[0] ? indexBlocks[1] : indexBlocks[0];
+        const uint8_t revision = context.indexBlock.has_value() ? context.indexRevision + 1 : 0;
+        // All of its blocks, records are added until it is full
+        for (FlashAddr i = 0; i < indexSpan(); ++i)
+        {
+            if (!s->flashErase(addr + i * s->maxBlockSize()))
+            {
+                return false;
+            }
+        }
+        // The index has its own wear (counted in its first block, the
+        // others have no header)
+        const uint32_t eraseCount = ++context.blocks[addr / s->maxBlockSize()].eraseCount;
+
+        // To write:
+        // - tag table, bad blocks and the first record
+        // - header (blockSize, revision)
+        // - flags (commit)
+        IndexStream stream{
+            .s = *s,
+            .addr = addr + Header::size,
+            .end = addr + Header::size + size + IndexRecord::size,
+            .check = true,
+        };
+        stream.store(static_cast<FlashAddr>(files));
+        for (const RamHeader & rh : fileHeaders(context))
+        {
+            if (!rh.current.erased())
+            {
+                stream.store(rh.current.tag);
+                stream.store(rh.startBlock);
+                stream.store(rh.current.revision);
+                stream.store(rh.size);
+            }
+        }
+        stream.store(static_cast<FlashAddr>(bad));
+        for (FlashAddr i = 0; i < blockCount(); ++i)
+        {
+            if (context.blocks[i].bad())
+            {
+                stream.store(i * s->maxBlockSize());
+            }
+        }
+        const uint16_t crc = stream.crc;
+        stream.store(crc);
+        stream.storeRecord(IndexRecord{
+            .kind = IndexRecord::Kind::Moved,
+            .nextFree = context.nextFreeBlock,
+            .packedEnd = context.packedBlock.has_value() ? std::optional{context.packedEnd} : std::nullopt,
+        });
+        if (!stream.flush())
+        {
+            return false;
+        }
+        Header hdr{
+            .checksum   = init<Checksum>(0xFF),
+            .blockSize  = static_cast<BlockSize>(size),
+            .tag        = init<Tag>(0xFF),
+            .flags      = 0xFF,
+            .revision   = revision,
+            .eraseCount = eraseCount,
+            .position   = 0xFFFF,
+        };
+        if (!writeHeader(hdr, addr))
+        {
+            return false;
+        }
+        hdr.flags = static_cast<uint8_t>(~(Header::ERASED_BIT | Header::INDEX_BIT));
+        if (!writeHeader(hdr, addr))
+        {
+            return false;
+        }
+        context.indexBlock = addr;
+        context.indexRevision = revision;
+        context.indexEnd = addr + Header::size + size + IndexRecord::size;
+        context.indexedFree = context.nextFreeBlock;
+        return true;
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::loadIndex(LockFs::Context & context)
+{
+    if constexpr (!IndexedStorage<Storage>)
+    {
+        return false;
+    }
+    else
+    {
+        if (!indexErasable())
+        {
+            return false;
+        }
+        // Find the newest committed index
+        const auto indexBlocks = s->indexBlocks();
+        std::array<Header, 2> hdrs;
+        if (!readHeaders(indexBlocks, hdrs))
+        {
+            return false;
+        }
+        std::optional<size_t> newest{};
+        for (size_t i = 0; i < hdrs.size(); ++i)
+        {
+            if (
+                !hdrs[i].erased() &&
+                hdrs[i].index() &&
+                (!newest.has_value() || hdrs[i].newerThan(hdrs[*newest]))
+            )
+            {
+                newest = i;
+            }
+        }
+        if (!newest.has_value())
+        {
+            context.indexBlock.reset();
+            return false;
+        }
+        const FlashAddr addr = indexBlocks[*newest];
+        const Header & hdr = hdrs[*newest];
+        const FlashAddr end = addr + indexSpan() * s->maxBlockSize();
+        context.indexBlock = addr;
+        context.indexRevision = hdr.revision;
+        context.indexEnd.reset();
+        context.indexedFree.reset();
+        if (hdr.tag != init<Tag>(0xFF) || Header::size + hdr.blockSize + IndexRecord::size > end - addr)
+        {
+            return false;
+        }
+
+        // Nothing known of the other blocks but what the index says,
+        // until their headers are read
+        for (FlashAddr i = 0; i < blockCount(); ++i)
+        {
+            const FlashAddr block = i * s->maxBlockSize();
+            context.blocks[i] = BlockInfo{
+                .blockSize  = 0,
+                .tag        = init<Tag>(0xFF),
+                .flags      = 0xFF,
+                .revision   = 0xFF,
+                .eraseCount = 0,
+                .position   = 0xFFFF,
+                .live       = false,
+                .unread     = true,
+            };
+            if (isIndexBlock(block))
+            {
+                // As scan has them
+                const size_t copy = block - indexBlocks[0] < indexSpan() * s->maxBlockSize() ? 0 : 1;
+                context.blocks[i] = BlockInfo{
+                    .blockSize  = 0,
+                    .tag        = init<Tag>(0xFF),
+                    .flags      = static_cast<uint8_t>(~(Header::ERASED_BIT | Header::INDEX_BIT)),
+                    .revision   = 0xFF,
+                    .eraseCount = isIndexStart(block) ? hdrs[copy].eraseCount : 0,
+                    .position   = 0xFFFF,
+                    .live       = false,
+                };
+            }
+        }
+        context.headerCount = 0;
+        for (RamHeader & rh : fileHeaders(context))
+        {
+            rh.current.flags = Header::ERASED_BIT;
+        }
+        // Tag table, checked as it is read. Each file's header is filled
+        // in from its start block once the whole index checks out.
+        const auto valid = [&](FlashAddr block)
+        {
+            return block < s->size() && block % s->maxBlockSize() == 0 && !isIndexBlock(block);
+        };
+        IndexStream stream{.s = *s, .addr = addr + Header::size, .end = end, .check = true};
+        FlashAddr files;
+        stream.load(files);
+        for (FlashAddr i = 0; i < files && stream.ok; ++i)
+        {
+            RamHeader file{};
+            stream.load(file.current.tag);
+            stream.load(file.startBlock);
+            stream.load(file.current.revision);
+            stream.load(file.size);
+            // For a different context
+            RamHeader * rh = addFileHeader(context, file.current.tag);
+            if (rh == nullptr)
+            {
+                return false;
+            }
+            file.current.flags = 0;
+            *rh = file;
+        }
+        FlashAddr bad;
+        stream.load(bad);
+        for (FlashAddr i = 0; i < bad && stream.ok; ++i)
+        {
+            FlashAddr block;
+            stream.load(block);
+            if (!valid(block))
+            {
+                return false;
+            }
+            context.blocks[block / s->maxBlockSize()].flags &= static_cast<uint8_t>(~Header::BAD_BIT);
+        }
+        const uint16_t expected = stream.crc;
+        uint16_t crc;
+        stream.load(crc);
+        if (!stream.ok || crc != expected || hdr.blockSize != indexSize(files, bad))
+        {
+            return false;
+        }
+
+        // Then the records, up to the first blank one. One that doesn't
+        // check out was cut short, nothing more goes after it.
+        std::optional<IndexRecord> last{};
+        std::optional<FlashAddr> logEnd{};
+        for (FlashAddr at = addr + Header::size + hdr.blockSize; at + IndexRecord::size <= end; at += IndexRecord::size)
+        {
+            IndexRecord record;
+            const bool ok = stream.loadRecord(record);
+            if (stream.blank)
+            {
+                logEnd = at;
+                break;
+            }
+            if (!ok)
+            {
+                break;
+            }
+            if (record.kind == IndexRecord::Kind::File)
+            {
+                RamHeader * rh = addFileHeader(context, record.tag);
+                if (rh == nullptr)
+                {
+                    return false;
+                }
+                *rh = RamHeader{
+                    .current = {.tag = record.tag, .flags = 0, .revision = record.revision},
+                    .startBlock = record.addr,
+                    .size = record.fileSize,
+                };
+            }
+            else if (record.kind == IndexRecord::Kind::Bad && valid(record.addr))
+            {
+                context.blocks[record.addr / s->maxBlockSize()].flags &= static_cast<uint8_t>(~Header::BAD_BIT);
+            }
+            else if (record.kind != IndexRecord::Kind::Moved)
+            {
+                return false;
+            }
+            last = record;
+        }
+        if (!stream.ok || !last.has_value())
+        {
+            return false;
+        }
+
+        // Stale, as any write since would have started at the next free
+        // block. Without one (full), the eraser may have made room for
+        // writes since, and we can't tell where they started.
+        if (!last->nextFree.has_value() || !valid(*last->nextFree))
+        {
+            return false;
+        }
+        const FlashAddr nextFree = *last->nextFree;
+        std::array<Header, 1> next;
+        if (!loadBlocks(context, std::span{&nextFree, 1}, next) || !next[0].blank())
+        {
+            return false;
+        }
+        // Likewise a file packed since, which went after the last record
+        if (last->packedEnd.has_value())
+        {
+            const auto record = readHeader(*last->packedEnd);
+            if (!record.has_value() || !record->blank())
+            {
+                return false;
+            }
+        }
+        bool patches = false;
+        for (RamHeader & rh : fileHeaders(context))
+        {
+            if (!rh.current.erased())
+            {
+                if (!loadFile(context, rh))
+                {
+                    return false;
+                }
+                patches = patches || rh.current.patch();
+            }
+        }
+        context.partial = true;
+        // Patches keep blocks of older revisions, which lock finds from
+        // the summaries
+        if (patches && !loadRest(context))
+        {
+            return false;
+        }
+        context.nextFreeBlock = nextFree;
+        context.indexEnd = logEnd;
+        context.indexedFree = nextFree;
+        return true;
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+template<typename T>
+void LockFs::LockFs<Storage, Instrument>::IndexStream::load(T & out)
+{
+    std::array<uint8_t, sizeof(T)> bytes{};
+    for (uint8_t & byte : bytes)
+    {
+        if (pos == len)
+        {
+            pos = 0;
+            len = std::min<FlashAddr>(buf.size(), end - addr);
+            ok = ok && len > 0 && s.flashRead(addr, std::span{buf}.first(len));
+            addr += len;
+        }
+        if (!ok)
+        {
+            return;
+        }
+        byte = buf[pos++];
+        if (check)
+        {
+            update(byte);
+        }
+    }
+    out = EL::load<T>(bytes);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+template<typename T>
+void LockFs::LockFs<Storage, Instrument>::IndexStream::store(T value)
+{
+    std::array<uint8_t, sizeof(T)> bytes;
+    EL::store<T>(bytes, value);
+    for (const uint8_t byte : bytes)
+    {
+        if (len == buf.size() && !flush())
+        {
+            return;
+        }
+        buf[len++] = byte;
+        if (check)
+        {
+            update(byte);
+        }
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::IndexStream::flush()
+{
+    if (ok && len > 0)
+    {
+        ok = s.flashWrite(std::span{buf}.first(len), addr);
+        addr += len;
+        len = 0;
+    }
+    return ok;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+void LockFs::LockFs<Storage, Instrument>::IndexStream::update(uint8_t byte)
+{
+    // CRC-16/CCITT a bit at a time, the index is small (unlike a
+    // Fletcher sum it tells 0x00 from 0xFF)
+    blank = blank && byte == 0xFF;
+    crc ^= static_cast<uint16_t>(byte << 8);
+    for (int i = 0; i < 8; ++i)
+    {
+        crc = static_cast<uint16_t>(crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1);
+    }
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::IndexStream::loadRecord(LockFs::IndexRecord & record)
+{
+    crc = 0xFFFF;
+    blank = true;
+    uint8_t kind;
+    uint8_t hasNextFree;
+    FlashAddr nextFree;
+    uint8_t hasPacked;
+    FlashAddr packedEnd;
+    load(kind);
+    load(record.tag);
+    load(record.addr);
+    load(record.revision);
+    load(record.fileSize);
+    load(hasNextFree);
+    load(nextFree);
+    load(hasPacked);
+    load(packedEnd);
+    const uint16_t expected = crc;
+    uint16_t stored;
+    load(stored);
+    record.kind = static_cast<typename IndexRecord::Kind>(kind);
+    record.nextFree = hasNextFree ? std::optional{nextFree} : std::nullopt;
+    record.packedEnd = hasPacked ? std::optional{packedEnd} : std::nullopt;
+    return ok && stored == expected;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+void LockFs::LockFs<Storage, Instrument>::IndexStream::storeRecord(const LockFs::IndexRecord & record)
+{
+    crc = 0xFFFF;
+    store(static_cast<uint8_t>(record.kind));
+    store(record.tag);
+    store(record.addr);
+    store(record.revision);
+    store(record.fileSize);
+    store(static_cast<uint8_t>(record.nextFree.has_value()));
+    store(record.nextFree.value_or(0));
+    store(static_cast<uint8_t>(record.packedEnd.has_value()));
+    store(record.packedEnd.value_or(0));
+    const uint16_t sum = crc;
+    store(sum);
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+template<typename Expired>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::eraseStep(
+    LockFs::Context & context,
+    LockFs::Eraser & eraser,
+    FlashAddr maxBlocks,
+    Expired && expired
+)
+{
+    if (!loadRest(context))
+    {
+        return {};
+    }
+    FlashAddr blank = 0;
+    for (FlashAddr i = 0; i < blockCount(); ++i)
+    {
+        if (context.blocks[i].blank() && !isIndexBlock(i * s->maxBlockSize()))
+        {
+            ++blank;
+        }
+    }
+    FlashAddr erased = 0;
+    // With BatchStorage, a batch of blocks at a time
+    constexpr FlashAddr batchSize = BatchStorage<Storage> ? headerBatch : 1;
+    std::array<FlashAddr, batchSize> batch;
+    std::array<Header, batchSize> counts;
+    FlashAddr checked = 0;
+    while (checked < blockCount() && erased < maxBlocks && blank < eraser.pool && !expired())
+    {
+        const FlashAddr want = std::min({batchSize, maxBlocks - erased, eraser.pool - blank});
+        size_t n = 0;
+        // A sector of several blocks, erased after the batch
+        std::optional<Extent> sector{};
+        for (; checked < blockCount() && n < want && !sector.has_value(); ++checked)
+        {
+            const FlashAddr addr = eraser.nextBlock;
+            eraser.nextBlock = (eraser.nextBlock + s->maxBlockSize()) % s->size();
+            const Extent in = sectorOf(addr);
+            if (in.count > 1)
+            {
+                if (addr != in.first)
+                {
+                    continue;
+                }
+                // Erased if it has nothing in use and isn't all blank
+                // already
+                bool stale = false;
+                bool inUse = false;
+                for (FlashAddr j = 0; j < in.count && !inUse; ++j)
+                {
+                    const FlashAddr block = in.first + j * s->maxBlockSize();
+                    const bool isBlank = context.blocks[block / s->maxBlockSize()].blank();
+                    stale |= !isBlank;
+                    inUse = !isBlank && !erasable(context, block);
+                }
+                if (stale && !inUse)
+                {
+                    sector = in;
+                }
+                continue;
+            }
+            if (!erasable(context, addr))
+            {
+                continue;
+            }
+            batch[n] = addr;
+            counts[n++] = Header::erasedBlock(context.blocks[addr / s->maxBlockSize()].eraseCount + 1);
+        }
+        // Lost if the power goes between erasing and writing the erase
+        // counts, then they start again from 0
+        if (!eraseBlocks(std::span{batch}.first(n)) || !writeHeaders(std::span{batch}.first(n), counts))
+        {
+            return {};
+        }
+        for (size_t i = 0; i < n; ++i)
+        {
+            context.blocks[batch[i] / s->maxBlockSize()] = BlockInfo::erasedBlock(counts[i].eraseCount);
+            markFree(context, batch[i], true);
+            context.nextFreeBlock = context.nextFreeBlock.value_or(batch[i]);
+        }
+        erased += n;
+        blank += n;
+        if constexpr (SectoredStorage<Storage>)
+        {
+            if (sector.has_value())
+            {
+                const auto reclaimed = eraseSector(context, *sector);
+                if (!reclaimed.has_value())
+                {
+                    return {};
+                }
+                erased += *reclaimed;
+                blank += *reclaimed;
+            }
+        }
+    }
+    return erased;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+bool LockFs::LockFs<Storage, Instrument>::erasable(const LockFs::Context & context, FlashAddr addr) const
+{
+    const BlockInfo & info = context.blocks[addr / s->maxBlockSize()];
+    return !(
+        info.blank() || info.live || info.locked || info.reserved || info.bad() || info.unread ||
+        isIndexBlock(addr) || addr == context.packedBlock
+    );
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::eraseSector(LockFs::Context & context, LockFs::Extent sector)
+    requires SectoredStorage<Storage>
+{
+    if (!s->flashEraseSector(sector.first, sector.count * s->maxBlockSize()))
+    {
+        return {};
+    }
+    // Every block's erase count, blank ones included (they were erased
+    // too), as many at a time as writeHeaders takes
+    FlashAddr reclaimed = 0;
+    std::array<FlashAddr, headerBatch> addrs;
+    std::array<Header, headerBatch> counts;
+    for (FlashAddr done = 0; done < sector.count;)
+    {
+        const size_t n = std::min<FlashAddr>(headerBatch, sector.count - done);
+        for (size_t j = 0; j < n; ++j)
+        {
+            addrs[j] = sector.first + (done + j) * s->maxBlockSize();
+            const BlockInfo & info = context.blocks[addrs[j] / s->maxBlockSize()];
+            reclaimed += !info.blank();
+            counts[j] = Header::erasedBlock(info.eraseCount + 1);
+        }
+        if (!writeHeaders(std::span{addrs}.first(n), std::span{counts}.first(n)))
+        {
+            return {};
+        }
+        for (size_t j = 0; j < n; ++j)
+        {
+            context.blocks[addrs[j] / s->maxBlockSize()] = BlockInfo::erasedBlock(counts[j].eraseCount);
+            markFree(context, addrs[j], true);
+            context.nextFreeBlock = context.nextFreeBlock.value_or(addrs[j]);
+        }
+        done += n;
+    }
+    return reclaimed;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+std::optional<bool> LockFs::LockFs<Storage, Instrument>::eraseAsync(
+    LockFs::Context & context,
+    LockFs::Eraser & eraser,
+    LockFs::AsyncErase & op
+)
+    requires AsyncStorage<Storage>
+{
+    if (op.pending)
+    {
+        const auto result = s->flashPoll();
+        if (!result.has_value())
+        {
+            return {};
+        }
+        op.pending = false;
+        if (!*result)
+        {
+            return false;
+        }
+        BlockInfo & info = context.blocks[op.block / s->maxBlockSize()];
+        if (!op.recording)
+        {
+            // Erased, now record the erase count as eraseStep does
+            info = BlockInfo::erasedBlock(info.eraseCount + 1);
+            Header::erasedBlock(info.eraseCount).encode(op.buf);
+            instrument.count(Counter::HeaderWrites, 1);
+            if (!s->flashWriteAsync(op.buf, op.block))
+            {
+                return false;
+            }
+            op.recording = true;
+            op.pending = true;
+            return {};
+        }
+        op.recording = false;
+        markFree(context, op.block, true);
+        context.nextFreeBlock = context.nextFreeBlock.value_or(op.block);
+        op.checked = 0;
+    }
+    // As eraseStep, but one block at a time
+    if (!loadRest(context))
+    {
+        return false;
+    }
+    FlashAddr blank = 0;
+    for (FlashAddr i = 0; i < blockCount(); ++i)
+    {
+        if (context.blocks[i].blank() && !isIndexBlock(i * s->maxBlockSize()))
+        {
+            ++blank;
+        }
+    }
+    for (; op.checked < blockCount() && blank < eraser.pool; ++op.checked)
+    {
+        const FlashAddr addr = eraser.nextBlock;
+        eraser.nextBlock = (eraser.nextBlock + s->maxBlockSize()) % s->size();
+        if (!erasable(context, addr) || sectorOf(addr).count > 1)
+        {
+            continue;
+        }
+        if (!s->flashEraseAsync(addr))
+        {
+            return false;
+        }
+        op.block = addr;
+        op.pending = true;
+        return {};
+    }
+    op.checked = 0;
+    return true;
+}
+
+template<LockFs::Storage Storage, LockFs::Instrumentation Instrument>
+template<typename Expired>
+std::optional<typename LockFs::LockFs<Storage, Instrument>::FlashAddr>
+LockFs::LockFs<Storage, Instrument>::scrubStep(
+    LockFs::Context & context,
+    LockFs::Scrubber & scrubber,
+    FlashAddr maxBlocks,
+    Expired && expired
+)
+{
+    if (!loadRest(context))
+    {
+        return {};
+    }
+    FlashAddr bad = 0;
+    FlashAddr verified = 0;
+    // At most once round per step, even if there is little to verify
+    for (FlashAddr checked = 0; checked < blockCount() && verified < maxBlocks && !expired(); ++checked)
+    {
+        const FlashAddr addr = scrubber.nextBlock;
+        scrubber.nextBlock = (scrubber.nextBlock + s->maxBlockSize()) % s->size();
+        if (scrubber.nextBlock == 0)
+        {
+            ++scrubber.passes;
+        }
+        BlockInfo & info = context.blocks[addr / s->maxBlockSize()];
+        // Blocks of files, and packed blocks
+        if (info.erased() || info.index() || info.bad() || isIndexBlock(addr))
+        {
+            continue;
+        }
+        // The checksum isn't in the summaries
+        const auto hdr = readHeader(addr);
+        if (!hdr.has_value())
+        {
+            return {};
+        }
+        ++verified;
+        bool ok = true;
+        if (info.packed())
+        {
+            // Each record has a checksum over its file
+            const bool read = records(addr, [&](FlashAddr record, const Header & file)
+            {
+                instrument.count(Counter::Checksums, 1);
+                ok = ok && s->verifyChecksum(record + Header::size, file.blockSize, file.checksum);
+            });
+            if (!read)
+            {
+                return {};
+            }
+        }
+        else
+        {
+            // See checksumBlock. The start block of an empty file is
+            // never sealed, so has nothing to verify.
+            const BlockSize covered = hdr->compressed() ? static_cast<BlockSize>(blockDataSize()) : hdr->blockSize;
+            if (covered > blockDataSize())
+            {
+                continue;
+            }
+            instrument.count(Counter::Checksums, 1);
+            ok = s->verifyChecksum(addr + Header::size, covered, hdr->checksum);
+        }
+        if (ok)
+        {
+            continue;
+        }
+        // Recorded in its header, so later mounts know without verifying
+        // it again. If the flash enforces locks, a locked block's header
+        // can't be programmed until reboot, so that is left to the index.
+        Header marked = *hdr;
+        marked.flags &= static_cast<uint8_t>(~Header::BAD_BIT);
+        if (!writeHeader(marked, addr) && !info.locked)
+        {
+            return {};
+        }
+        info.flags &= static_cast<uint8_t>(~Header::BAD_BIT);
+        markBad(context, addr);
+        ++bad;
+        // An index without the mark would have later mounts reuse the
+        // block
+        if (!logIndex(context, IndexRecord{.kind = IndexRecord::Kind::Bad, .addr = addr}))
+        {
+            return {};
+        }
+    }
+    return bad;
 }
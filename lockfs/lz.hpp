@@ -0,0 +1,240 @@
+/**
+
+# LockFS block compression
+
+A small LZ77 codec (the LZ4 block format, without its end of block
+rules) used for the blocks of compressed files. Each block is compressed
+on its own, matches only referring back within it, so it decodes
+without the others.
+
+A block is a run of sequences: a token (the number of literals in the
+high nibble, the match length less 4 in the low one, 15 meaning more
+length bytes follow, added up until one is below 255), the literals, then
+the match as a little endian 16 bit offset back. Decoding stops once the
+expected size is out, so the last sequence needn't have a match.
+
+*/
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace LockFs::Lz
+{
+
+constexpr size_t minMatch = 4;
+
+// Length bytes after the token for a count
+constexpr size_t extraBytes(size_t count)
+{
+    return count < 15 ? 0 : (count - 15) / 255 + 1;
+}
+
+// Most literals a sequence of its own can hold in capacity bytes
+constexpr size_t literalCapacity(size_t capacity)
+{
+    size_t count = capacity > 0 ? capacity - 1 : 0;
+    while (count > 0 && 1 + extraBytes(count) + count > capacity)
+    {
+        --count;
+    }
+    return count;
+}
+
+// Input compress always takes (if there is that much), however badly the
+// data compresses: the sequences with matches never cost more than their
+// input, bar their length bytes
+constexpr size_t minConsumed(size_t capacity)
+{
+    return capacity > 16 ? capacity - capacity / 128 - 8 : 0;
+}
+
+struct Encoded
+{
+    size_t consumed;
+    size_t produced;
+};
+
+// Compresses as much of src as fits in capacity bytes (src at most
+// 64KiB), handing the output to put(std::span<const uint8_t>) in order
+template<size_t HashBits = 9, typename Put>
+Encoded compress(std::span<const uint8_t> src, size_t capacity, Put && put)
+{
+    constexpr uint16_t none = 0xFFFF;
+    std::array<uint16_t, size_t{1} << HashBits> table;
+    table.fill(none);
+    const auto load = [&](size_t i)
+    {
+        return
+            uint32_t{src[i]} | uint32_t{src[i + 1]} << 8 |
+            uint32_t{src[i + 2]} << 16 | uint32_t{src[i + 3]} << 24;
+    };
+    const auto putLength = [&](size_t count)
+    {
+        if (count < 15)
+        {
+            return;
+        }
+        for (count -= 15; count >= 255; count -= 255)
+        {
+            const uint8_t more = 255;
+            put(std::span{&more, 1});
+        }
+        const uint8_t last = static_cast<uint8_t>(count);
+        put(std::span{&last, 1});
+    };
+
+    size_t anchor = 0;
+    size_t produced = 0;
+    // Literals from anchor then (if match > 0) the match, if it fits
+    const auto emit = [&](size_t literals, size_t match, size_t offset)
+    {
+        const size_t size =
+            1 + extraBytes(literals) + literals +
+            (match > 0 ? 2 + extraBytes(match - minMatch) : 0);
+        if (produced + size > capacity)
+        {
+            return false;
+        }
+        const uint8_t token = static_cast<uint8_t>(
+            std::min<size_t>(literals, 15) << 4 |
+            (match > 0 ? std::min<size_t>(match - minMatch, 15) : 0)
+        );
+        put(std::span{&token, 1});
+        putLength(literals);
+        put(src.subspan(anchor, literals));
+        if (match > 0)
+        {
+            const std::array<uint8_t, 2> back{static_cast<uint8_t>(offset), static_cast<uint8_t>(offset >> 8)};
+            put(std::span{back});
+            putLength(match - minMatch);
+        }
+        produced += size;
+        return true;
+    };
+
+    size_t pos = 0;
+    // Stopping once the literals so far couldn't fit anyway
+    while (pos + minMatch <= src.size() && pos - anchor < capacity - produced)
+    {
+        const uint32_t word = load(pos);
+        const size_t hash = (word * 2654435761u) >> (32 - HashBits);
+        const uint16_t candidate = table[hash];
+        table[hash] = static_cast<uint16_t>(pos);
+        if (candidate == none || load(candidate) != word)
+        {
+            ++pos;
+            continue;
+        }
+        size_t match = minMatch;
+        while (pos + match < src.size() && src[candidate + match] == src[pos + match])
+        {
+            ++match;
+        }
+        if (!emit(pos - anchor, match, pos - candidate))
+        {
+            break;
+        }
+        pos += match;
+        anchor = pos;
+    }
+    // The rest (or as much as fits) as literals
+    const size_t literals = std::min(src.size() - anchor, literalCapacity(capacity - produced));
+    if (literals > 0)
+    {
+        emit(literals, 0, 0);
+        anchor += literals;
+    }
+    return Encoded{.consumed = anchor, .produced = produced};
+}
+
+// Decodes until dest is full, taking the input a byte at a time from
+// get(uint8_t &), which returns false once there is no more. Returns
+// false if the input is corrupt or runs out.
+template<typename Get>
+    requires std::invocable<Get &, uint8_t &>
+bool decompress(Get && get, std::span<uint8_t> dest)
+{
+    const auto getLength = [&](size_t & count)
+    {
+        if (count < 15)
+        {
+            return true;
+        }
+        uint8_t more;
+        do
+        {
+            if (!get(more))
+            {
+                return false;
+            }
+            count += more;
+        } while (more == 255);
+        return true;
+    };
+
+    size_t out = 0;
+    while (out < dest.size())
+    {
+        uint8_t token;
+        size_t literals;
+        if (!get(token) || !getLength(literals = token >> 4) || literals > dest.size() - out)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < literals; ++i)
+        {
+            if (!get(dest[out++]))
+            {
+                return false;
+            }
+        }
+        if (out == dest.size())
+        {
+            break;
+        }
+        uint8_t low;
+        uint8_t high;
+        size_t match;
+        if (!get(low) || !get(high) || !getLength(match = token & 0x0F))
+        {
+            return false;
+        }
+        match += minMatch;
+        const size_t offset = low | size_t{high} << 8;
+        if (offset == 0 || offset > out || match > dest.size() - out)
+        {
+            return false;
+        }
+        // Byte by byte, the match may overlap what it is copying
+        for (size_t i = 0; i < match; ++i, ++out)
+        {
+            dest[out] = dest[out - offset];
+        }
+    }
+    return true;
+}
+
+// As above, from a buffer
+inline bool decompress(std::span<const uint8_t> src, std::span<uint8_t> dest)
+{
+    size_t in = 0;
+    return decompress(
+        [&](uint8_t & byte)
+        {
+            if (in == src.size())
+            {
+                return false;
+            }
+            byte = src[in++];
+            return true;
+        },
+        dest
+    );
+}
+
+};
@@ -0,0 +1,261 @@
+/**
+
+# LockFS striped storage
+
+`StripedStorage` presents several identical chips (e.g. NOR flash on
+separate SPI buses) as one `Storage`, with block `i` on chip `i % N`.
+It is an `InterleavedStorage`, so LockFs takes each block of a file from
+the chip after the one its previous block is on, skipping free blocks on
+other chips as long as enough are left for the rest of the file. When
+they aren't (or for a `longLived` file) it falls back to the next free
+block, which can put two of a file's blocks on the same chip.
+
+Batches (header reads at mount, file reads, finishing and erasing blocks)
+are split up by chip, and the parts handed to a `Dispatch` which may run
+them at the same time. The default, `Sequential`, runs them one after the
+other; give it something that starts each part on its own bus (DMA, a
+worker thread) and waits for them all to get them in parallel.
+
+*/
+#pragma once
+
+#include "flash_interface.hpp"
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace LockFs
+{
+
+// Runs job(0) .. job(count - 1), returning once they are all done
+struct Sequential
+{
+    template<typename Job>
+    void operator()(size_t count, Job && job)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            job(i);
+        }
+    }
+};
+
+template<Storage Chip, size_t N, typename Dispatch = Sequential>
+struct StripedStorage
+{
+    using FlashAddr = Chip::FlashAddr;
+    using BlockSize = Chip::BlockSize;
+    using Checksum = Chip::Checksum;
+    using Tag = TagOf<Chip>::type;
+
+    // Requests handed to a chip at once
+    static constexpr size_t batch = 16;
+
+    std::array<Chip *, N> chips;
+    [[no_unique_address]] Dispatch dispatch{};
+
+    constexpr BlockSize maxBlockSize() const { return chips[0]->maxBlockSize(); }
+    constexpr FlashAddr size() const { return static_cast<FlashAddr>(N * chips[0]->size()); }
+    static constexpr FlashAddr pageSize() requires PagedStorage<Chip> { return Chip::pageSize(); }
+    static constexpr size_t stripes() { return N; }
+
+    // Chip of the address
+    constexpr size_t chip(FlashAddr addr) const
+    {
+        return (addr / maxBlockSize()) % N;
+    }
+
+    // Address on its chip
+    constexpr FlashAddr local(FlashAddr addr) const
+    {
+        const FlashAddr block = addr / maxBlockSize();
+        return (block / N) * maxBlockSize() + addr % maxBlockSize();
+    }
+
+    // Accesses don't cross blocks, so they stay on one chip
+    constexpr bool inBlock(FlashAddr addr, size_t size) const
+    {
+        return size == 0 || addr / maxBlockSize() == (addr + size - 1) / maxBlockSize();
+    }
+
+    bool flashRead(FlashAddr addr, std::span<uint8_t> dest)
+    {
+        assert(inBlock(addr, dest.size()));
+        return chips[chip(addr)]->flashRead(local(addr), dest);
+    }
+
+    bool flashWrite(std::span<const uint8_t> src, FlashAddr addr)
+    {
+        assert(inBlock(addr, src.size()));
+        return chips[chip(addr)]->flashWrite(src, local(addr));
+    }
+
+    bool flashErase(FlashAddr block)
+    {
+        return chips[chip(block)]->flashErase(local(block));
+    }
+
+    bool flashLock(FlashAddr addr, Tag tag)
+    {
+        return chips[chip(addr)]->flashLock(local(addr), tag);
+    }
+
+    bool flashLockFreeze()
+    {
+        bool ok = true;
+        for (Chip * c : chips)
+        {
+            ok = c->flashLockFreeze() && ok;
+        }
+        return ok;
+    }
+
+    Checksum computeChecksum(FlashAddr addr, BlockSize blockSize)
+    {
+        assert(inBlock(addr, blockSize));
+        return chips[chip(addr)]->computeChecksum(local(addr), blockSize);
+    }
+
+    bool verifyChecksum(FlashAddr addr, BlockSize blockSize, Checksum expected)
+    {
+        assert(inBlock(addr, blockSize));
+        return chips[chip(addr)]->verifyChecksum(local(addr), blockSize, expected);
+    }
+
+    std::span<const uint8_t> flashMap(FlashAddr addr, FlashAddr size) requires MappedStorage<Chip>
+    {
+        assert(inBlock(addr, size));
+        return chips[chip(addr)]->flashMap(local(addr), size);
+    }
+
+    // Each chip does its part of the batch, at the same time if the
+    // dispatch allows
+    bool flashReadv(std::span<const ReadRequest<FlashAddr>> requests)
+    {
+        return perChip(requests, [](Chip & c, std::span<const ReadRequest<FlashAddr>> part)
+        {
+            if constexpr (VectoredStorage<Chip>)
+            {
+                return c.flashReadv(part);
+            }
+            else
+            {
+                for (const auto & request : part)
+                {
+                    if (!c.flashRead(request.addr, request.dest))
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            }
+        });
+    }
+
+    bool flashWritev(std::span<const WriteRequest<FlashAddr>> requests)
+    {
+        return perChip(requests, [](Chip & c, std::span<const WriteRequest<FlashAddr>> part)
+        {
+            if constexpr (BatchStorage<Chip>)
+            {
+                return c.flashWritev(part);
+            }
+            else
+            {
+                for (const auto & request : part)
+                {
+                    if (!c.flashWrite(request.src, request.addr))
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            }
+        });
+    }
+
+    bool flashErasev(std::span<const FlashAddr> blocks)
+    {
+        return perChip(blocks, [](Chip & c, std::span<const FlashAddr> part)
+        {
+            if constexpr (BatchStorage<Chip>)
+            {
+                return c.flashErasev(part);
+            }
+            else
+            {
+                for (const FlashAddr block : part)
+                {
+                    if (!c.flashErase(block))
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            }
+        });
+    }
+
+    // Address of a request, and the same request on its chip
+    constexpr FlashAddr address(const ReadRequest<FlashAddr> & request) const { return request.addr; }
+    constexpr FlashAddr address(const WriteRequest<FlashAddr> & request) const { return request.addr; }
+    constexpr FlashAddr address(FlashAddr block) const { return block; }
+    ReadRequest<FlashAddr> onChip(const ReadRequest<FlashAddr> & request) const
+    {
+        assert(inBlock(request.addr, request.dest.size()));
+        return {.addr = local(request.addr), .dest = request.dest};
+    }
+    WriteRequest<FlashAddr> onChip(const WriteRequest<FlashAddr> & request) const
+    {
+        assert(inBlock(request.addr, request.src.size()));
+        return {.addr = local(request.addr), .src = request.src};
+    }
+    FlashAddr onChip(FlashAddr block) const
+    {
+        return local(block);
+    }
+
+    // Splits the requests up by chip (in parts of up to batch), and runs
+    // do(chip, part) for each chip through the dispatch
+    template<typename Request, typename Do>
+    bool perChip(std::span<const Request> requests, Do && doPart)
+    {
+        std::array<bool, N> ok;
+        dispatch(N, [&](size_t i)
+        {
+            std::array<Request, batch> part;
+            size_t n = 0;
+            ok[i] = true;
+            for (const Request & request : requests)
+            {
+                if (chip(address(request)) != i)
+                {
+                    continue;
+                }
+                part[n++] = onChip(request);
+                if (n == part.size())
+                {
+                    ok[i] = ok[i] && doPart(*chips[i], std::span<const Request>{part});
+                    n = 0;
+                }
+            }
+            if (n > 0)
+            {
+                ok[i] = ok[i] && doPart(*chips[i], std::span<const Request>{part}.first(n));
+            }
+        });
+        for (const bool chipOk : ok)
+        {
+            if (!chipOk)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+};
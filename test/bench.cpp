@@ -0,0 +1,956 @@
+#include "lockfs/lockfs.hpp"
+#include "lockfs/striped.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Costs in microseconds, the defaults modelled on a typical 3V SPI NOR
+// (W25Q-class, single SPI at 50MHz, 256 byte pages, 4KiB sectors)
+struct CostModel
+{
+    // Command, address and dummy cycles of a read
+    double readSetup = 1.0;
+    double readByte = 0.16;
+    // Each (partial) page programmed, plus clocking the bytes in
+    double pageProgram = 700;
+    double programByte = 0.16;
+    double sectorErase = 45000;
+    // Erase of a 64 KiB block (parts erasing 4 KiB sub-sectors too)
+    double blockErase = 150000;
+    // Write of the protection (status) register, or a block lock
+    double lockWrite = 10000;
+};
+
+struct Counters
+{
+    size_t reads = 0;
+    size_t bytesRead = 0;
+    size_t programs = 0;
+    size_t bytesProgrammed = 0;
+    size_t erases = 0;
+    double us = 0;
+};
+
+// In-RAM flash charging the cost model for each operation. Optionally
+// advertises its page size and index blocks to LockFs, and has bigger
+// blocks (e.g. 64 KiB sectors).
+template<bool Paged, bool Indexed = false, uint32_t BlockBytes = 4096>
+struct CostStorage
+{
+    using FlashAddr = uint32_t;
+    using BlockSize = std::conditional_t<(BlockBytes > 0xFFFF), uint32_t, uint16_t>;
+    using Checksum = uint8_t;
+    static constexpr FlashAddr page = 256;
+    static constexpr BlockSize maxBlockSize() { return BlockBytes; }
+    static constexpr FlashAddr pageSize() requires Paged { return page; }
+    FlashAddr size() const { return bytes; }
+    // Two copies at the end, with room for a 256 file tag table and a few
+    // hundred records after it
+    FlashAddr indexSpan() const requires Indexed
+    {
+        return ((8 << 10) + maxBlockSize() - 1) / maxBlockSize();
+    }
+    std::array<FlashAddr, 2> indexBlocks() const requires Indexed
+    {
+        return {size() - 2 * indexSpan() * maxBlockSize(), size() - indexSpan() * maxBlockSize()};
+    }
+
+    FlashAddr bytes;
+    CostModel cost{};
+    std::vector<uint8_t> backing = std::vector<uint8_t>(bytes, 0xFF);
+    Counters counters{};
+
+    bool flashRead(FlashAddr address, std::span<uint8_t> dest)
+    {
+        ++counters.reads;
+        counters.bytesRead += dest.size();
+        counters.us += cost.readSetup + cost.readByte * dest.size();
+        std::copy_n(backing.begin() + address, dest.size(), dest.begin());
+        return true;
+    }
+
+    bool flashWrite(std::span<const uint8_t> src, FlashAddr address)
+    {
+        const size_t pages = (address + src.size() + page - 1) / page - address / page;
+        counters.programs += pages;
+        counters.bytesProgrammed += src.size();
+        counters.us += cost.pageProgram * pages + cost.programByte * src.size();
+        std::transform(src.begin(), src.end(), backing.begin() + address, backing.begin() + address, std::bit_and{});
+        return true;
+    }
+
+    bool flashErase(FlashAddr block)
+    {
+        ++counters.erases;
+        counters.us += cost.sectorErase;
+        std::fill_n(backing.begin() + block, maxBlockSize(), 0xFF);
+        return true;
+    }
+
+    bool flashLock(FlashAddr address, uint8_t tag) { return true; }
+    bool flashLockFreeze() { return true; }
+
+    Checksum computeChecksum(FlashAddr addr, BlockSize blockSize)
+    {
+        ++counters.reads;
+        counters.bytesRead += blockSize;
+        counters.us += cost.readSetup + cost.readByte * blockSize;
+        return std::accumulate(backing.begin() + addr, backing.begin() + addr + blockSize, 0);
+    }
+
+    bool verifyChecksum(FlashAddr addr, BlockSize blockSize, Checksum expected)
+    {
+        return computeChecksum(addr, blockSize) == expected;
+    }
+};
+
+static_assert(!LockFs::PagedStorage<CostStorage<false>>);
+static_assert(LockFs::PagedStorage<CostStorage<true>>);
+static_assert(LockFs::IndexedStorage<CostStorage<true, true>>);
+static_assert(LockFs::SpannedIndexStorage<CostStorage<true, true>>);
+
+// Locking a block at a time
+struct BlockLockStorage : CostStorage<true>
+{
+    size_t lockWrites = 0;
+
+    bool flashLock(FlashAddr address, uint8_t tag)
+    {
+        ++lockWrites;
+        counters.us += cost.lockWrite;
+        return true;
+    }
+};
+
+// Locking ranges of blocks
+template<LockFs::LockFrom From, uint32_t Unit, uint32_t MaxRanges>
+struct RangeLockStorage : CostStorage<true>
+{
+    static constexpr LockFs::LockGranularity lockGranularity()
+    {
+        return {.from = From, .unit = Unit, .maxRanges = MaxRanges};
+    }
+
+    size_t lockWrites = 0;
+
+    bool flashLockRange(FlashAddr address, FlashAddr size)
+    {
+        ++lockWrites;
+        counters.us += cost.lockWrite;
+        return true;
+    }
+};
+
+static_assert(LockFs::RangeLockStorage<RangeLockStorage<LockFs::LockFrom::Top, 16, 1>>);
+
+// 16 MiB erased 4 KiB at a time in the first 2 MiB (say the part's boot
+// sectors) and 64 KiB at a time after
+struct MixedSectorStorage : CostStorage<true>
+{
+    static constexpr auto sectors()
+    {
+        return std::array{
+            LockFs::Sectors<FlashAddr>{.size = 2 << 20, .eraseSize = 4 << 10},
+            LockFs::Sectors<FlashAddr>{.size = 14 << 20, .eraseSize = 64 << 10},
+        };
+    }
+
+    bool flashEraseSector(FlashAddr address, FlashAddr size)
+    {
+        ++counters.erases;
+        counters.us += cost.blockErase;
+        std::fill_n(backing.begin() + address, size, 0xFF);
+        return true;
+    }
+};
+
+static_assert(LockFs::SectoredStorage<MixedSectorStorage>);
+
+// 16 MiB of 64 KiB sectors, but in 4 KiB blocks so small files don't take
+// a sector each
+struct SmallBlockSectorStorage : CostStorage<true>
+{
+    static constexpr auto sectors()
+    {
+        return std::array{LockFs::Sectors<FlashAddr>{.size = 16 << 20, .eraseSize = 64 << 10}};
+    }
+
+    bool flashEraseSector(FlashAddr address, FlashAddr size)
+    {
+        ++counters.erases;
+        counters.us += cost.blockErase;
+        std::fill_n(backing.begin() + address, size, 0xFF);
+        return true;
+    }
+};
+
+// Mounted file system over a CostStorage, with room for every tag
+template<bool Paged, bool Indexed>
+struct Mounted
+{
+    using Storage = CostStorage<Paged, Indexed>;
+    using Fs = LockFs::LockFs<Storage>;
+
+    Storage & storage;
+    Fs fs{.s = &storage};
+    std::array<typename Fs::RamHeader, 256> headers{};
+    std::vector<typename Fs::BlockInfo> blocks = std::vector<typename Fs::BlockInfo>(fs.blockCount());
+    std::array<typename Fs::Reservation, 1> writers{};
+    std::vector<uint32_t> freeMap = std::vector<uint32_t>(fs.freeMapWords());
+    typename Fs::Context ctx{.headers = headers, .blocks = blocks, .writers = writers, .freeMap = freeMap};
+
+    bool writeFile(uint8_t tag, std::span<const uint8_t> data, size_t chunk, double & finishUs)
+    {
+        auto rh = fs.startWrite(ctx, tag, data.size());
+        if (!rh.has_value())
+        {
+            return false;
+        }
+        for (size_t i = 0; i < data.size(); i += chunk)
+        {
+            if (!fs.write(*rh, data.subspan(i, std::min(chunk, data.size() - i))))
+            {
+                return false;
+            }
+        }
+        const double before = storage.counters.us;
+        const bool ok = fs.finishWrite(ctx, *rh);
+        finishUs = storage.counters.us - before;
+        return ok;
+    }
+};
+
+// Fills the given percentage of the flash with files of 1/32 of its size
+// (written a page at a time), then reboots and mounts it
+template<bool Indexed>
+void fillAndMount(uint32_t mebibytes, uint32_t fill)
+{
+    using Storage = CostStorage<true, Indexed>;
+    Storage storage{.bytes = mebibytes << 20};
+    std::vector<uint8_t> data(storage.size() / 32);
+    std::iota(data.begin(), data.end(), 0);
+
+    Counters writing{};
+    double finishUs = 0;
+    size_t files = 0;
+    {
+        Mounted<true, Indexed> mounted{.storage = storage};
+        if (!mounted.fs.loadAll(mounted.ctx))
+        {
+            std::printf("loadAll failed\n");
+            return;
+        }
+        storage.counters = {};
+        for (; files < fill * 32 / 100; ++files)
+        {
+            double us;
+            if (!mounted.writeFile(uint8_t(files), data, Storage::page, us))
+            {
+                std::printf("write failed\n");
+                return;
+            }
+            finishUs += us;
+        }
+        writing = storage.counters;
+    }
+
+    storage.counters = {};
+    Mounted<true, Indexed> mounted{.storage = storage};
+    const bool ok = mounted.fs.loadAll(mounted.ctx);
+    const Counters & mount = storage.counters;
+    std::printf(
+        "%5u MiB %4u%% %-7s | %9.2f ms %7zu reads %9zu B | %8.1f KiB/s %8.2f ms%s\n",
+        mebibytes, fill, Indexed ? "indexed" : "scan",
+        mount.us / 1000, mount.reads, mount.bytesRead,
+        files ? files * data.size() / 1024.0 / (writing.us / 1e6) : 0.0,
+        files ? finishUs / files / 1000 : 0.0,
+        ok ? "" : " (mount failed)"
+    );
+}
+
+// Streams a file in small chunks (e.g. USB packets)
+template<bool Paged>
+void streamChunks(size_t fileSize, size_t chunk)
+{
+    CostStorage<Paged> storage{.bytes = 1 << 20};
+    Mounted<Paged, false> mounted{.storage = storage};
+    if (!mounted.fs.loadAll(mounted.ctx))
+    {
+        std::printf("loadAll failed\n");
+        return;
+    }
+    std::vector<uint8_t> data(fileSize);
+    std::iota(data.begin(), data.end(), 0);
+    storage.counters = {};
+    double finishUs;
+    const bool ok = mounted.writeFile(1, data, chunk, finishUs);
+    std::printf(
+        "%-10s %7zu B in %4zu B chunks: %6zu programs, %9.1f ms%s\n",
+        Paged ? "paged" : "unbuffered", fileSize, chunk, storage.counters.programs,
+        storage.counters.us / 1000, ok ? "" : " (failed)"
+    );
+}
+
+// Updates files of different sizes at different rates (a small one every
+// cycle, larger ones every few), over a quarter of the flash holding files
+// which never change. Erases the stale blocks after every update and
+// reboots every so often, then reports the spread of erase counts.
+void wearCycles(bool levelWear, size_t cycles)
+{
+    using Storage = CostStorage<true>;
+    Storage storage{.bytes = 1 << 20};
+    Mounted<true, false> mounted{.storage = storage};
+    mounted.fs.levelWear = levelWear;
+    if (!mounted.fs.loadAll(mounted.ctx))
+    {
+        std::printf("loadAll failed\n");
+        return;
+    }
+    constexpr size_t dataSize = Storage::maxBlockSize() - Mounted<true, false>::Fs::Header::size;
+    std::vector<uint8_t> data(16 * dataSize);
+    std::iota(data.begin(), data.end(), 0);
+    double us;
+    for (uint8_t tag = 0; tag < 4; ++tag)
+    {
+        if (!mounted.writeFile(tag, std::span{data}, Storage::page, us))
+        {
+            std::printf("write failed\n");
+            return;
+        }
+    }
+
+    // Tag, size in blocks, and updated every this many cycles
+    constexpr std::array<std::array<size_t, 3>, 3> dynamic{{{10, 1, 1}, {11, 4, 8}, {12, 16, 64}}};
+    std::minstd_rand rng{1};
+    typename Mounted<true, false>::Fs::Eraser eraser{.pool = mounted.fs.blockCount()};
+    for (size_t cycle = 0; cycle < cycles; ++cycle)
+    {
+        for (const auto & [tag, blocks, every] : dynamic)
+        {
+            if (cycle % every != 0)
+            {
+                continue;
+            }
+            // Not quite filling the last block
+            const size_t size = blocks * dataSize - rng() % (dataSize / 2);
+            if (!mounted.writeFile(uint8_t(tag), std::span{data}.first(size), Storage::page, us))
+            {
+                std::printf("write failed at cycle %zu\n", cycle);
+                return;
+            }
+        }
+        if (!mounted.fs.eraseStep(mounted.ctx, eraser, mounted.fs.blockCount()).has_value())
+        {
+            std::printf("erase failed at cycle %zu\n", cycle);
+            return;
+        }
+        if (cycle % 1000 == 999 && !mounted.fs.loadAll(mounted.ctx))
+        {
+            std::printf("loadAll failed at cycle %zu\n", cycle);
+            return;
+        }
+    }
+
+    const auto wear = mounted.fs.wear(mounted.ctx);
+    const double mean = double(wear.total) / wear.blocks;
+    std::printf(
+        "%-10s %7zu cycles: %8u max %10.1f mean %6.2f max/mean %8u min (%zu erases)\n",
+        levelWear ? "levelled" : "next free", cycles, wear.max, mean, wear.max / mean, wear.min,
+        storage.counters.erases
+    );
+}
+
+// Updates a 64 block file with some blocks changed, by rewriting it or
+// patching just those blocks
+void patchUpdate(size_t changedBlocks, bool patch)
+{
+    using Storage = CostStorage<true>;
+    Storage storage{.bytes = 1 << 20};
+    Mounted<true, false> mounted{.storage = storage};
+    auto & fs = mounted.fs;
+    if (!fs.loadAll(mounted.ctx))
+    {
+        std::printf("loadAll failed\n");
+        return;
+    }
+    const size_t dataSize = fs.blockDataSize();
+    std::vector<uint8_t> data(64 * dataSize - dataSize / 2);
+    std::iota(data.begin(), data.end(), 0);
+    double us;
+    if (!mounted.writeFile(1, data, Storage::page, us))
+    {
+        std::printf("write failed\n");
+        return;
+    }
+
+    // Spread out, not the last block (always written)
+    std::vector<uint16_t> changed;
+    for (size_t i = 0; i < changedBlocks; ++i)
+    {
+        changed.push_back(uint16_t(i * 63 / changedBlocks));
+        data[changed.back() * dataSize] ^= 0xFF;
+    }
+    storage.counters = {};
+    const size_t free = fs.freeCount(mounted.ctx);
+    bool ok;
+    if (patch)
+    {
+        auto rh = fs.startPatch(mounted.ctx, mounted.headers[1], data.size(), changed);
+        ok = rh.has_value();
+        for (size_t position = 0; ok && position * dataSize < data.size(); ++position)
+        {
+            const bool last = (position + 1) * dataSize >= data.size();
+            if (last || std::ranges::binary_search(changed, position))
+            {
+                const auto block = std::span{data}.subspan(position * dataSize);
+                ok = fs.write(*rh, block.first(std::min(dataSize, block.size())));
+            }
+        }
+        ok = ok && fs.finishWrite(mounted.ctx, *rh);
+    }
+    else
+    {
+        ok = mounted.writeFile(1, data, data.size(), us);
+    }
+    std::printf(
+        "%2zu of 64 blocks changed, %-7s: %8.1f KiB programmed %6zu programs %3zu blocks used %9.1f ms%s\n",
+        changedBlocks, patch ? "patch" : "rewrite", storage.counters.bytesProgrammed / 1024.0,
+        storage.counters.programs, free - fs.freeCount(mounted.ctx), storage.counters.us / 1000,
+        ok ? "" : " (failed)"
+    );
+}
+
+// Scrubs a flash half full of files, a block per step, reporting the
+// longest step and the whole pass against the mount
+void scrubPass(uint32_t mebibytes)
+{
+    using Storage = CostStorage<true>;
+    Storage storage{.bytes = mebibytes << 20};
+    Mounted<true, false> mounted{.storage = storage};
+    auto & fs = mounted.fs;
+    std::vector<uint8_t> data(storage.size() / 32);
+    std::iota(data.begin(), data.end(), 0);
+    bool ok = fs.loadAll(mounted.ctx);
+    for (uint8_t tag = 0; ok && tag < 16; ++tag)
+    {
+        double us;
+        ok = mounted.writeFile(tag, data, data.size(), us);
+    }
+    storage.counters = {};
+    ok = ok && fs.loadAll(mounted.ctx);
+    const double mountUs = storage.counters.us;
+
+    typename Mounted<true, false>::Fs::Scrubber scrubber{};
+    double longest = 0;
+    size_t steps = 0;
+    storage.counters = {};
+    while (ok && scrubber.passes == 0)
+    {
+        const double before = storage.counters.us;
+        ok = fs.scrubStep(mounted.ctx, scrubber, 1) == 0;
+        longest = std::max(longest, storage.counters.us - before);
+        ++steps;
+    }
+    std::printf(
+        "%5u MiB, 50%% full: %6zu steps, longest %6.2f ms, pass %9.1f ms (mount %7.2f ms)%s\n",
+        mebibytes, steps, longest / 1000, storage.counters.us / 1000, mountUs / 1000, ok ? "" : " (failed)"
+    );
+}
+
+// Writes four 64 block firmware images (two of them again half way
+// through) among a dozen small files updated at random, then reboots and
+// reports the lock writes mounting it takes, and the blocks they lock,
+// failing if a file can't be written after
+template<typename Storage>
+void lockAtMount(const char * kind, bool placed)
+{
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage{{.bytes = 16 << 20}};
+    Fs fs{.s = &storage};
+    if (placed)
+    {
+        fs.longLived = [](uint8_t tag) { return tag < 4; };
+    }
+    std::array<typename Fs::RamHeader, 256> headers{};
+    std::vector<typename Fs::BlockInfo> blocks(fs.blockCount());
+    std::array<typename Fs::Reservation, 1> writers{};
+    std::vector<uint32_t> freeMap(fs.freeMapWords());
+    typename Fs::Context ctx{.headers = headers, .blocks = blocks, .writers = writers, .freeMap = freeMap};
+    std::vector<uint8_t> data(64 * fs.blockDataSize());
+    std::iota(data.begin(), data.end(), 0);
+    const auto write = [&](uint8_t tag, size_t size)
+    {
+        auto rh = fs.startWrite(ctx, tag, size);
+        return rh.has_value() && fs.write(*rh, std::span{data}.first(size)) && fs.finishWrite(ctx, *rh);
+    };
+
+    bool ok = fs.loadAll(ctx);
+    typename Fs::Eraser eraser{.pool = fs.blockCount()};
+    std::minstd_rand rng{1};
+    for (size_t cycle = 0; ok && cycle < 200; ++cycle)
+    {
+        for (uint8_t tag = 0; tag < (cycle == 0 ? 4 : cycle == 100 ? 2 : 0); ++tag)
+        {
+            ok = ok && write(tag, data.size());
+        }
+        for (uint8_t tag = 10; tag < 22; ++tag)
+        {
+            if (rng() % 4 == 0)
+            {
+                ok = ok && write(tag, (1 + tag % 8) * fs.blockDataSize() - 1);
+            }
+        }
+        ok = ok && fs.eraseStep(ctx, eraser, fs.blockCount()).has_value();
+    }
+
+    storage.lockWrites = 0;
+    ok = ok && fs.loadAll(ctx);
+    size_t live = 0;
+    size_t locked = 0;
+    for (const auto & info : blocks)
+    {
+        live += info.live;
+        locked += info.locked;
+    }
+    // Still writable after mounting
+    ok = ok && write(30, fs.blockDataSize());
+    std::printf(
+        "%-28s %-9s | %4zu lock writes %8.1f ms | %5zu blocks locked, %4zu live%s\n",
+        kind, placed ? "placed" : "next free", storage.lockWrites,
+        storage.lockWrites * storage.cost.lockWrite / 1000, locked, live, ok ? "" : " (failed)"
+    );
+}
+
+// Keeps 200 small files (1 to 4 KiB, like config blobs) on 16 MiB of
+// 64 KiB sectors, written as files of their own or packed, and updates
+// them (half the updates to ten of them) with a reboot every 50 updates,
+// erasing in the background. Reboots have to be that often unpacked, the
+// sectors of files updated since are locked until then. Reports the flash the files took once all
+// written, and the erases and simulated time the updates took.
+void smallFiles(bool packed, size_t updates)
+{
+    using Storage = CostStorage<true, false, 64 << 10>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage{.bytes = 16 << 20};
+    Fs fs{.s = &storage};
+    std::array<Fs::RamHeader, 256> headers{};
+    std::vector<Fs::BlockInfo> blocks(fs.blockCount());
+    std::array<Fs::Reservation, 1> writers{};
+    std::vector<uint32_t> freeMap(fs.freeMapWords());
+    Fs::Context ctx{.headers = headers, .blocks = blocks, .writers = writers, .freeMap = freeMap};
+    std::minstd_rand rng{1};
+    std::array<size_t, 200> sizes;
+    std::ranges::generate(sizes, [&]() { return 1024 + rng() % (3 * 1024 + 1); });
+    std::vector<uint8_t> data(4 * 1024);
+    std::iota(data.begin(), data.end(), 0);
+    Fs::Eraser eraser{.pool = 8};
+    const auto write = [&](uint8_t tag)
+    {
+        const auto file = std::span{data}.first(sizes[tag]);
+        if (packed)
+        {
+            return fs.writePacked(ctx, tag, file);
+        }
+        auto rh = fs.startWrite(ctx, tag, file.size());
+        return rh.has_value() && fs.write(*rh, file) && fs.finishWrite(ctx, *rh);
+    };
+    // Erasing in the background, and in the foreground if out of space
+    const auto update = [&](uint8_t tag)
+    {
+        if (!write(tag) && !(fs.eraseStep(ctx, eraser, fs.blockCount()).has_value() && write(tag)))
+        {
+            return false;
+        }
+        return fs.eraseStep(ctx, eraser, 1).has_value();
+    };
+
+    bool ok = fs.loadAll(ctx);
+    for (uint8_t tag = 0; ok && tag < sizes.size(); ++tag)
+    {
+        ok = update(tag);
+    }
+    const size_t used = std::ranges::count_if(blocks, [](const Fs::BlockInfo & info) { return info.live; });
+    const size_t bytes = std::accumulate(sizes.begin(), sizes.end(), size_t{0});
+    storage.counters = {};
+    for (size_t i = 0; ok && i < updates; ++i)
+    {
+        const size_t tag = rng() % 2 ? rng() % 10 : rng() % sizes.size();
+        ok = update(uint8_t(tag));
+        if (i % 50 == 49)
+        {
+            ok = ok && fs.loadAll(ctx);
+        }
+    }
+    std::printf(
+        "%-8s | %4zu KiB in %3zu sectors (%5.1f%% used) | %6zu erases (%6.1f per 1000 updates) %7.2f ms per update%s\n",
+        packed ? "packed" : "unpacked", bytes / 1024, used, 100.0 * bytes / (used * Storage::maxBlockSize()),
+        storage.counters.erases, 1000.0 * storage.counters.erases / updates,
+        storage.counters.us / updates / 1000, ok ? "" : " (failed)"
+    );
+}
+
+// Keeps 100 small files (1 to 4 KiB) and 4 images (480 KiB) on 16 MiB,
+// updating them (one update in 20 to an image) with a reboot every 50
+// updates, erasing in the background. Reports the flash the files took
+// once all written, and the erases and simulated time the updates took,
+// also relative to baseline's if given. Returns the updates' counters.
+template<typename Storage>
+Counters mixedSectors(const char * kind, Storage storage, size_t updates, const Counters * baseline = nullptr)
+{
+    using Fs = LockFs::LockFs<Storage>;
+    Fs fs{.s = &storage};
+    std::array<typename Fs::RamHeader, 256> headers{};
+    std::vector<typename Fs::BlockInfo> blocks(fs.blockCount());
+    std::array<typename Fs::Reservation, 1> writers{};
+    std::vector<uint32_t> freeMap(fs.freeMapWords());
+    typename Fs::Context ctx{.headers = headers, .blocks = blocks, .writers = writers, .freeMap = freeMap};
+    std::minstd_rand rng{1};
+    std::array<size_t, 104> sizes;
+    std::ranges::generate(sizes, [&]() { return 1024 + rng() % (3 * 1024 + 1); });
+    std::fill(sizes.end() - 4, sizes.end(), 480 << 10);
+    std::vector<uint8_t> data(480 << 10);
+    std::iota(data.begin(), data.end(), 0);
+    // 2 MiB blank
+    typename Fs::Eraser eraser{.pool = (2 << 20) / Storage::maxBlockSize()};
+    const auto write = [&](uint8_t tag)
+    {
+        const auto file = std::span{data}.first(sizes[tag]);
+        auto rh = fs.startWrite(ctx, tag, file.size());
+        return rh.has_value() && fs.write(*rh, file) && fs.finishWrite(ctx, *rh);
+    };
+    const auto update = [&](uint8_t tag)
+    {
+        if (!write(tag) && !(fs.eraseStep(ctx, eraser, fs.blockCount()).has_value() && write(tag)))
+        {
+            return false;
+        }
+        return fs.eraseStep(ctx, eraser, 1).has_value();
+    };
+
+    bool ok = fs.loadAll(ctx);
+    for (uint8_t tag = 0; ok && tag < sizes.size(); ++tag)
+    {
+        ok = update(tag);
+    }
+    const size_t used = std::ranges::count_if(blocks, [](const auto & info) { return info.live; });
+    storage.counters = {};
+    for (size_t i = 0; ok && i < updates; ++i)
+    {
+        const size_t tag = rng() % 20 == 0 ? sizes.size() - 1 - rng() % 4 : rng() % (sizes.size() - 4);
+        ok = update(uint8_t(tag));
+        if (i % 50 == 49)
+        {
+            ok = ok && fs.loadAll(ctx);
+        }
+    }
+    std::printf(
+        "%-32s | %5zu KiB used | %6zu erases (%6.1f per 1000 updates) %7.2f ms per update",
+        kind, used * Storage::maxBlockSize() / 1024,
+        storage.counters.erases, 1000.0 * storage.counters.erases / updates,
+        storage.counters.us / updates / 1000
+    );
+    if (baseline != nullptr)
+    {
+        const double time = storage.counters.us / baseline->us;
+        std::printf(
+            " | %4.2fx erases, %4.2fx time%s",
+            double(storage.counters.erases) / baseline->erases, time, time > 1 ? " (slower)" : ""
+        );
+    }
+    std::printf("%s\n", ok ? "" : " (failed)");
+    return storage.counters;
+}
+
+// Writes a file in one go, reporting what finishWrite costs and how many
+// headers the whole write programmed
+void commitFile(size_t fileSize)
+{
+    using Storage = CostStorage<true>;
+    Storage storage{.bytes = 16 << 20};
+    Mounted<true, false> mounted{.storage = storage};
+    auto & fs = mounted.fs;
+    if (!fs.loadAll(mounted.ctx))
+    {
+        std::printf("loadAll failed\n");
+        return;
+    }
+    std::vector<uint8_t> data(fileSize);
+    std::iota(data.begin(), data.end(), 0);
+    storage.counters = {};
+    auto rh = fs.startWrite(mounted.ctx, 1, data.size());
+    bool ok = rh.has_value() && fs.write(*rh, data);
+    const Counters before = storage.counters;
+    ok = ok && fs.finishWrite(mounted.ctx, *rh);
+    const Counters & after = storage.counters;
+    // Everything programmed but the data is headers
+    const size_t headers = (after.bytesProgrammed - data.size()) / Mounted<true, false>::Fs::Header::size;
+    std::printf(
+        "%5zu KiB, %4zu blocks: finishWrite %5zu reads %5zu programs %8.2f ms | %5zu header programs%s\n",
+        fileSize / 1024, (fileSize + fs.blockDataSize() - 1) / fs.blockDataSize(),
+        after.reads - before.reads, after.programs - before.programs, (after.us - before.us) / 1000,
+        headers, ok ? "" : " (failed)"
+    );
+}
+
+// Writes then reads back a 256 KiB file, compressed through a buffer of
+// the given size (or not), reporting the flash used, the simulated times
+// and the host's time to compress and decompress it
+void compressedFile(const char * kind, std::span<const uint8_t> data, size_t bufferSize)
+{
+    using Storage = CostStorage<true>;
+    Storage storage{.bytes = 1 << 20};
+    Mounted<true, false> mounted{.storage = storage};
+    auto & fs = mounted.fs;
+    if (!fs.loadAll(mounted.ctx))
+    {
+        std::printf("loadAll failed\n");
+        return;
+    }
+    using Clock = std::chrono::steady_clock;
+    std::vector<uint8_t> buffer(bufferSize);
+    std::vector<uint8_t> out(data.size());
+    storage.counters = {};
+    const auto start = Clock::now();
+    auto rh = fs.startWrite(mounted.ctx, 1, data.size(), buffer);
+    bool ok = rh.has_value();
+    for (size_t i = 0; ok && i < data.size(); i += Storage::page)
+    {
+        ok = fs.write(*rh, data.subspan(i, std::min<size_t>(Storage::page, data.size() - i)));
+    }
+    ok = ok && fs.finishWrite(mounted.ctx, *rh);
+    const auto written = Clock::now();
+    const Counters writing = storage.counters;
+    const size_t used = std::ranges::count_if(mounted.blocks, [](const auto & info) { return info.live; });
+
+    storage.counters = {};
+    const auto reading = Clock::now();
+    auto reader = fs.openRead(mounted.ctx, mounted.headers[1], buffer);
+    ok = ok && reader.has_value() && fs.read(*reader, out) == data.size();
+    const auto read = Clock::now();
+    ok = ok && std::ranges::equal(data, out);
+
+    const auto mibPerSecond = [&](Clock::duration time)
+    {
+        return data.size() / 1048576.0 / std::chrono::duration<double>(time).count();
+    };
+    std::printf(
+        "%-6s %-6s %3zu blocks %7.1f KiB programmed %8.1f ms | read %6.1f KiB %6.1f ms | host %6.1f / %6.1f MiB/s%s\n",
+        kind, bufferSize > 0 ? (std::to_string(bufferSize / 1024) + " KiB").c_str() : "raw", used,
+        writing.bytesProgrammed / 1024.0, writing.us / 1000,
+        storage.counters.bytesRead / 1024.0, storage.counters.us / 1000,
+        mibPerSecond(written - start), mibPerSecond(read - reading), ok ? "" : " (failed)"
+    );
+}
+
+// Runs the chips' parts one after the other, but notes the time they
+// would have saved running at the same time (each on its own bus)
+template<size_t N>
+struct Overlapped
+{
+    std::array<CostStorage<false> *, N> chips;
+    double savedUs = 0;
+
+    template<typename Job>
+    void operator()(size_t count, Job && job)
+    {
+        double total = 0;
+        double longest = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const double before = chips[i]->counters.us;
+            job(i);
+            const double us = chips[i]->counters.us - before;
+            total += us;
+            longest = std::max(longest, us);
+        }
+        savedUs += total - longest;
+    }
+};
+
+// Writes a quarter of 1 MiB as one file, striped over N chips, then
+// mounts, reads it back, updates it and erases the old revision
+template<size_t N>
+void stripeChips()
+{
+    using Chip = CostStorage<false>;
+    using Storage = LockFs::StripedStorage<Chip, N, Overlapped<N>>;
+    using Fs = LockFs::LockFs<Storage>;
+    std::array<Chip, N> chips{};
+    std::array<Chip *, N> pointers;
+    for (size_t i = 0; i < N; ++i)
+    {
+        chips[i].bytes = (1 << 20) / N;
+        chips[i].backing.assign(chips[i].bytes, 0xFF);
+        pointers[i] = &chips[i];
+    }
+    Storage storage{.chips = pointers, .dispatch = {.chips = pointers}};
+    // Simulated time since the last call
+    double lastUs = 0;
+    const auto elapsed = [&]()
+    {
+        double us = -storage.dispatch.savedUs;
+        for (const Chip & chip : chips)
+        {
+            us += chip.counters.us;
+        }
+        const double ret = us - lastUs;
+        lastUs = us;
+        return ret;
+    };
+
+    Fs fs{.s = &storage};
+    std::array<typename Fs::RamHeader, 4> headers{};
+    std::vector<typename Fs::BlockInfo> blocks(fs.blockCount());
+    std::array<typename Fs::Reservation, 1> writers{};
+    std::vector<uint32_t> freeMap(fs.freeMapWords());
+    typename Fs::Context ctx{.headers = headers, .blocks = blocks, .writers = writers, .freeMap = freeMap};
+    std::vector<uint8_t> data(storage.size() / 4);
+    std::iota(data.begin(), data.end(), 0);
+    bool ok = fs.loadAll(ctx);
+    for (size_t revision = 0; ok && revision < 2; ++revision)
+    {
+        auto rh = fs.startWrite(ctx, 1, data.size());
+        ok = rh.has_value() && fs.write(*rh, data) && fs.finishWrite(ctx, *rh);
+    }
+    elapsed();
+
+    ok = ok && fs.loadAll(ctx);
+    const double mountUs = elapsed();
+    auto reader = fs.openRead(ctx, ctx.headers[1]);
+    ok = ok && reader.has_value() && fs.read(*reader, data) == data.size();
+    const double readUs = elapsed();
+    typename Fs::Eraser eraser{};
+    ok = ok && fs.eraseStep(ctx, eraser, fs.blockCount()).has_value();
+    const double eraseUs = elapsed();
+    std::printf(
+        "%zu chip%s | %8.2f ms mount %8.2f ms read %9.2f ms erase%s\n",
+        N, N == 1 ? " " : "s", mountUs / 1000, readUs / 1000, eraseUs / 1000,
+        ok ? "" : " (failed)"
+    );
+}
+
+int main()
+{
+    std::printf("Simulated times, default NOR cost model\n\n");
+    std::printf(
+        "%-22s | %-37s | %-8s %s\n",
+        "flash  fill  mount", "mount time, reads, bytes read per boot", "write", "finish (per file)"
+    );
+    for (const uint32_t mebibytes : {1, 4, 16, 64})
+    {
+        for (const uint32_t fill : {0, 25, 50, 90})
+        {
+            fillAndMount<false>(mebibytes, fill);
+            fillAndMount<true>(mebibytes, fill);
+        }
+    }
+
+    std::printf("\n");
+    for (const size_t chunk : {32, 64, 512})
+    {
+        streamChunks<false>(64 * 1024, chunk);
+        streamChunks<true>(64 * 1024, chunk);
+    }
+
+    std::printf("\nErase counts over 1 MiB, a quarter static\n");
+    for (const bool levelWear : {false, true})
+    {
+        wearCycles(levelWear, 100000);
+    }
+
+    std::printf("\nUpdating a 256 KiB file\n");
+    for (const size_t changed : {1, 4, 16})
+    {
+        patchUpdate(changed, false);
+        patchUpdate(changed, true);
+    }
+
+    std::printf("\nScrubbing a block per step\n");
+    for (const uint32_t mebibytes : {1, 16})
+    {
+        scrubPass(mebibytes);
+    }
+
+    std::printf("\nLocking 16 MiB at mount, 10 ms a lock write\n");
+    {
+        using LockFs::LockFrom;
+        lockAtMount<BlockLockStorage>("a block at a time", false);
+        for (const bool placed : {false, true})
+        {
+            lockAtMount<RangeLockStorage<LockFrom::Anywhere, 16, 4>>("64 KiB units, 4 ranges", placed);
+            lockAtMount<RangeLockStorage<LockFrom::Anywhere, 16, 16>>("64 KiB units, 16 ranges", placed);
+            lockAtMount<RangeLockStorage<LockFrom::Bottom, 16, 1>>("64 KiB units from the bottom", placed);
+        }
+    }
+
+    std::printf("\nSmall files on 64 KiB sectors, 20000 updates\n");
+    for (const bool packed : {false, true})
+    {
+        smallFiles(packed, 20000);
+    }
+
+    // Erasing 4 KiB sub-sectors everywhere is slower than 64 KiB sectors
+    // (images take 16 times the erases, each a third of the time)
+    std::printf("\nSmall files and images on 16 MiB, 20000 updates (relative to 64 KiB sectors)\n");
+    {
+        using Uniform = CostStorage<true, false, 64 << 10>;
+        Uniform uniform{.bytes = 16 << 20};
+        uniform.cost.sectorErase = uniform.cost.blockErase;
+        const Counters sectors = mixedSectors("64 KiB sectors", uniform, 20000);
+        mixedSectors("4 KiB sub-sectors", CostStorage<true>{.bytes = 16 << 20}, 20000, &sectors);
+        mixedSectors("4 KiB in 2 MiB, 64 KiB after", MixedSectorStorage{{.bytes = 16 << 20}}, 20000, &sectors);
+        mixedSectors("4 KiB blocks in 64 KiB sectors", SmallBlockSectorStorage{{.bytes = 16 << 20}}, 20000, &sectors);
+    }
+
+    std::printf("\nCommitting a file written in one go\n");
+    for (const size_t kibibytes : {64, 1024, 4096})
+    {
+        commitFile(kibibytes * 1024);
+    }
+
+    std::printf("\nCompressing a 256 KiB file (host rates are write / read, not simulated)\n");
+    {
+        std::minstd_rand rng{1};
+        const std::array<std::string_view, 8> words{
+            "flash ", "block ", "header ", "erase ", "the ", "a ", "revision ", "locked\n",
+        };
+        std::vector<uint8_t> text;
+        while (text.size() < 256 * 1024)
+        {
+            const auto word = words[rng() % words.size()];
+            text.insert(text.end(), word.begin(), word.end());
+        }
+        text.resize(256 * 1024);
+        // Tables of small values, like firmware data
+        std::vector<uint8_t> table(256 * 1024);
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            table[i] = i % 4 == 0 ? uint8_t(i / 64 + rng() % 4) : 0;
+        }
+        std::vector<uint8_t> noise(256 * 1024);
+        std::ranges::generate(noise, [&]() { return uint8_t(rng()); });
+        for (const auto & [kind, data] : {std::pair{"text", &text}, {"table", &table}, {"noise", &noise}})
+        {
+            for (const size_t bufferSize : {0, 4096, 16384})
+            {
+                compressedFile(kind, *data, bufferSize);
+            }
+        }
+    }
+
+    std::printf("\n1 MiB striped over chips on separate buses\n");
+    stripeChips<1>();
+    stripeChips<2>();
+    stripeChips<4>();
+}
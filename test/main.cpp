@@ -1,14 +1,37 @@
+#include "lockfs/image.hpp"
 #include "lockfs/lockfs.hpp"
+#include "lockfs/striped.hpp"
 
 #include <algorithm>
 #include <array>
+#include <bit>
 #include <bitset>
 #include <cassert>
+#include <concepts>
 #include <cstdint>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <numeric>
+#include <optional>
 #include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Like assert, but always evaluated (the tests call the code under test
+// inside it), so the tests still run with NDEBUG
+#define CHECK(expr) ::check(static_cast<bool>(expr), #expr, __FILE__, __LINE__)
+
+void check(bool ok, const char * expr, const char * file, int line)
+{
+    if (!ok)
+    {
+        std::cerr << file << ":" << line << ": check failed: " << expr << "\n";
+        std::abort();
+    }
+}
 
 struct TestStorage
 {
@@ -25,7 +48,7 @@ struct TestStorage
 
     bool flashRead(FlashAddr address, std::span<uint8_t> dest)
     {
-        assert(dest.size() <= size());
+        CHECK(dest.size() <= size());
         s.seekp(address);
         s.read(reinterpret_cast<char *>(dest.data()), dest.size());
         return true;
@@ -39,7 +62,7 @@ struct TestStorage
             addr = (addr + maxBlockSize()) % size()
         )
         {
-            assert(!locked[addr / maxBlockSize()]);
+            CHECK(!locked[addr / maxBlockSize()]);
         }
         s.write(reinterpret_cast<const char *>(src.data()), address);
         return true;
@@ -47,7 +70,7 @@ struct TestStorage
 
     bool flashErase(FlashAddr block)
     {
-        assert(!locked[block / maxBlockSize()]);
+        CHECK(!locked[block / maxBlockSize()]);
         FlashAddr end = block + maxBlockSize();
         for (; block < end; ++block)
         {
@@ -58,7 +81,7 @@ struct TestStorage
 
     bool flashLock(FlashAddr address, uint8_t tag)
     {
-        assert(!frozen);
+        CHECK(!frozen);
         locked[address / maxBlockSize()] = 1;
         return true;
     }
@@ -85,6 +108,1751 @@ struct TestStorage
 
 static_assert(LockFs::Storage<TestStorage>);
 
+// In-RAM flash counting bus transactions, optionally with vectored reads,
+// incremental checksums, page buffered writes and async programs/erases
+// (which complete after a few polls)
+template<bool Vectored, bool Incremental = false, bool Paged = false, bool Async = false>
+struct CountingStorage
+{
+    using FlashAddr = uint32_t;
+    using BlockSize = uint16_t;
+    using Checksum = uint8_t;
+    using ChecksumState = uint8_t;
+    static constexpr BlockSize maxBlockSize() { return 256; }
+    static constexpr FlashAddr size() { return 64 * 256; }
+    static constexpr FlashAddr pageSize() requires Paged { return 64; }
+
+    std::array<uint8_t, size()> backing;
+    size_t transactions = 0;
+    size_t bytesRead = 0;
+
+    CountingStorage() { backing.fill(0xFF); }
+
+    bool flashRead(FlashAddr address, std::span<uint8_t> dest)
+    {
+        ++transactions;
+        bytesRead += dest.size();
+        std::copy_n(backing.begin() + address, dest.size(), dest.begin());
+        return true;
+    }
+
+    bool flashReadv(std::span<const LockFs::ReadRequest<FlashAddr>> requests)
+        requires Vectored
+    {
+        ++transactions;
+        for (const auto & request : requests)
+        {
+            bytesRead += request.dest.size();
+            std::copy_n(backing.begin() + request.addr, request.dest.size(), request.dest.begin());
+        }
+        return true;
+    }
+
+    bool flashWrite(std::span<const uint8_t> src, FlashAddr address)
+    {
+        ++transactions;
+        for (size_t i = 0; i < src.size(); ++i)
+        {
+            backing[address + i] &= src[i];
+        }
+        return true;
+    }
+
+    bool flashErase(FlashAddr block)
+    {
+        ++transactions;
+        std::fill_n(backing.begin() + block, maxBlockSize(), 0xFF);
+        return true;
+    }
+
+    std::span<const uint8_t> flashMap(FlashAddr address, FlashAddr size)
+    {
+        return std::span{backing}.subspan(address, size);
+    }
+
+    struct Pending
+    {
+        std::span<const uint8_t> src;
+        FlashAddr addr;
+        bool erase;
+        size_t ticks;
+    };
+    std::optional<Pending> pending;
+    static constexpr size_t asyncTicks = 3;
+
+    bool flashWriteAsync(std::span<const uint8_t> src, FlashAddr address) requires Async
+    {
+        if (pending.has_value())
+        {
+            return false;
+        }
+        pending = Pending{.src = src, .addr = address, .erase = false, .ticks = asyncTicks};
+        return true;
+    }
+
+    bool flashEraseAsync(FlashAddr block) requires Async
+    {
+        if (pending.has_value())
+        {
+            return false;
+        }
+        pending = Pending{.addr = block, .erase = true, .ticks = asyncTicks};
+        return true;
+    }
+
+    // Only does the operation once it completes, so src must still be valid
+    std::optional<bool> flashPoll() requires Async
+    {
+        CHECK(pending.has_value());
+        if (pending->ticks > 0)
+        {
+            --pending->ticks;
+            return {};
+        }
+        const Pending op = *pending;
+        pending.reset();
+        return op.erase ? flashErase(op.addr) : flashWrite(op.src, op.addr);
+    }
+
+    bool flashLock(FlashAddr address, uint8_t tag) { return true; }
+    bool flashLockFreeze() { return true; }
+
+    Checksum computeChecksum(FlashAddr addr, BlockSize blockSize)
+    {
+        ++transactions;
+        bytesRead += blockSize;
+        return std::accumulate(backing.begin() + addr, backing.begin() + addr + blockSize, 0);
+    }
+
+    ChecksumState checksumInit() requires Incremental { return 0; }
+    void checksumUpdate(ChecksumState & state, std::span<const uint8_t> data) requires Incremental
+    {
+        state = std::accumulate(data.begin(), data.end(), state);
+    }
+    Checksum checksumFinal(ChecksumState state) requires Incremental { return state; }
+
+    bool verifyChecksum(FlashAddr addr, BlockSize blockSize, Checksum expected)
+    {
+        return computeChecksum(addr, blockSize) == expected;
+    }
+};
+
+static_assert(LockFs::Storage<CountingStorage<false>>);
+static_assert(!LockFs::VectoredStorage<CountingStorage<false>>);
+static_assert(LockFs::VectoredStorage<CountingStorage<true>>);
+static_assert(!LockFs::IncrementalChecksum<CountingStorage<false>>);
+static_assert(LockFs::IncrementalChecksum<CountingStorage<false, true>>);
+static_assert(!LockFs::PagedStorage<CountingStorage<false>>);
+static_assert(LockFs::PagedStorage<CountingStorage<false, false, true>>);
+static_assert(!LockFs::AsyncStorage<CountingStorage<false>>);
+static_assert(LockFs::AsyncStorage<CountingStorage<false, false, false, true>>);
+
+// A LockFs over the storage with its context, for Files files (tags below
+// Files unless sparse) and Writers interleaved writes, as the tests use it
+template<typename Storage, size_t Files = 4, size_t Writers = 1>
+struct Mounted
+{
+    using Fs = LockFs::LockFs<Storage>;
+
+    Storage & storage;
+    Fs fs{.s = &storage};
+    std::array<typename Fs::RamHeader, Files> headers{};
+    std::vector<typename Fs::BlockInfo> blocks = std::vector<typename Fs::BlockInfo>(fs.blockCount());
+    std::array<typename Fs::Reservation, Writers> writers{};
+    std::vector<uint32_t> freeMap = std::vector<uint32_t>(fs.freeMapWords());
+    // Only used if the test sets ctx.badMap to it
+    std::vector<uint32_t> badMap = std::vector<uint32_t>(fs.freeMapWords());
+    typename Fs::Context ctx{.headers = headers, .blocks = blocks, .writers = writers, .freeMap = freeMap};
+
+    // Writes the file in one go
+    bool write(typename Fs::Tag tag, std::span<const uint8_t> data)
+    {
+        auto rh = fs.startWrite(ctx, tag, data.size());
+        return rh.has_value() && fs.write(*rh, data) && fs.finishWrite(ctx, *rh);
+    }
+
+    // Whether the file's current revision reads back as data
+    bool holds(typename Fs::Tag tag, std::span<const uint8_t> data)
+    {
+        const auto * file = fs.fileHeader(ctx, tag);
+        auto reader = file != nullptr ? fs.openRead(ctx, *file) : std::nullopt;
+        std::vector<uint8_t> out(data.size() + 1);
+        const auto size = reader.has_value() ? fs.read(*reader, out) : std::nullopt;
+        return size == data.size() && std::equal(data.begin(), data.end(), out.begin());
+    }
+};
+
+// Blocks taken by a file of the given size
+template<typename Storage>
+constexpr size_t fileBlocks(size_t size)
+{
+    const size_t dataSize = Storage::maxBlockSize() - LockFs::LockFs<Storage>::Header::size;
+    return (size + dataSize - 1) / dataSize;
+}
+
+// Returns the number of transactions to mount a flash with one file on it
+template<bool Vectored>
+size_t mountTransactions()
+{
+    using Storage = CountingStorage<Vectored>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    std::iota(data.begin(), data.end(), 0);
+    CHECK(m.write(1, data));
+
+    storage.transactions = 0;
+    CHECK(fs.loadAll(ctx));
+    CHECK(ctx.headers[1].size == data.size());
+    return storage.transactions;
+}
+
+// Reads back a file with a foreign block in the middle, returning the
+// number of transactions to read it all in one go
+template<bool Vectored>
+size_t readTransactions()
+{
+    using Storage = CountingStorage<Vectored>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+
+    const typename Fs::Header foreign{
+        .checksum = 0,
+        .blockSize = 1,
+        .tag = 3,
+        .flags = static_cast<uint8_t>(~(Fs::Header::ERASED_BIT | Fs::Header::CONTINUATION_BIT)),
+        .revision = 0,
+    };
+    CHECK(foreign.write(storage, 2 * Storage::maxBlockSize()));
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    std::iota(data.begin(), data.end(), 0);
+    CHECK(m.write(1, data));
+    CHECK(fs.loadAll(ctx));
+
+    // Small chunks
+    auto reader = fs.openRead(ctx, ctx.headers[1]);
+    CHECK(reader.has_value());
+    std::array<uint8_t, data.size() + 1> out;
+    std::span<uint8_t> dest{out};
+    while (true)
+    {
+        const auto n = fs.read(*reader, dest.first(std::min<size_t>(77, dest.size())));
+        CHECK(n.has_value());
+        if (*n == 0)
+        {
+            break;
+        }
+        dest = dest.subspan(*n);
+    }
+    CHECK(dest.size() == 1);
+    CHECK(std::equal(data.begin(), data.end(), out.begin()));
+
+    // One large read
+    reader = fs.openRead(ctx, ctx.headers[1]);
+    storage.transactions = 0;
+    CHECK(fs.read(*reader, out) == data.size());
+    CHECK(std::equal(data.begin(), data.end(), out.begin()));
+    const size_t transactions = storage.transactions;
+
+    // In place, one span per block
+    reader = fs.openRead(ctx, ctx.headers[1]);
+    storage.transactions = 0;
+    size_t mapped = 0;
+    size_t views = 0;
+    for (auto view = fs.map(*reader); view.has_value() && !view->empty(); view = fs.map(*reader))
+    {
+        CHECK(std::equal(view->begin(), view->end(), data.begin() + mapped));
+        mapped += view->size();
+        ++views;
+    }
+    CHECK(mapped == data.size());
+    CHECK(views == fileBlocks<Storage>(data.size()));
+    CHECK(storage.transactions == 0);
+    CHECK(!fs.mapFile(ctx, ctx.headers[1]).has_value());
+    const auto single = fs.mapFile(ctx, ctx.headers[3]);
+    CHECK(single.has_value() && single->size() == 1);
+    CHECK(single->data() == storage.backing.data() + 2 * Storage::maxBlockSize() + Fs::Header::size);
+
+    return transactions;
+}
+
+// Stale blocks get erased a few at a time, the live file is kept
+void eraseSteps()
+{
+    using Storage = CountingStorage<false>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    for (uint8_t revision = 0; revision < 2; ++revision)
+    {
+        std::fill(data.begin(), data.end(), revision);
+        CHECK(m.write(1, data));
+    }
+    CHECK(fs.loadAll(ctx));
+
+    typename Fs::Eraser eraser{};
+    // Out of time
+    CHECK(fs.eraseStep(ctx, eraser, 10, []() { return true; }) == 0);
+    // Enough blank blocks for now (two revisions' worth are used)
+    const size_t stale = fileBlocks<Storage>(data.size());
+    eraser.pool = blocks.size() - 2 * stale + 2;
+    CHECK(fs.eraseStep(ctx, eraser, 10) == 2);
+    eraser.pool = blocks.size();
+    CHECK(fs.eraseStep(ctx, eraser, 1) == 1);
+    CHECK(fs.eraseStep(ctx, eraser, 10) == stale - 3);
+    CHECK(fs.eraseStep(ctx, eraser, 10) == 0);
+
+    CHECK(m.holds(1, data));
+}
+
+// A block whose data has gone bad is found by scrubbing, a block at a time,
+// and from then on is locked and never erased, without being verified again
+void scrubbing()
+{
+    using Storage = CountingStorage<false>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    ctx.badMap = m.badMap;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    const auto write = [&](uint8_t revision)
+    {
+        std::fill(data.begin(), data.end(), revision);
+        CHECK(m.write(1, data));
+    };
+    write(0);
+    CHECK(fs.loadAll(ctx));
+
+    Fs::Scrubber scrubber{};
+    // Out of time
+    CHECK(fs.scrubStep(ctx, scrubber, 10, []() { return true; }) == 0);
+    CHECK(scrubber.nextBlock == 0);
+    // All good, only the file's blocks are verified
+    const size_t fileSize = fileBlocks<Storage>(data.size());
+    for (size_t i = 0; i < fileSize; ++i)
+    {
+        CHECK(fs.scrubStep(ctx, scrubber, 1) == 0);
+        CHECK(scrubber.passes == 0);
+    }
+    CHECK(fs.scrubStep(ctx, scrubber, 1) == 0);
+    CHECK(scrubber.passes == 1);
+
+    // Its second block goes bad
+    const auto second = std::ranges::find_if(blocks, [](const Fs::BlockInfo & info) { return info.live && info.position == 1; });
+    const Storage::FlashAddr addr = (second - blocks.begin()) * Storage::maxBlockSize();
+    storage.backing[addr + Fs::Header::size + 10] ^= 0x01;
+    CHECK(!fs.isBad(ctx, addr));
+    CHECK(fs.scrubStep(ctx, scrubber, blocks.size()) == 1);
+    CHECK(fs.isBad(ctx, addr) && second->bad() && m.badMap[0] == 1u << (addr / Storage::maxBlockSize()));
+    CHECK(fs.scrubStep(ctx, scrubber, blocks.size()) == 0);
+
+    // Rewritten, the bad block is kept out of the way, even once stale
+    write(1);
+    CHECK(fs.loadAll(ctx));
+    CHECK(fs.isBad(ctx, addr) && second->locked);
+    Fs::Eraser eraser{};
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == fileSize - 1);
+    CHECK(second->bad() && !second->blank());
+    CHECK(m.holds(1, data));
+}
+
+// With the index at the end, two copies of up to four blocks each
+struct IndexedCountingStorage : CountingStorage<false>
+{
+    static constexpr FlashAddr indexSpan() { return 4; }
+    static constexpr std::array<FlashAddr, 2> indexBlocks()
+    {
+        return {size() - 2 * indexSpan() * maxBlockSize(), size() - indexSpan() * maxBlockSize()};
+    }
+};
+
+static_assert(LockFs::SpannedIndexStorage<IndexedCountingStorage>);
+
+// The index stays trusted through erases, which don't change it, and each
+// commit adds a record to it, the other copy only being rewritten once it
+// is full
+void indexedErases()
+{
+    using Storage = IndexedCountingStorage;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    const auto write = [&](uint8_t revision)
+    {
+        std::fill(data.begin(), data.end(), revision);
+        CHECK(m.write(1, data));
+    };
+    // Mounts again from the index, reading only the file's headers, and
+    // checks it agrees with the flash once the rest are read
+    const auto remount = [&]()
+    {
+        Mounted<Storage> again{.storage = storage};
+        CHECK(again.fs.loadIndex(again.ctx));
+        CHECK(again.fs.loadAll(again.ctx) && again.ctx.partial);
+        CHECK(again.holds(1, data));
+        CHECK(again.fs.loadRest(again.ctx) && !again.ctx.partial);
+        for (size_t i = 0; i < m.blocks.size(); ++i)
+        {
+            CHECK(again.blocks[i].blank() == m.blocks[i].blank());
+            CHECK(again.blocks[i].eraseCount == m.blocks[i].eraseCount);
+        }
+    };
+    write(0);
+    write(1);
+    remount();
+
+    // Stopped early, or with nothing left to erase
+    typename Fs::Eraser eraser{};
+    CHECK(fs.eraseStep(ctx, eraser, 1) == 1);
+    remount();
+    CHECK(fs.eraseStep(ctx, eraser, m.blocks.size()) == fileBlocks<Storage>(data.size()) - 1);
+    remount();
+    write(2);
+    remount();
+
+    // A record per commit until the copy is full
+    const auto indexErases = [&]()
+    {
+        uint32_t erases = 0;
+        for (const Storage::FlashAddr first : Storage::indexBlocks())
+        {
+            erases += m.blocks[first / Storage::maxBlockSize()].eraseCount;
+        }
+        return erases;
+    };
+    const uint32_t erases = indexErases();
+    const std::array<uint8_t, 10> small{};
+    size_t commits = 0;
+    while (indexErases() == erases)
+    {
+        CHECK(m.write(2, small));
+        CHECK(fs.eraseStep(ctx, eraser, m.blocks.size()).has_value());
+        ++commits;
+    }
+    // It had its first record and the file's two commits, and the table
+    // only has the file
+    const size_t room = Storage::indexSpan() * Storage::maxBlockSize() - Fs::Header::size - fs.indexSize(1, 0);
+    CHECK(commits == room / Fs::IndexRecord::size - 3 + 1);
+    CHECK(indexErases() == erases + 1);
+    remount();
+}
+
+// Indexed flash which refuses to program or erase a locked block until
+// reboot
+struct LockingStorage : IndexedCountingStorage
+{
+    std::vector<FlashAddr> locked;
+
+    bool flashLock(FlashAddr address, uint8_t tag)
+    {
+        locked.push_back(address);
+        return true;
+    }
+
+    bool isLocked(FlashAddr address) const
+    {
+        return std::ranges::find(locked, address - address % maxBlockSize()) != locked.end();
+    }
+
+    bool flashWrite(std::span<const uint8_t> src, FlashAddr address)
+    {
+        return !isLocked(address) && IndexedCountingStorage::flashWrite(src, address);
+    }
+
+    bool flashErase(FlashAddr block)
+    {
+        return !isLocked(block) && IndexedCountingStorage::flashErase(block);
+    }
+
+    void reboot() { locked.clear(); }
+};
+
+// Scrubbing where locks are enforced: a locked block's mark is kept by the
+// index, an unlocked one's in its header too, and mounting from the index
+// keeps both out of the way
+void scrubLocked()
+{
+    using Storage = LockingStorage;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    ctx.badMap = m.badMap;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    const auto write = [&](uint8_t revision)
+    {
+        std::fill(data.begin(), data.end(), revision);
+        CHECK(m.write(1, data));
+    };
+    // From the index, with the marks so far
+    const auto reboot = [&](Storage::FlashAddr bad)
+    {
+        storage.reboot();
+        Mounted<Storage> again{.storage = storage};
+        again.ctx.badMap = again.badMap;
+        CHECK(again.fs.loadIndex(again.ctx));
+        CHECK(fs.loadAll(ctx));
+        CHECK(fs.isBad(ctx, bad) && blocks[bad / Storage::maxBlockSize()].locked);
+    };
+    const auto find = [&](uint16_t position)
+    {
+        const auto block = std::ranges::find_if(blocks, [&](const Fs::BlockInfo & info)
+        {
+            return info.live && info.position == position;
+        });
+        return Storage::FlashAddr((block - blocks.begin()) * Storage::maxBlockSize());
+    };
+    write(0);
+    CHECK(fs.loadAll(ctx));
+
+    // Its second block goes bad while locked
+    const Storage::FlashAddr second = find(1);
+    CHECK(storage.isLocked(second));
+    storage.backing[second + Fs::Header::size + 10] ^= 0x01;
+    Fs::Scrubber scrubber{};
+    CHECK(fs.scrubStep(ctx, scrubber, blocks.size()) == 1);
+    CHECK(fs.isBad(ctx, second) && !Fs::Header::read(storage, second)->bad());
+    reboot(second);
+
+    // Rewritten, then the old third block goes bad once it is stale
+    const Storage::FlashAddr third = find(2);
+    write(1);
+    storage.reboot();
+    CHECK(fs.loadAll(ctx));
+    CHECK(!storage.isLocked(third));
+    storage.backing[third + Fs::Header::size + 10] ^= 0x01;
+    CHECK(fs.scrubStep(ctx, scrubber, blocks.size()) == 1);
+    CHECK(Fs::Header::read(storage, third)->bad());
+    reboot(second);
+    CHECK(fs.isBad(ctx, third));
+
+    // Neither is erased
+    Fs::Eraser eraser{};
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == fileBlocks<Storage>(data.size()) - 2);
+    CHECK(!blocks[second / Storage::maxBlockSize()].blank() && !blocks[third / Storage::maxBlockSize()].blank());
+    CHECK(m.holds(1, data));
+}
+
+// Returns the bytes read back while writing a file
+template<bool Incremental>
+size_t writeReadBack(bool verify)
+{
+    using Storage = CountingStorage<false, Incremental>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    fs.verifyBlocks = verify;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    std::iota(data.begin(), data.end(), 0);
+    auto rh = fs.startWrite(ctx, 1, data.size());
+    CHECK(rh.has_value());
+    storage.bytesRead = 0;
+    for (size_t i = 0; i < data.size(); i += 100)
+    {
+        CHECK(fs.write(*rh, std::span{data}.subspan(i, 100)));
+    }
+    CHECK(fs.finishWrite(ctx, *rh));
+    const size_t bytesRead = storage.bytesRead;
+
+    // Same checksums either way
+    CHECK(fs.loadAll(ctx));
+    for (uint32_t addr = 0; addr < fileBlocks<Storage>(data.size()) * Storage::maxBlockSize(); addr += Storage::maxBlockSize())
+    {
+        const auto hdr = Fs::Header::read(storage, addr);
+        CHECK(storage.verifyChecksum(addr + Fs::Header::size, hdr->blockSize, hdr->checksum));
+    }
+    return bytesRead;
+}
+
+// Returns the programs needed to stream a file in small chunks, checking
+// the flash ends up the same as without buffering
+template<bool Paged>
+size_t pagedWrites()
+{
+    using Storage = CountingStorage<false, false, Paged>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    std::iota(data.begin(), data.end(), 0);
+    auto rh = fs.startWrite(ctx, 1, data.size());
+    CHECK(rh.has_value());
+    storage.transactions = 0;
+    for (size_t i = 0; i < data.size(); i += 10)
+    {
+        CHECK(fs.write(*rh, std::span{data}.subspan(i, 10)));
+    }
+    const size_t programs = storage.transactions;
+    CHECK(fs.finishWrite(ctx, *rh));
+
+    CountingStorage<false> unbuffered;
+    Mounted<CountingStorage<false>> reference{.storage = unbuffered};
+    CHECK(reference.fs.loadAll(reference.ctx));
+    CHECK(reference.write(1, data));
+    CHECK(storage.backing == unbuffered.backing);
+    return programs;
+}
+
+// Two files written a chunk of each at a time
+void interleavedWrites()
+{
+    using Storage = CountingStorage<false>;
+    Storage storage;
+    Mounted<Storage, 4, 2> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> a;
+    std::array<uint8_t, 600> b;
+    std::iota(a.begin(), a.end(), 0);
+    std::iota(b.begin(), b.end(), 100);
+    auto rhA = fs.startWrite(ctx, 1, a.size());
+    auto rhB = fs.startWrite(ctx, 2, b.size());
+    CHECK(rhA.has_value() && rhB.has_value());
+    // Same tag would get the same revision, and out of writers anyway
+    CHECK(!fs.startWrite(ctx, 1, 10).has_value());
+    CHECK(!fs.startWrite(ctx, 3, 10).has_value());
+    for (size_t i = 0; i < a.size(); i += 100)
+    {
+        CHECK(fs.write(*rhA, std::span{a}.subspan(i, 100)));
+        if (i < b.size())
+        {
+            CHECK(fs.write(*rhB, std::span{b}.subspan(i, 100)));
+        }
+    }
+    CHECK(fs.finishWrite(ctx, *rhB));
+    CHECK(fs.finishWrite(ctx, *rhA));
+
+    CHECK(fs.loadAll(ctx));
+    const std::array<std::pair<uint8_t, std::span<const uint8_t>>, 2> files{{{1, a}, {2, b}}};
+    for (const auto & [tag, data] : files)
+    {
+        CHECK(m.holds(tag, data));
+    }
+}
+
+// Writes a file across the holes left by erasing every other small file,
+// returning the transactions startWrite took to reserve its blocks
+size_t fragmentedWrite()
+{
+    using Storage = CountingStorage<false>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage, 64> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    CHECK(fs.loadAll(ctx));
+
+    // A block each, then a new revision of every other one
+    std::array<uint8_t, 100> small;
+    std::iota(small.begin(), small.end(), 0);
+    for (uint8_t tag = 2; tag < 42; tag += tag < 32 ? 1 : 2)
+    {
+        CHECK(m.write(tag < 32 ? tag : tag - 30, small));
+    }
+    CHECK(fs.loadAll(ctx));
+    Fs::Eraser eraser{.pool = fs.blockCount()};
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == 5);
+    CHECK(fs.freeCount(ctx) == blocks.size() - 30);
+
+    // The 29 blocks left after the last file, then the holes
+    std::array<uint8_t, 34 * (Storage::maxBlockSize() - Fs::Header::size)> data;
+    std::iota(data.begin(), data.end(), 0);
+    storage.transactions = 0;
+    auto rh = fs.startWrite(ctx, 1, data.size());
+    CHECK(rh.has_value());
+    const size_t transactions = storage.transactions;
+    CHECK(fs.write(*rh, data));
+    CHECK(fs.finishWrite(ctx, *rh));
+    CHECK(fs.freeCount(ctx) == 0);
+
+    CHECK(fs.loadAll(ctx));
+    CHECK(m.holds(1, data));
+    return transactions;
+}
+
+// Erase counts are recorded in the headers and survive remounting, and
+// startWrite goes for the least worn free blocks (if levelWear)
+void wearLevelling(bool levelWear)
+{
+    using Storage = CountingStorage<false>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    fs.levelWear = levelWear;
+    CHECK(fs.loadAll(ctx));
+
+    // Two revisions in blocks 0 and 1, then the first one erased
+    std::array<uint8_t, 100> data;
+    std::iota(data.begin(), data.end(), 0);
+    for (uint8_t revision = 0; revision < 2; ++revision)
+    {
+        CHECK(m.write(1, data));
+    }
+    CHECK(fs.loadAll(ctx));
+    Fs::Eraser eraser{.pool = fs.blockCount()};
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == 1);
+    const auto erased = Fs::Header::read(storage, 0);
+    CHECK(erased->blank() && erased->eraseCount == 1);
+    CHECK(fs.loadAll(ctx));
+    CHECK(ctx.blocks[0].eraseCount == 1 && ctx.blocks[1].eraseCount == 0);
+    const Fs::Wear wear = fs.wear(ctx);
+    CHECK(wear.min == 0 && wear.max == 1 && wear.total == 1 && wear.blocks == blocks.size());
+
+    // As if the next free blocks had been erased a few times already
+    const size_t next = *ctx.nextFreeBlock / Storage::maxBlockSize();
+    CHECK(next == 2);
+    for (size_t i = next; i < next + 32; ++i)
+    {
+        ctx.blocks[i].eraseCount = 5;
+    }
+    auto rh = fs.startWrite(ctx, 2, 2 * Storage::maxBlockSize());
+    CHECK(rh.has_value());
+    const size_t first = levelWear ? next + 32 : next;
+    CHECK(rh->startBlock == first * Storage::maxBlockSize());
+    for (size_t i = first; i < first + 3; ++i)
+    {
+        CHECK(ctx.blocks[i].reserved);
+        CHECK(Fs::Header::read(storage, i * Storage::maxBlockSize())->eraseCount == ctx.blocks[i].eraseCount);
+    }
+}
+
+// Vectored storage with its headers laid out back to front and big endian
+struct ReversedStorage : CountingStorage<true>
+{
+    using HeaderLayout = LockFs::HeaderLayout<
+        std::endian::big,
+        LockFs::Field::Position,
+        LockFs::Field::EraseCount,
+        LockFs::Field::Checksum,
+        LockFs::Field::BlockSize,
+        LockFs::Field::Revision,
+        LockFs::Field::Flags,
+        LockFs::Field::Tag
+    >;
+};
+
+static_assert(!LockFs::LaidOutStorage<CountingStorage<true>>);
+static_assert(LockFs::LaidOutStorage<ReversedStorage>);
+
+// Writes and mounts (decoding headers in batches) with a custom layout
+void customLayout()
+{
+    using Storage = ReversedStorage;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    std::iota(data.begin(), data.end(), 0);
+    CHECK(m.write(3, data));
+
+    // Tag last, blockSize big endian before the revision and flags
+    const uint16_t blockSize = Storage::maxBlockSize() - Fs::Header::size;
+    const auto start = std::span{storage.backing}.first(Fs::Header::size);
+    CHECK(start.back() == 3);
+    CHECK(start[start.size() - 5] == blockSize >> 8 && start[start.size() - 4] == (blockSize & 0xFF));
+
+    CHECK(fs.loadAll(ctx));
+    CHECK(ctx.headers[3].size == data.size());
+    CHECK(m.holds(3, data));
+}
+
+// Headers of the older format (tag, flags, revision, blockSize and
+// checksum, no wear fields) aren't mounted as this one, though a block of
+// it cut off while its flags were programmed is
+void legacyHeaders()
+{
+    using Storage = CountingStorage<false>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+
+    // A committed file of one block
+    const uint16_t blockSize = 100;
+    const std::array<uint8_t, 6> old{1, 0x3F, 0, blockSize & 0xFF, blockSize >> 8, 0};
+    std::ranges::copy(old, storage.backing.begin());
+    CHECK(!fs.loadAll(ctx));
+
+    std::ranges::fill(storage.backing, 0xFF);
+    CHECK(fs.loadAll(ctx));
+    std::array<uint8_t, 100> data;
+    std::iota(data.begin(), data.end(), 0);
+    CHECK(m.write(1, data));
+    // On flash with the format bit cleared, which reads as set
+    const uint8_t flags = storage.backing[Fs::Codec::offset(LockFs::Field::Flags)];
+    CHECK(!(flags & Fs::Header::FORMAT_BIT));
+    CHECK(!Fs::Header::read(storage, 0)->legacy());
+    std::ranges::copy(old, storage.backing.begin() + 8 * Storage::maxBlockSize());
+    CHECK(fs.loadAll(ctx));
+    CHECK(m.holds(1, data));
+}
+
+// Small files sharing packed blocks, each added as a record after the
+// last, and the block only erased once none of them are current
+void packedFiles()
+{
+    using Storage = CountingStorage<false>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage, 8> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    CHECK(fs.loadAll(ctx));
+    const auto packed = [&]()
+    {
+        return std::ranges::count_if(blocks, [](const Fs::BlockInfo & info) { return !info.erased() && info.packed(); });
+    };
+    const auto check = [&](uint8_t tag, uint8_t fill)
+    {
+        auto reader = fs.openRead(ctx, ctx.headers[tag]);
+        CHECK(reader.has_value());
+        std::array<uint8_t, 21> out;
+        CHECK(fs.read(*reader, out) == 20);
+        CHECK(std::all_of(out.begin(), out.begin() + 20, [&](uint8_t byte) { return byte == fill; }));
+        const auto view = fs.mapFile(ctx, ctx.headers[tag]);
+        CHECK(view.has_value() && view->size() == 20 && view->front() == fill);
+    };
+
+    // Seven records of 20 bytes fit in a block
+    std::array<uint8_t, 20> data;
+    for (uint8_t tag = 0; tag < 7; ++tag)
+    {
+        data.fill(tag);
+        CHECK(fs.writePacked(ctx, tag, data));
+    }
+    CHECK(packed() == 1);
+    data.fill(0x10);
+    CHECK(fs.writePacked(ctx, 0, data));
+    CHECK(packed() == 2);
+    check(0, 0x10);
+    check(6, 6);
+    std::vector<uint8_t> big(fs.packedCapacity() + 1);
+    CHECK(!fs.writePacked(ctx, 7, big));
+    CHECK(fs.writePacked(ctx, 7, std::span{big}.first(fs.packedCapacity())));
+    CHECK(packed() == 3);
+
+    // Mounted, both live and locked, and the block added to after the
+    // mount is a new one
+    CHECK(fs.loadAll(ctx));
+    CHECK(packed() == 3 && std::ranges::count_if(blocks, [](const Fs::BlockInfo & info) { return info.locked; }) == 3);
+    check(0, 0x10);
+    check(3, 3);
+    CHECK(ctx.headers[7].size == fs.packedCapacity());
+    for (uint8_t tag = 1; tag < 7; ++tag)
+    {
+        data.fill(tag + 0x10);
+        CHECK(fs.writePacked(ctx, tag, data));
+    }
+    CHECK(packed() == 4);
+    // One a full file now, the first block's no longer current
+    CHECK(m.write(0, big));
+    CHECK(fs.loadAll(ctx));
+    for (uint8_t tag = 1; tag < 7; ++tag)
+    {
+        check(tag, tag + 0x10);
+    }
+    CHECK(ctx.headers[0].size == big.size());
+    Fs::Eraser eraser{};
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == 2);
+    CHECK(packed() == 2);
+
+    // Scrubbing verifies each record
+    const auto record = ctx.headers[4].startBlock;
+    storage.backing[record + Fs::Header::size + 3] ^= 0x01;
+    Fs::Scrubber scrubber{};
+    CHECK(fs.scrubStep(ctx, scrubber, blocks.size()) == 1);
+    CHECK(fs.isBad(ctx, record - record % Storage::maxBlockSize()));
+}
+
+// Storage protecting ranges of blocks, recording the ranges
+template<LockFs::LockFrom From, uint32_t Unit, uint32_t MaxRanges>
+struct RangeLockedStorage : CountingStorage<false>
+{
+    static constexpr LockFs::LockGranularity lockGranularity()
+    {
+        return {.from = From, .unit = Unit, .maxRanges = MaxRanges};
+    }
+
+    std::vector<std::pair<FlashAddr, FlashAddr>> ranges;
+
+    bool flashLock(FlashAddr address, uint8_t tag)
+    {
+        CHECK(false);
+        return false;
+    }
+
+    bool flashLockRange(FlashAddr address, FlashAddr size)
+    {
+        ranges.emplace_back(address, size);
+        return true;
+    }
+};
+
+// Protecting from the bottom, with the index low down (blocks 4 to 11),
+// which may never be protected
+struct IndexedRangeLockedStorage : RangeLockedStorage<LockFs::LockFrom::Bottom, 1, 1>
+{
+    static constexpr FlashAddr indexSpan() { return 4; }
+    static constexpr std::array<FlashAddr, 2> indexBlocks()
+    {
+        return {4 * maxBlockSize(), 8 * maxBlockSize()};
+    }
+
+    bool flashErase(FlashAddr block)
+    {
+        CHECK(!locked(block));
+        return CountingStorage<false>::flashErase(block);
+    }
+
+    bool flashWrite(std::span<const uint8_t> src, FlashAddr address)
+    {
+        CHECK(!locked(address));
+        return CountingStorage<false>::flashWrite(src, address);
+    }
+
+    bool locked(FlashAddr address) const
+    {
+        return std::ranges::any_of(ranges, [&](const auto & range)
+        {
+            return address >= range.first && address - range.first < range.second;
+        });
+    }
+};
+
+static_assert(!LockFs::RangeLockStorage<CountingStorage<false>>);
+static_assert(LockFs::RangeLockStorage<RangeLockedStorage<LockFs::LockFrom::Top, 1, 1>>);
+
+// Locks merged into as few ranges as the storage allows, and long lived
+// files placed where it protects
+void rangeLocks()
+{
+    constexpr uint32_t block = CountingStorage<false>::maxBlockSize();
+    std::array<uint8_t, 100> data;
+    std::iota(data.begin(), data.end(), 0);
+
+    {
+        using Storage = RangeLockedStorage<LockFs::LockFrom::Anywhere, 2, 2>;
+        using Fs = LockFs::LockFs<Storage>;
+        Storage storage;
+        Mounted<Storage> m{.storage = storage};
+        auto & fs = m.fs;
+        auto & ctx = m.ctx;
+        auto & blocks = m.blocks;
+        CHECK(fs.loadAll(ctx));
+
+        // A block each, live in blocks 0, 4 and 10: units 0, 2 and 5
+        for (const uint8_t tag : {1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3})
+        {
+            CHECK(m.write(tag, data));
+        }
+        storage.ranges.clear();
+        CHECK(fs.loadAll(ctx));
+        // Merged over the shorter gap
+        using Range = std::pair<uint32_t, uint32_t>;
+        CHECK((storage.ranges == std::vector<Range>{{0, 6 * block}, {10 * block, 2 * block}}));
+        // Covered without needing it, so neither erased nor written
+        CHECK(ctx.blocks[1].locked && ctx.blocks[11].locked);
+        CHECK(!ctx.blocks[6].locked);
+        CHECK(*ctx.nextFreeBlock == 12 * block);
+        Fs::Eraser eraser{.pool = fs.blockCount()};
+        CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == 4);
+    }
+
+    {
+        using Storage = RangeLockedStorage<LockFs::LockFrom::Top, 1, 1>;
+        Storage storage;
+        Mounted<Storage> m{.storage = storage};
+        auto & fs = m.fs;
+        auto & ctx = m.ctx;
+        fs.longLived = [](uint8_t tag) { return tag == 1; };
+        CHECK(fs.loadAll(ctx));
+
+        // Three blocks, in the top three
+        std::array<uint8_t, 600> firmware;
+        std::iota(firmware.begin(), firmware.end(), 0);
+        auto rh = fs.startWrite(ctx, 1, firmware.size());
+        CHECK(rh.has_value());
+        CHECK(rh->startBlock == 61 * block);
+        CHECK(fs.write(*rh, firmware));
+        CHECK(fs.finishWrite(ctx, *rh));
+        // Others still go from the next free block
+        CHECK(*ctx.nextFreeBlock == 0);
+        CHECK(fs.loadAll(ctx));
+        using Range = std::pair<uint32_t, uint32_t>;
+        // Not rounded up over the free block below it
+        CHECK((storage.ranges == std::vector<Range>{{62 * block, 2 * block}}));
+        CHECK(ctx.blocks[61].locked && (ctx.freeMap[1] >> (60 - 32) & 1));
+
+        // The next revision in the free blocks below
+        rh = fs.startWrite(ctx, 1, firmware.size());
+        CHECK(rh.has_value());
+        CHECK(rh->startBlock == 58 * block);
+        CHECK(fs.write(*rh, firmware));
+        CHECK(fs.finishWrite(ctx, *rh));
+        storage.ranges.clear();
+        CHECK(fs.loadAll(ctx));
+        // Rounded up over the stale revision
+        CHECK((storage.ranges == std::vector<Range>{{60 * block, 4 * block}}));
+        CHECK(m.holds(1, firmware));
+        CHECK(m.write(2, data));
+        CHECK(m.holds(2, data));
+    }
+
+    {
+        using Storage = RangeLockedStorage<LockFs::LockFrom::Bottom, 1, 1>;
+        Storage storage;
+        Mounted<Storage> m{.storage = storage};
+        auto & fs = m.fs;
+        auto & ctx = m.ctx;
+        CHECK(fs.loadAll(ctx));
+
+        // All but the top two blocks live, still written after mounting
+        std::vector<uint8_t> big(62 * fs.blockDataSize());
+        std::iota(big.begin(), big.end(), 0);
+        CHECK(m.write(1, big));
+        storage.ranges.clear();
+        CHECK(fs.loadAll(ctx));
+        using Range = std::pair<uint32_t, uint32_t>;
+        CHECK((storage.ranges == std::vector<Range>{{0, 32 * block}}));
+        CHECK(fs.freeCount(ctx) == 2);
+        CHECK(m.write(2, data));
+        CHECK(m.holds(1, big));
+        CHECK(m.holds(2, data));
+    }
+
+    {
+        using Storage = IndexedRangeLockedStorage;
+        Storage storage;
+        Mounted<Storage> m{.storage = storage};
+        auto & fs = m.fs;
+        auto & ctx = m.ctx;
+        CHECK(fs.loadAll(ctx));
+
+        // A block each, the last past the index
+        for (const uint8_t tag : {0, 1, 2, 3, 0})
+        {
+            CHECK(m.write(tag, data));
+        }
+        CHECK(ctx.headers[0].startBlock == 12 * block);
+        storage.ranges.clear();
+        CHECK(fs.loadAll(ctx));
+        // Stopped short of it, rather than rounding up to 16 blocks
+        using Range = std::pair<uint32_t, uint32_t>;
+        CHECK((storage.ranges == std::vector<Range>{{0, 4 * block}}));
+        CHECK(!ctx.blocks[4].locked && ctx.blocks[12].locked);
+        CHECK(fs.writeIndex(ctx));
+        CHECK(fs.loadIndex(ctx));
+    }
+}
+
+// Storage with four blocks erased one at a time, then sectors of four
+// blocks, recording the sector erases
+struct SectoredStorage : CountingStorage<false>
+{
+    static constexpr auto sectors()
+    {
+        return std::array{
+            LockFs::Sectors<FlashAddr>{.size = 4 * maxBlockSize(), .eraseSize = maxBlockSize()},
+            LockFs::Sectors<FlashAddr>{.size = 60 * maxBlockSize(), .eraseSize = 4 * maxBlockSize()},
+        };
+    }
+
+    std::vector<FlashAddr> sectorErases;
+
+    bool flashErase(FlashAddr block)
+    {
+        CHECK(block < 4 * maxBlockSize());
+        return CountingStorage::flashErase(block);
+    }
+
+    bool flashEraseSector(FlashAddr address, FlashAddr size)
+    {
+        CHECK(size == 4 * maxBlockSize() && address % size == 0);
+        sectorErases.push_back(address);
+        std::fill_n(backing.begin() + address, size, 0xFF);
+        return true;
+    }
+};
+
+static_assert(!LockFs::SectoredStorage<CountingStorage<false>>);
+static_assert(LockFs::SectoredStorage<SectoredStorage>);
+
+// Files placed in sectors no bigger than them (or else in ones partly
+// used), and sectors erased whole once none of their blocks are in use
+void sectoredStorage()
+{
+    using Storage = SectoredStorage;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage, 8> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    CHECK(fs.loadAll(ctx));
+
+    constexpr uint32_t block = Storage::maxBlockSize();
+    std::vector<uint8_t> data(8 * fs.blockDataSize());
+    std::iota(data.begin(), data.end(), 0);
+    const auto write = [&](uint8_t tag, uint32_t blockCount)
+    {
+        auto rh = fs.startWrite(ctx, tag, blockCount * fs.blockDataSize());
+        CHECK(rh.has_value());
+        CHECK(fs.write(*rh, std::span{data}.first(blockCount * fs.blockDataSize())));
+        CHECK(fs.finishWrite(ctx, *rh));
+        return rh->startBlock / block;
+    };
+    // Small files in the small sectors, bigger ones from the start of a
+    // free sector, and once the small sectors are full wherever is free
+    CHECK(write(1, 1) == 0);
+    CHECK(write(2, 8) == 4);
+    CHECK(write(3, 2) == 1);
+    CHECK(write(4, 5) == 12);
+    CHECK(write(5, 1) == 3);
+    CHECK(write(6, 1) == 17);
+    CHECK(write(2, 8) == 20);
+    CHECK(write(4, 5) == 28);
+
+    // The sectors of the old revisions, but not the one shared with tag 6
+    CHECK(fs.loadAll(ctx));
+    Fs::Eraser eraser{.pool = fs.blockCount()};
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == 12);
+    CHECK((storage.sectorErases == std::vector<uint32_t>{4 * block, 8 * block, 12 * block}));
+    CHECK(ctx.blocks[4].blank() && ctx.blocks[4].eraseCount == 1);
+    CHECK(!ctx.blocks[16].blank());
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == 0);
+
+    CHECK(fs.loadAll(ctx));
+    CHECK(ctx.blocks[7].eraseCount == 1);
+    for (const uint8_t tag : {2, 4})
+    {
+        auto reader = fs.openRead(ctx, ctx.headers[tag]);
+        CHECK(reader.has_value());
+        std::vector<uint8_t> out(data.size() + 1);
+        const auto size = fs.read(*reader, out);
+        CHECK(size == (tag == 2 ? 8 : 5) * fs.blockDataSize());
+        CHECK(std::equal(out.begin(), out.begin() + *size, data.begin()));
+    }
+
+    // With the small sectors full, small files fill up sectors already
+    // in use (tag 6's, tag 4's last block's) before free ones
+    CHECK(write(7, 4) == 36);
+    CHECK(write(1, 1) == 18);
+    CHECK(write(3, 2) == 33);
+    // None has room, so the start of a free one
+    CHECK(write(5, 3) == 40);
+}
+
+// Storage with 16 bit tags
+struct WideTagStorage : CountingStorage<false>
+{
+    using Tag = uint16_t;
+
+    bool flashLock(FlashAddr address, Tag tag) { return true; }
+};
+
+// Files with tags far apart in a sparse table, only as big as the number
+// of files
+void sparseTags()
+{
+    using Storage = WideTagStorage;
+    using Fs = LockFs::LockFs<Storage>;
+    static_assert(std::same_as<Fs::Tag, uint16_t>);
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    ctx.sparse = true;
+    CHECK(fs.loadAll(ctx));
+    CHECK(ctx.headerCount == 0);
+
+    constexpr std::array<uint16_t, 4> tags{60000, 5, 1000, 300};
+    std::array<uint8_t, 100> data;
+    for (const uint16_t tag : tags)
+    {
+        std::fill(data.begin(), data.end(), uint8_t(tag));
+        CHECK(m.write(tag, data));
+    }
+    // Out of room for another file, but updates are fine
+    CHECK(!fs.startWrite(ctx, 7, data.size()).has_value());
+    CHECK(fs.fileHeader(ctx, 7) == nullptr);
+    auto rh = fs.startWrite(ctx, 1000, data.size());
+    CHECK(rh.has_value() && rh->current.revision == 1);
+    std::fill(data.begin(), data.end(), 0xAA);
+    CHECK(fs.write(*rh, data));
+    CHECK(fs.finishWrite(ctx, *rh));
+
+    const auto check = [&](const Fs::Context & mounted)
+    {
+        CHECK(mounted.headerCount == tags.size());
+        for (size_t i = 1; i < mounted.headerCount; ++i)
+        {
+            CHECK(m.headers[i - 1].current.tag < m.headers[i].current.tag);
+        }
+        for (const uint16_t tag : tags)
+        {
+            const Fs::RamHeader * file = fs.fileHeader(mounted, tag);
+            CHECK(file != nullptr && file->size == data.size());
+            auto reader = fs.openRead(mounted, *file);
+            CHECK(reader.has_value());
+            std::array<uint8_t, data.size()> out;
+            CHECK(fs.read(*reader, out) == data.size());
+            CHECK(std::ranges::all_of(out, [&](uint8_t byte) { return byte == (tag == 1000 ? 0xAA : uint8_t(tag)); }));
+        }
+    };
+    CHECK(fs.loadAll(ctx));
+    check(ctx);
+}
+
+// Runs each chip's part on its own thread
+struct Threaded
+{
+    template<typename Job>
+    void operator()(size_t count, Job && job)
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < count; ++i)
+        {
+            threads.emplace_back(job, i);
+        }
+        for (std::thread & thread : threads)
+        {
+            thread.join();
+        }
+    }
+};
+
+// A file striped over four chips, mounted, read and erased with each
+// chip's part of the batch on its own thread
+void stripedStorage()
+{
+    using Chip = CountingStorage<false>;
+    using Storage = LockFs::StripedStorage<Chip, 4, Threaded>;
+    using Fs = LockFs::LockFs<Storage>;
+    static_assert(LockFs::BatchStorage<Storage> && LockFs::VectoredStorage<Storage>);
+    std::array<Chip, 4> chips;
+    Storage storage{.chips = {&chips[0], &chips[1], &chips[2], &chips[3]}};
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    for (uint8_t revision = 0; revision < 2; ++revision)
+    {
+        std::fill(data.begin(), data.end(), revision);
+        CHECK(m.write(1, data));
+    }
+    // Consecutive blocks on different chips
+    const size_t fileBlocks = ::fileBlocks<Chip>(data.size());
+    CHECK(fileBlocks >= chips.size());
+    for (const Chip & chip : chips)
+    {
+        CHECK(chip.backing[0] != 0xFF);
+    }
+
+    for (Chip & chip : chips)
+    {
+        chip.transactions = 0;
+    }
+    CHECK(fs.loadAll(ctx));
+    // Each chip reads its headers in batches
+    for (const Chip & chip : chips)
+    {
+        CHECK(chip.transactions == Chip::size() / Chip::maxBlockSize());
+    }
+    CHECK(m.holds(1, data));
+
+    Fs::Eraser eraser{.pool = fs.blockCount()};
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == fileBlocks);
+    CHECK(fs.loadAll(ctx));
+    CHECK(m.holds(1, data));
+}
+
+// Blocks of a file on successive chips, past free blocks on the same
+// chip, unless that would leave too few for the rest
+void stripedAllocation()
+{
+    using Chip = CountingStorage<false>;
+    using Storage = LockFs::StripedStorage<Chip, 4>;
+    using Fs = LockFs::LockFs<Storage>;
+    static_assert(LockFs::InterleavedStorage<Storage>);
+    constexpr uint32_t block = Chip::maxBlockSize();
+    std::array<Chip, 4> chips;
+    Storage storage{.chips = {&chips[0], &chips[1], &chips[2], &chips[3]}};
+    Mounted<Storage, 8> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    // Else blocks erased once are passed over anyway
+    fs.levelWear = false;
+    CHECK(fs.loadAll(ctx));
+
+    // Blocks 1 and 5 free (both on chip 1) among the first eight
+    std::array<uint8_t, 100> small;
+    std::iota(small.begin(), small.end(), 0);
+    for (const uint8_t tag : {0, 1, 2, 3, 4, 5, 1, 5})
+    {
+        CHECK(m.write(tag, small));
+    }
+    Fs::Eraser eraser{.pool = fs.blockCount()};
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == 2);
+    CHECK(ctx.blocks[1].blank() && ctx.blocks[5].blank());
+
+    // From block 1, then chips 2, 3 and 0 rather than blocks 5, 8 and 9
+    ctx.nextFreeBlock = block;
+    std::vector<uint8_t> data(4 * fs.blockDataSize());
+    std::iota(data.begin(), data.end(), 0);
+    CHECK(m.write(6, data));
+    std::vector<uint32_t> taken;
+    for (uint32_t i = 0; i < fs.blockCount(); ++i)
+    {
+        if (!ctx.blocks[i].blank() && ctx.blocks[i].tag == 6)
+        {
+            taken.push_back(i);
+        }
+    }
+    CHECK((taken == std::vector<uint32_t>{1, 10, 11, 12}));
+    CHECK(m.holds(6, data));
+
+    // Every free block, none can be passed over
+    std::vector<uint8_t> rest(fs.freeCount(ctx) * fs.blockDataSize());
+    std::iota(rest.begin(), rest.end(), 0);
+    ctx.nextFreeBlock = 5 * block;
+    CHECK(m.write(7, rest));
+    CHECK(fs.freeCount(ctx) == 0);
+    CHECK(fs.loadAll(ctx));
+    CHECK(m.holds(6, data) && m.holds(7, rest));
+}
+
+// Format of CountingStorage for ImageBuilder
+struct CountingFormat
+{
+    using FlashAddr = uint32_t;
+    using BlockSize = uint16_t;
+    using Checksum = uint8_t;
+    BlockSize maxBlockSize() const { return CountingStorage<false>::maxBlockSize(); }
+    FlashAddr size() const { return CountingStorage<false>::size(); }
+    Checksum checksum(std::span<const uint8_t> data) const
+    {
+        return std::accumulate(data.begin(), data.end(), Checksum{0});
+    }
+};
+
+struct IndexedCountingFormat : CountingFormat
+{
+    static constexpr FlashAddr indexSpan() { return IndexedCountingStorage::indexSpan(); }
+    static constexpr std::array<FlashAddr, 2> indexBlocks() { return IndexedCountingStorage::indexBlocks(); }
+};
+
+// An image laid out on the host is the same as writing the files on the
+// device, and mounts
+void imageBuilder()
+{
+    using Storage = CountingStorage<false>;
+    std::array<std::vector<uint8_t>, 3> files{
+        std::vector<uint8_t>(1000), std::vector<uint8_t>(10), std::vector<uint8_t>(3000)
+    };
+    constexpr std::array<uint8_t, files.size()> tags{7, 2, 9};
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        std::iota(files[i].begin(), files[i].end(), uint8_t(i));
+    }
+
+    LockFs::ImageBuilder<CountingFormat> sequential{CountingFormat{}, files.size()};
+    LockFs::ImageBuilder<CountingFormat> threaded{CountingFormat{}, files.size()};
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        CHECK(sequential.add(tags[i], files[i]));
+        CHECK(threaded.add(tags[i], files[i]));
+    }
+    // One file per tag
+    CHECK(!sequential.add(tags[0], files[1]));
+    CHECK(sequential.seal(LockFs::Sequential{}, 1) && sequential.writeIndex());
+    CHECK(threaded.seal(Threaded{}, 4) && threaded.writeIndex());
+    CHECK(std::ranges::equal(sequential.image(), threaded.image()));
+
+    Storage device;
+    Mounted<Storage, 16> m{.storage = device};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    CHECK(fs.loadAll(ctx));
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        auto rh = fs.startWrite(ctx, tags[i], files[i].size());
+        CHECK(rh.has_value());
+        CHECK(fs.write(*rh, files[i]));
+        CHECK(fs.finishWrite(ctx, *rh));
+    }
+    CHECK(std::ranges::equal(sequential.image(), device.backing));
+
+    std::ranges::copy(threaded.image(), device.backing.begin());
+    CHECK(fs.loadAll(ctx));
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        CHECK(m.holds(tags[i], files[i]));
+    }
+
+    // The index has the sealed checksums, as scanning the image finds
+    // (the image's context is sparse, so is the device's to use it)
+    LockFs::ImageBuilder<IndexedCountingFormat> indexed{IndexedCountingFormat{}, files.size()};
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        CHECK(indexed.add(tags[i], files[i]));
+    }
+    CHECK(indexed.seal(Threaded{}, 4) && indexed.writeIndex());
+    IndexedCountingStorage indexedDevice;
+    std::ranges::copy(indexed.image(), indexedDevice.backing.begin());
+    Mounted<IndexedCountingStorage, 16> fromIndex{.storage = indexedDevice};
+    Mounted<IndexedCountingStorage, 16> scanned{.storage = indexedDevice};
+    fromIndex.ctx.sparse = true;
+    scanned.ctx.sparse = true;
+    CHECK(fromIndex.fs.loadIndex(fromIndex.ctx) && fromIndex.fs.loadAll(fromIndex.ctx));
+    CHECK(scanned.fs.scan(scanned.ctx) && scanned.fs.lock(scanned.ctx));
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        const auto * file = fromIndex.fs.fileHeader(fromIndex.ctx, tags[i]);
+        const auto * expected = scanned.fs.fileHeader(scanned.ctx, tags[i]);
+        CHECK(file != nullptr && expected != nullptr && file->current.checksum == expected->current.checksum);
+        CHECK(fromIndex.holds(tags[i], files[i]));
+    }
+}
+
+// Patches only program the blocks that changed, keeping the rest of the
+// file where it is, through reboots, power loss, patches of patches and
+// erasing what they replaced
+void patchUpdates()
+{
+    using Storage = CountingStorage<false>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    CHECK(fs.loadAll(ctx));
+
+    const size_t dataSize = fs.blockDataSize();
+    std::vector<uint8_t> data(8 * dataSize + 100);
+    std::iota(data.begin(), data.end(), 0);
+    CHECK(m.write(1, data));
+
+    const auto check = [&]()
+    {
+        for (const bool reboot : {false, true})
+        {
+            CHECK(!reboot || fs.loadAll(ctx));
+            CHECK(ctx.headers[1].size == data.size());
+            CHECK(m.holds(1, data));
+        }
+    };
+    // Writes the blocks at the positions (as startPatch expects them)
+    const auto patch = [&](std::span<const uint16_t> changed, std::span<const uint16_t> written, bool finish)
+    {
+        const size_t free = fs.freeCount(ctx);
+        auto rh = fs.startPatch(ctx, ctx.headers[1], data.size(), changed);
+        CHECK(rh.has_value());
+        CHECK(free - fs.freeCount(ctx) == written.size());
+        for (const uint16_t position : written)
+        {
+            const size_t begin = position * dataSize;
+            CHECK(fs.write(*rh, std::span{data}.subspan(begin, std::min(dataSize, data.size() - begin))));
+        }
+        CHECK(!finish || fs.finishWrite(ctx, *rh));
+    };
+
+    // Just those, and the last block
+    data[2 * dataSize] ^= 0xFF;
+    data[5 * dataSize + 7] ^= 0xFF;
+    patch(std::array<uint16_t, 2>{2, 5}, std::array<uint16_t, 3>{2, 5, 8}, true);
+    check();
+
+    // Power loss before it finishes, the last patch stays
+    std::vector<uint8_t> patched = data;
+    data[0] ^= 0xFF;
+    patch(std::array<uint16_t, 1>{0}, std::array<uint16_t, 2>{0, 8}, false);
+    data = patched;
+    check();
+
+    // A patch of a patch which grows the file: the old last block wasn't
+    // full, so it is written too
+    data.resize(data.size() + dataSize);
+    data[3 * dataSize + 1] ^= 0xFF;
+    patch(std::array<uint16_t, 1>{3}, std::array<uint16_t, 3>{3, 8, 9}, true);
+    check();
+
+    // What they replaced (and the unfinished patch) is erased, check
+    // rebooted so none of it is locked
+    Fs::Eraser eraser{};
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == 7);
+    check();
+
+    // A full rewrite replaces them all
+    const size_t live = std::ranges::count_if(blocks, [](const Fs::BlockInfo & info) { return info.live; });
+    CHECK(live == 10);
+    auto rh = fs.startWrite(ctx, 1, data.size());
+    CHECK(rh.has_value());
+    CHECK(fs.write(*rh, data));
+    CHECK(fs.finishWrite(ctx, *rh));
+    check();
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == live);
+    check();
+
+    // Power loss once a patch has sealed a block other than its start,
+    // which looks finished: a patch would keep it, so has to wait until
+    // it is erased
+    patched = data;
+    data[0] ^= 0xFF;
+    data[3 * dataSize] ^= 0xFF;
+    patch(std::array<uint16_t, 2>{0, 3}, std::array<uint16_t, 3>{0, 3, 9}, false);
+    data = patched;
+    check();
+    CHECK(!fs.startPatch(ctx, ctx.headers[1], data.size(), std::array<uint16_t, 1>{3}).has_value());
+    CHECK(fs.eraseStep(ctx, eraser, blocks.size()) == 3);
+    data[3 * dataSize] ^= 0xFF;
+    patch(std::array<uint16_t, 1>{3}, std::array<uint16_t, 2>{3, 9}, true);
+    check();
+}
+
+// Compressed files round trip, a block at a time through a small buffer,
+// taking fewer blocks when the data compresses
+template<bool Incremental, bool Paged>
+void compressedFiles()
+{
+    using Storage = CountingStorage<false, Incremental, Paged>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    fs.verifyBlocks = Incremental;
+    CHECK(fs.loadAll(ctx));
+
+    // Text-like, and noise
+    std::vector<uint8_t> text;
+    const std::string words[] = {
+        "the block is erased\n",
+        "the header is written last\n",
+        "a new revision is locked\n",
+        "flash wears out\n",
+        "blocks are checksummed\n",
+        "the index is a speed up\n",
+    };
+    for (uint32_t i = 0; text.size() < 3000; i = i * 1103515245 + 12345)
+    {
+        text.insert(text.end(), words[(i >> 16) % 6].begin(), words[(i >> 16) % 6].end());
+    }
+    text.resize(3000);
+    std::vector<uint8_t> noise(1000);
+    uint32_t x = 1;
+    for (uint8_t & byte : noise)
+    {
+        x = x * 1103515245 + 12345;
+        byte = static_cast<uint8_t>(x >> 16);
+    }
+
+    // However badly the data compresses, compress takes at least
+    // minConsumed of it
+    std::vector<uint8_t> encoded;
+    const auto put = [&](std::span<const uint8_t> bytes) { encoded.insert(encoded.end(), bytes.begin(), bytes.end()); };
+    const auto [consumed, produced] = LockFs::Lz::compress(noise, fs.blockDataSize(), put);
+    CHECK(consumed >= LockFs::Lz::minConsumed(fs.blockDataSize()) && produced == encoded.size());
+    std::vector<uint8_t> decoded(consumed);
+    CHECK(LockFs::Lz::decompress(encoded, decoded));
+    CHECK(std::equal(decoded.begin(), decoded.end(), noise.begin()));
+
+    std::array<uint8_t, 1024> buffer;
+    const auto check = [&](uint8_t tag, const std::vector<uint8_t> & data)
+    {
+        for (const bool reboot : {false, true})
+        {
+            CHECK(!reboot || fs.loadAll(ctx));
+            CHECK(ctx.headers[tag].size == data.size());
+            CHECK(ctx.headers[tag].current.compressed());
+            // Needs a buffer, and one big enough
+            CHECK(!fs.openRead(ctx, ctx.headers[tag]).has_value());
+            std::array<uint8_t, 100> small;
+            auto reader = fs.openRead(ctx, ctx.headers[tag], small);
+            std::array<uint8_t, 1> one;
+            CHECK(reader.has_value() && (data.empty() || !fs.read(*reader, one).has_value()));
+            // Small chunks, not in place
+            std::array<uint8_t, 1024> decode;
+            reader = fs.openRead(ctx, ctx.headers[tag], decode);
+            CHECK(reader.has_value());
+            CHECK(!fs.map(*reader).has_value());
+            std::vector<uint8_t> out(data.size() + 1);
+            std::span<uint8_t> dest{out};
+            while (true)
+            {
+                const auto n = fs.read(*reader, dest.first(std::min<size_t>(77, dest.size())));
+                CHECK(n.has_value());
+                if (*n == 0)
+                {
+                    break;
+                }
+                dest = dest.subspan(*n);
+            }
+            CHECK(dest.size() == 1);
+            CHECK(std::equal(data.begin(), data.end(), out.begin()));
+        }
+    };
+    // Returns the blocks taken, checking their checksums cover the whole
+    // data area
+    const auto write = [&](uint8_t tag, const std::vector<uint8_t> & data)
+    {
+        auto rh = fs.startWrite(ctx, tag, data.size(), buffer);
+        CHECK(rh.has_value());
+        for (size_t i = 0; i < data.size(); i += 100)
+        {
+            CHECK(fs.write(*rh, std::span{data}.subspan(i, std::min<size_t>(100, data.size() - i))));
+        }
+        CHECK(fs.finishWrite(ctx, *rh));
+        size_t taken = 0;
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+            const auto hdr = Fs::Header::read(storage, i * Storage::maxBlockSize());
+            if (hdr->tag == tag && !hdr->erased())
+            {
+                CHECK(hdr->compressed());
+                const auto data = i * Storage::maxBlockSize() + Fs::Header::size;
+                CHECK(storage.verifyChecksum(data, fs.blockDataSize(), hdr->checksum));
+                ++taken;
+            }
+        }
+        return taken;
+    };
+
+    const size_t textBlocks = write(1, text);
+    check(1, text);
+    const size_t noiseBlocks = write(2, noise);
+    check(2, noise);
+    std::cout << "compressed blocks: " << textBlocks << " text (of " << fileBlocks<Storage>(text.size())
+        << "), " << noiseBlocks << " noise (of " << fileBlocks<Storage>(noise.size()) << ")\n";
+    CHECK(textBlocks < fileBlocks<Storage>(text.size()) / 2);
+    CHECK(noiseBlocks <= fileBlocks<Storage>(noise.size()) + 1);
+
+    // An empty file still has its block
+    std::vector<uint8_t> empty;
+    CHECK(write(3, empty) == 1);
+    check(3, empty);
+
+    // Blocks reserved but not needed are erased, the files kept
+    typename Fs::Eraser eraser{};
+    const auto erased = fs.eraseStep(ctx, eraser, blocks.size());
+    CHECK(erased.has_value() && *erased > 0);
+    check(1, text);
+    check(2, noise);
+}
+
+// Updates a file and erases the old revision, with the state machines if
+// Async (counting the polls where the CPU was free for other work), and
+// returns the resulting flash
+template<bool Async>
+std::array<uint8_t, CountingStorage<false>::size()> asyncUpdate(size_t & busy)
+{
+    using Storage = CountingStorage<false, false, false, Async>;
+    using Fs = LockFs::LockFs<Storage>;
+    Storage storage;
+    Mounted<Storage> m{.storage = storage};
+    auto & fs = m.fs;
+    auto & ctx = m.ctx;
+    auto & blocks = m.blocks;
+    CHECK(fs.loadAll(ctx));
+
+    std::array<uint8_t, 1000> data;
+    std::iota(data.begin(), data.end(), 0);
+    CHECK(m.write(1, data));
+
+    std::ranges::reverse(data);
+    auto rh = fs.startWrite(ctx, 1, data.size());
+    CHECK(rh.has_value());
+    typename Fs::Eraser eraser{.pool = static_cast<uint32_t>(blocks.size())};
+    busy = 0;
+    const auto wait = [&](auto && step)
+    {
+        std::optional<bool> done;
+        while (!(done = step()).has_value())
+        {
+            ++busy;
+        }
+        CHECK(*done);
+    };
+    if constexpr (Async)
+    {
+        for (size_t i = 0; i < data.size(); i += 100)
+        {
+            typename Fs::AsyncWrite op{.data = std::span{data}.subspan(i, 100)};
+            wait([&]() { return fs.writeAsync(*rh, op); });
+        }
+        typename Fs::AsyncFinish finish{};
+        wait([&]() { return fs.finishWriteAsync(ctx, *rh, finish); });
+        typename Fs::AsyncErase erase{};
+        wait([&]() { return fs.eraseAsync(ctx, eraser, erase); });
+    }
+    else
+    {
+        for (size_t i = 0; i < data.size(); i += 100)
+        {
+            CHECK(fs.write(*rh, std::span{data}.subspan(i, 100)));
+        }
+        CHECK(fs.finishWrite(ctx, *rh));
+        CHECK(fs.eraseStep(ctx, eraser, blocks.size()).has_value());
+    }
+
+    CHECK(fs.loadAll(ctx));
+    CHECK(m.holds(1, data));
+    return storage.backing;
+}
+
 int main()
 {
     TestStorage storage;
@@ -107,4 +1875,77 @@ int main()
         std::fill(buf.begin(), buf.end(), 0xFF);
         storage.s.write(buf.data(), buf.size());
     }
+
+    {
+        const size_t blocks = CountingStorage<false>::size() / CountingStorage<false>::maxBlockSize();
+        const size_t single = mountTransactions<false>();
+        const size_t vectored = mountTransactions<true>();
+        std::cout << "mount transactions: " << single << " single, " << vectored << " vectored\n";
+        CHECK(single == blocks);
+        CHECK(vectored == blocks / LockFs::LockFs<CountingStorage<true>>::headerBatch);
+    }
+
+    {
+        const size_t single = readTransactions<false>();
+        const size_t vectored = readTransactions<true>();
+        std::cout << "read transactions: " << single << " single, " << vectored << " vectored\n";
+        // One per block, and no header reads
+        CHECK(single == fileBlocks<CountingStorage<false>>(1000));
+        CHECK(vectored == 1);
+    }
+
+    eraseSteps();
+    scrubbing();
+    indexedErases();
+    scrubLocked();
+
+    {
+        const size_t readBack = writeReadBack<false>(false);
+        const size_t incremental = writeReadBack<true>(false);
+        const size_t verified = writeReadBack<true>(true);
+        std::cout << "bytes read writing: " << readBack << " read back, "
+            << incremental << " incremental, " << verified << " verified\n";
+        CHECK(incremental < readBack);
+        CHECK(verified >= readBack);
+    }
+
+    {
+        const size_t unbuffered = pagedWrites<false>();
+        const size_t paged = pagedWrites<true>();
+        std::cout << "programs writing: " << unbuffered << " unbuffered, " << paged << " paged\n";
+        CHECK(paged < unbuffered);
+    }
+
+    interleavedWrites();
+
+    {
+        const size_t transactions = fragmentedWrite();
+        std::cout << "transactions reserving a fragmented file: " << transactions << "\n";
+        // Only writing the 34 headers
+        CHECK(transactions == 34);
+    }
+
+    customLayout();
+    legacyHeaders();
+    rangeLocks();
+    sectoredStorage();
+    sparseTags();
+    stripedStorage();
+    stripedAllocation();
+    imageBuilder();
+    patchUpdates();
+    compressedFiles<false, false>();
+    compressedFiles<true, true>();
+    packedFiles();
+
+    wearLevelling(false);
+    wearLevelling(true);
+
+    {
+        size_t blocking;
+        size_t busy;
+        CHECK(asyncUpdate<false>(blocking) == asyncUpdate<true>(busy));
+        std::cout << "polls while busy updating: " << busy << "\n";
+        CHECK(busy > 0);
+    }
 }
@@ -23,6 +23,7 @@ FILE * out = stdout;
 bool TimeoutStorage::flashRead(FlashAddr address, std::span<uint8_t> dest)
 {
     assert(dest.size() <= size());
+    ++reads;
     while (dest.size() > 0)
     {
         if (timeout == 0)
@@ -83,7 +84,15 @@ bool TimeoutStorage::flashLockFreeze()
     return true;
 }
 
+std::span<const uint8_t> TimeoutStorage::flashMap(FlashAddr address, FlashAddr size)
+{
+    assert(address + size <= this->size());
+    return std::span{backing}.subspan(address, size);
+}
+
 static_assert(LockFs::Storage<TimeoutStorage>);
+static_assert(LockFs::MappedStorage<TimeoutStorage>);
+static_assert(LockFs::IndexedStorage<TimeoutStorage>);
 
 bool flashRead(TimeoutStorage * ts, Addr addr, uint8_t * buf, size_t bufSize)
 {
@@ -160,6 +169,7 @@ int dumpTS(const TimeoutStorage * ts, char * buf, size_t len, const char * prefi
         }
 
         printed += append(buf, len, "%s\tfrozen: %s\n", prefix, ts->frozen ? "true" : "false");
+        printed += append(buf, len, "%s\treads: %u\n", prefix, (unsigned)ts->reads);
         printed += append(buf, len, "%s\tcompute: %d\n", prefix, ts->computeChecksum(0, 0));
         printed += append(buf, len, "%s\tverify0: %d\n", prefix, ts->verifyChecksum(0, 0, 0));
     }
@@ -179,10 +189,16 @@ int dumpH(const Fs::Header * h, char * buf, size_t len, const char * prefix)
         const char * sep = "";
         if (h->flags & Fs::Header::ERASED_BIT) { printed += append(buf, len, "%sErased", sep); sep = "|"; }
         if (h->flags & Fs::Header::CONTINUATION_BIT) { printed += append(buf, len, "%sContinuation", sep); sep = "|"; }
+        if (!(h->flags & Fs::Header::PATCH_BIT)) { printed += append(buf, len, "%sPatch", sep); sep = "|"; }
+        if (!(h->flags & Fs::Header::COMPRESSED_BIT)) { printed += append(buf, len, "%sCompressed", sep); sep = "|"; }
+        if (!(h->flags & Fs::Header::BAD_BIT)) { printed += append(buf, len, "%sBad", sep); sep = "|"; }
+        if (!(h->flags & Fs::Header::PACKED_BIT)) { printed += append(buf, len, "%sPacked", sep); sep = "|"; }
         if (h->flags == 0) { printed += append(buf, len, "%s(none)", sep); sep = "|"; }
         printed += append(buf, len, "\n");
     }
     printed += append(buf, len, "%s\trevision:  %d\n", prefix, h->revision);
+    printed += append(buf, len, "%s\teraseCount: %u\n", prefix, (unsigned)h->eraseCount);
+    printed += append(buf, len, "%s\tposition:  %u\n", prefix, (unsigned)h->position);
     printed += append(buf, len, "%s}", prefix);
     return printed;
 }
@@ -237,9 +253,35 @@ int dumpFS(const Fs * fs, char * buf, size_t len, const char * prefix)
     return printed;
 }
 
-Fs::Context * context(Fs::RamHeader * buf, size_t size)
+int dumpCounters(const LockFs::Counters * c, char * buf, size_t len, const char * prefix)
 {
-    return new Fs::Context{.headers = std::span{buf, size}};
+    int printed = 0;
+    printed += append(buf, len, "%sCounters(%p){\n", prefix, c);
+    printed += append(buf, len, "%s\theaderReads:     %zu\n", prefix, c->headerReads);
+    printed += append(buf, len, "%s\theaderWrites:    %zu\n", prefix, c->headerWrites);
+    printed += append(buf, len, "%s\tbytesProgrammed: %zu\n", prefix, c->bytesProgrammed);
+    printed += append(buf, len, "%s\tchecksums:       %zu\n", prefix, c->checksums);
+    printed += append(buf, len, "%s\tblocksSkipped:   %zu\n", prefix, c->blocksSkipped);
+    printed += append(buf, len, "%s\tlocks:           %zu\n", prefix, c->locks);
+    printed += append(buf, len, "%s}", prefix);
+    return printed;
+}
+
+Fs::Context * context(
+    Fs::RamHeader * buf, size_t size,
+    Fs::BlockInfo * blocks, size_t blocksSize,
+    Fs::Reservation * writers, size_t writersSize,
+    uint32_t * freeMap, size_t freeMapSize,
+    bool sparse
+)
+{
+    return new Fs::Context{
+        .headers = std::span{buf, size},
+        .blocks = std::span{blocks, blocksSize},
+        .writers = std::span{writers, writersSize},
+        .freeMap = std::span{freeMap, freeMapSize},
+        .sparse = sparse,
+    };
 }
 
 Fs * create(TimeoutStorage * ts)
@@ -247,14 +289,29 @@ Fs * create(TimeoutStorage * ts)
     return new Fs{.s = ts};
 }
 
+LockFs::Counters * counters(Fs * fs)
+{
+    return &fs->instrument.counters;
+}
+
+void trace(Fs * fs, void (*cb)(LockFs::Event event, bool begin))
+{
+    fs->instrument.trace = cb;
+}
+
 bool loadAll(Fs * fs, Fs::Context * ctx)
 {
     return fs->loadAll(*ctx);
 }
 
-bool startWrite(Fs * fs, Fs::Context ctx, uint8_t tag, Addr size, Fs::RamHeader * out)
+bool loadRest(Fs * fs, Fs::Context * ctx)
 {
-    const auto opt = fs->startWrite(ctx, tag, size);
+    return fs->loadRest(*ctx);
+}
+
+bool startWrite(Fs * fs, Fs::Context * ctx, uint8_t tag, Addr size, Fs::RamHeader * out)
+{
+    const auto opt = fs->startWrite(*ctx, tag, size);
     if (opt.has_value())
     {
         *out = *opt;
@@ -268,7 +325,63 @@ bool write(Fs * fs, Fs::RamHeader * rh, const uint8_t * src, size_t len)
     return fs->write(*rh, std::span{src, len});
 }
 
-bool finishWrite(Fs * fs, Fs::RamHeader * rh)
+bool finishWrite(Fs * fs, Fs::Context * ctx, Fs::RamHeader * rh)
+{
+    return fs->finishWrite(*ctx, *rh);
+}
+
+bool writePacked(Fs * fs, Fs::Context * ctx, uint8_t tag, const uint8_t * src, size_t len)
 {
-    return fs->finishWrite(*rh);
+    return fs->writePacked(*ctx, tag, std::span{src, len});
+}
+
+bool scan(Fs * fs, Fs::Context * ctx)
+{
+    return fs->scan(*ctx);
+}
+
+bool eraseStep(Fs * fs, Fs::Context * ctx, Fs::Eraser * eraser, Addr maxBlocks, Addr * out)
+{
+    const auto opt = fs->eraseStep(*ctx, *eraser, maxBlocks);
+    if (opt.has_value())
+    {
+        *out = *opt;
+        return true;
+    }
+    return false;
+}
+
+bool openRead(Fs * fs, Fs::Context * ctx, uint8_t tag, Fs::Reader * out)
+{
+    const Fs::RamHeader * file = fs->fileHeader(*ctx, tag);
+    const auto opt = file != nullptr ? fs->openRead(*ctx, *file) : std::nullopt;
+    if (opt.has_value())
+    {
+        *out = *opt;
+        return true;
+    }
+    return false;
+}
+
+bool read(Fs * fs, Fs::Reader * reader, uint8_t * dest, size_t len, Addr * out)
+{
+    const auto opt = fs->read(*reader, std::span{dest, len});
+    if (opt.has_value())
+    {
+        *out = *opt;
+        return true;
+    }
+    return false;
+}
+
+bool map(Fs * fs, Fs::Reader * reader, const uint8_t ** data, size_t * len)
+{
+    const auto opt = fs->map(*reader);
+    if (opt.has_value())
+    {
+        *data = opt->data();
+        *len = opt->size();
+        return true;
+    }
+    return false;
 }
@@ -3,14 +3,15 @@
 #include "lockfs/flash_interface.hpp"
 #include "lockfs/lockfs.hpp"
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <span>
 
 using Addr = uint32_t;
 
-constexpr uint8_t maxBlockSize_ = 8;
-constexpr Addr size_ = 64;
+constexpr uint8_t maxBlockSize_ = 128;
+constexpr Addr size_ = 1024;
 constexpr Addr blocks_ = size_ / maxBlockSize_;
 
 // Has a timeout and simulates power-off after that many steps
@@ -21,6 +22,11 @@ struct TimeoutStorage
     using Checksum = uint8_t;
     static constexpr uint8_t maxBlockSize() { return ::maxBlockSize_; }
     static constexpr FlashAddr size() { return ::size_; }
+    // Last two blocks
+    static constexpr std::array<FlashAddr, 2> indexBlocks()
+    {
+        return {size() - 2 * maxBlockSize(), size() - maxBlockSize()};
+    }
 
     Checksum (*computeChecksum)(FlashAddr addr, BlockSize size);
     bool (*verifyChecksum)(FlashAddr addr, BlockSize size, Checksum);
@@ -28,18 +34,21 @@ struct TimeoutStorage
     uint8_t backing[::size_];
     bool locked[::blocks_];
     bool frozen = false;
+    // Number of flashRead calls
+    size_t reads = 0;
 
     bool flashRead(FlashAddr address, std::span<uint8_t> dest);
     bool flashWrite(std::span<const uint8_t> src, FlashAddr address);
     bool flashErase(FlashAddr block);
     bool flashLock(FlashAddr address, uint8_t tag);
     bool flashLockFreeze();
+    std::span<const uint8_t> flashMap(FlashAddr address, FlashAddr size);
 };
 
 static_assert(LockFs::Storage<TimeoutStorage>);
 
 using Addr = TimeoutStorage::FlashAddr;
-using Fs = LockFs::LockFs<TimeoutStorage>;
+using Fs = LockFs::LockFs<TimeoutStorage, LockFs::CountingInstrumentation>;
 
 extern "C"
 {
@@ -54,11 +63,28 @@ extern "C"
     int dumpH(const Fs::Header * h, char * buf, size_t len, const char * prefix);
     int dumpRH(const Fs::RamHeader * rh, char * buf, size_t len, const char * prefix);
     int dumpFS(const Fs * fs, char * buf, size_t len, const char * prefix);
+    int dumpCounters(const LockFs::Counters * c, char * buf, size_t len, const char * prefix);
 
-    Fs::Context * context(Fs::RamHeader * buf, size_t size);
+    Fs::Context * context(
+        Fs::RamHeader * buf, size_t size,
+        Fs::BlockInfo * blocks, size_t blocksSize,
+        Fs::Reservation * writers, size_t writersSize,
+        uint32_t * freeMap, size_t freeMapSize,
+        bool sparse
+    );
     Fs * create(TimeoutStorage * ts);
+    // Live counters of the instrumentation, and its trace callback
+    LockFs::Counters * counters(Fs * fs);
+    void trace(Fs * fs, void (*cb)(LockFs::Event event, bool begin));
     bool loadAll(Fs * fs, Fs::Context * ctx);
-    bool startWrite(Fs * fs, Fs::Context ctx, uint8_t tag, Addr size, Fs::RamHeader * out);
+    bool loadRest(Fs * fs, Fs::Context * ctx);
+    bool startWrite(Fs * fs, Fs::Context * ctx, uint8_t tag, Addr size, Fs::RamHeader * out);
     bool write(Fs * fs, Fs::RamHeader * rh, const uint8_t * src, size_t len);
-    bool finishWrite(Fs * fs, Fs::RamHeader * rh);
+    bool finishWrite(Fs * fs, Fs::Context * ctx, Fs::RamHeader * rh);
+    bool writePacked(Fs * fs, Fs::Context * ctx, uint8_t tag, const uint8_t * src, size_t len);
+    bool scan(Fs * fs, Fs::Context * ctx);
+    bool eraseStep(Fs * fs, Fs::Context * ctx, Fs::Eraser * eraser, Addr maxBlocks, Addr * out);
+    bool openRead(Fs * fs, Fs::Context * ctx, uint8_t tag, Fs::Reader * out);
+    bool read(Fs * fs, Fs::Reader * reader, uint8_t * dest, size_t len, Addr * out);
+    bool map(Fs * fs, Fs::Reader * reader, const uint8_t ** data, size_t * len);
 };
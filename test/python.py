@@ -1,6 +1,8 @@
 from __future__ import annotations
 
 import enum
+import random
+import sys
 from ctypes import (
     CDLL,
     CFUNCTYPE,
@@ -10,15 +12,21 @@ from ctypes import (
     c_byte,
     c_char,
     c_char_p,
+    c_int,
     c_size_t,
     c_uint8,
+    c_uint16,
     c_uint32,
     c_void_p,
     create_string_buffer,
+    string_at,
 )
 from pathlib import Path
 
-build = Path(__file__).parent.parent / "build" / "libpython.so"
+build = (
+    Path(sys.argv[1]).resolve() if len(sys.argv) > 1 else
+    Path(__file__).parent.parent / "build" / "libpython.so"
+)
 
 lib = CDLL(build)
 
@@ -40,8 +48,9 @@ class TimeoutStorage(Structure):
         ("verifyChecksumCb", VerifyChecksum),
         ("timeout", c_size_t),
         ("backing", c_byte * size),
-        ("locked", c_bool * (size // 8)),
+        ("locked", c_bool * blocks),
         ("frozen", c_bool),
+        ("reads", c_size_t),
     )
 
     def __init__(self, *args: object, **kw: object) -> None:
@@ -73,7 +82,7 @@ class TimeoutStorage(Structure):
         return print(self.__repr__(prefix))
 
     def __repr__(self, prefix: str = "") -> str:
-        buf = create_string_buffer(1024)
+        buf = create_string_buffer(16384)
         n = lib.dumpTS(TimeoutStorageP(self), buf, len(buf), prefix.encode())
         d = buf[:n]
         assert isinstance(d, bytes)
@@ -105,9 +114,15 @@ class Header(Structure):
     class Flags(enum.IntFlag):
         Erased = 0x80
         Continuation = 0x40
+        Index = 0x20
+        Patch = 0x10
+        Compressed = 0x08
+        Bad = 0x04
+        Packed = 0x02
 
     Erased = Flags.Erased
     Continuation = Flags.Continuation
+    Patch = Flags.Patch
 
     class CFlags(c_uint8):
         def __repr__(self) -> str:
@@ -117,7 +132,7 @@ class Header(Structure):
         return print(self.__repr__(prefix))
 
     def __repr__(self, prefix: str = "") -> str:
-        buf = create_string_buffer(1024)
+        buf = create_string_buffer(16384)
         n = lib.dumpH(HeaderP(self), buf, len(buf), prefix.encode())
         d = buf[:n]
         assert isinstance(d, bytes)
@@ -130,6 +145,8 @@ Header._fields_ = (
     ("tag", c_uint8),
     ("flags", Header.CFlags),
     ("revision", c_uint8),
+    ("eraseCount", c_uint32),
+    ("position", c_uint16),
 )
 
 HeaderP = POINTER(Header)
@@ -138,19 +155,63 @@ lib.dumpH.argtypes = (HeaderP, c_byte_p, c_size_t, c_char_p)
 lib.dumpH.restype = None
 
 
+class BlockInfo(Structure):
+    _fields_ = (
+        ("blockSize", BlockSize),
+        ("tag", c_uint8),
+        ("flags", Header.CFlags),
+        ("revision", c_uint8),
+        ("eraseCount", c_uint32),
+        ("position", c_uint16),
+        ("live", c_bool),
+        ("locked", c_bool),
+        ("reserved", c_bool),
+        ("unread", c_bool),
+    )
+
+    def __repr__(self) -> str:
+        return (
+            f"BlockInfo(blockSize={self.blockSize}, tag={self.tag}, "
+            f"flags={self.flags!r}, revision={self.revision}, "
+            f"eraseCount={self.eraseCount}, position={self.position}, live={self.live}, "
+            f"locked={self.locked}, reserved={self.reserved}, unread={self.unread})"
+        )
+
+
+BlockInfoP = POINTER(BlockInfo)
+
+
+class Extent(Structure):
+    _fields_ = (
+        ("first", Addr),
+        ("count", Addr),
+    )
+
+
 class RamHeader(Structure):
     _fields_ = (
         ("current", Header),
         ("startBlock", Addr),
         ("currentBlock", Addr),
         ("size", Addr),
+        ("positions", c_uint16),
+        ("base", c_uint8),
+        ("blocks", BlockInfoP),
+        ("blocksSize", c_size_t),
+        ("extents", Extent * 4),
+        ("extentCount", c_uint8),
+        ("extent", c_uint8),
+        ("buffer", c_void_p),
+        ("bufferSize", c_size_t),
+        ("buffered", Addr),
+        ("blockDone", c_bool),
     )
 
     def dump(self, prefix: str = "") -> None:
         return print(self.__repr__(prefix))
 
     def __repr__(self, prefix: str = "") -> str:
-        buf = create_string_buffer(1024)
+        buf = create_string_buffer(16384)
         n = lib.dumpRH(RamHeaderP(self), buf, len(buf), prefix.encode())
         d = buf[:n]
         assert isinstance(d, bytes)
@@ -162,29 +223,118 @@ RamHeaderP = POINTER(RamHeader)
 lib.dumpRH.argtypes = (RamHeaderP, c_byte_p, c_size_t, c_char_p)
 lib.dumpRH.restype = None
 
-lib.context.argtypes = (RamHeaderP, c_size_t)
+
+class Reservation(Structure):
+    _fields_ = (
+        ("tag", c_uint8),
+        ("revision", c_uint8),
+        ("startBlock", Addr),
+        ("endBlock", Addr),
+        ("active", c_bool),
+    )
+
+
+ReservationP = POINTER(Reservation)
+
+lib.context.argtypes = (
+    RamHeaderP, c_size_t, BlockInfoP, c_size_t, ReservationP, c_size_t, POINTER(c_uint32), c_size_t, c_bool
+)
 lib.context.restype = c_void_p
 
 
+
 class ContextP(c_void_p):
-    def __init__(self, size: int) -> None:
+    def __init__(self, size: int, writers: int = 1, sparse: bool = False) -> None:
         self.RamHeaders = RamHeader * size
         self.headers = self.RamHeaders()
-        void_p = lib.context(self.headers, len(self.headers))
+        self.blocks = (BlockInfo * TimeoutStorage.blocks)()
+        self.writers = (Reservation * writers)()
+        self.freeMap = (c_uint32 * ((TimeoutStorage.blocks + 31) // 32))()
+        void_p = lib.context(
+            self.headers, len(self.headers), self.blocks, len(self.blocks),
+            self.writers, len(self.writers), self.freeMap, len(self.freeMap), sparse,
+        )
         super().__init__(void_p)
 
     def __repr__(self, prefix: str = "") -> str:
         return "\n".join(
             f"{str(i) + ' ':-<80}\n" +
             hdr.__repr__(prefix=prefix+f"{i:<4}")
-            for i, hdr in enumerate(ctx.headers)
+            for i, hdr in enumerate(self.headers)
         )
 
 
+class Reader(Structure):
+    _fields_ = (
+        ("blocks", BlockInfoP),
+        ("blocksSize", c_size_t),
+        ("tag", c_uint8),
+        ("revision", c_uint8),
+        ("currentBlock", Addr),
+        ("offset", Addr),
+        ("remaining", Addr),
+        ("position", c_uint16),
+        ("patch", c_bool),
+        ("compressed", c_bool),
+        ("buffer", c_void_p),
+        ("bufferSize", c_size_t),
+        ("decodedBlock", Addr),
+    )
+
+
+ReaderP = POINTER(Reader)
+
+
+class Eraser(Structure):
+    _fields_ = (
+        ("nextBlock", Addr),
+        ("pool", Addr),
+    )
+
+
+EraserP = POINTER(Eraser)
+
 lib.create.argtypes = (TimeoutStorageP,)
 lib.create.restype = c_void_p
 
 
+class Event(enum.IntEnum):
+    LoadAll = 0
+    StartWrite = 1
+    Write = 2
+    FinishWrite = 3
+
+
+Trace = CFUNCTYPE(None, c_uint8, c_bool)
+
+
+class Counters(Structure):
+    _fields_ = (
+        ("headerReads", c_size_t),
+        ("headerWrites", c_size_t),
+        ("bytesProgrammed", c_size_t),
+        ("checksums", c_size_t),
+        ("blocksSkipped", c_size_t),
+        ("locks", c_size_t),
+    )
+
+    def dump(self, prefix: str = "") -> None:
+        return print(self.__repr__(prefix))
+
+    def __repr__(self, prefix: str = "") -> str:
+        buf = create_string_buffer(16384)
+        n = lib.dumpCounters(CountersP(self), buf, len(buf), prefix.encode())
+        d = buf[:n]
+        assert isinstance(d, bytes)
+        return str(d.decode())
+
+
+CountersP = POINTER(Counters)
+
+lib.dumpCounters.argtypes = (CountersP, c_byte_p, c_size_t, c_char_p)
+lib.dumpCounters.restype = c_int
+
+
 class LockFsP(c_void_p):
     def __init__(self, storage: TimeoutStorage = TimeoutStorage()) -> None:
         void_p = lib.create(TimeoutStorageP(storage))
@@ -193,6 +343,9 @@ class LockFsP(c_void_p):
     def loadAll(self, context: ContextP) -> bool:
         return lib.loadAll(self, context)
 
+    def loadRest(self, context: ContextP) -> bool:
+        return lib.loadRest(self, context)
+
     def startWrite(self, context: ContextP, tag: int, size: int) -> RamHeader | None:
         out = RamHeader()
         if lib.startWrite(self, context, tag, size, RamHeaderP(out)):
@@ -201,14 +354,54 @@ class LockFsP(c_void_p):
     def write(self, ramHeader: RamHeader, data: bytes) -> bool:
         return lib.write(self, RamHeaderP(ramHeader), data, len(data))
 
-    def finishWrite(self, ramHeader: RamHeader) -> bool:
-        return lib.finishWrite(self, RamHeaderP(ramHeader))
+    def finishWrite(self, context: ContextP, ramHeader: RamHeader) -> bool:
+        return lib.finishWrite(self, context, RamHeaderP(ramHeader))
+
+    def writePacked(self, context: ContextP, tag: int, data: bytes) -> bool:
+        return lib.writePacked(self, context, tag, data, len(data))
+
+    def scan(self, context: ContextP) -> bool:
+        return lib.scan(self, context)
+
+    def eraseStep(self, context: ContextP, eraser: Eraser, maxBlocks: int) -> int | None:
+        out = Addr()
+        if lib.eraseStep(self, context, EraserP(eraser), maxBlocks, POINTER(Addr)(out)):
+            return out.value
+
+    def openRead(self, context: ContextP, tag: int) -> Reader | None:
+        out = Reader()
+        if lib.openRead(self, context, tag, ReaderP(out)):
+            return out
+
+    def read(self, reader: Reader, size: int) -> bytes | None:
+        data = create_string_buffer(size)
+        out = Addr()
+        if lib.read(self, ReaderP(reader), data, len(data), POINTER(Addr)(out)):
+            return data.raw[:out.value]
+
+    def map(self, reader: Reader) -> bytes | None:
+        data = c_void_p()
+        size = c_size_t()
+        if lib.map(self, ReaderP(reader), POINTER(c_void_p)(data), POINTER(c_size_t)(size)):
+            return string_at(data, size.value) if size.value else b""
+
+    def counters(self) -> Counters:
+        # Snapshot
+        return Counters.from_buffer_copy(lib.counters(self).contents)
+
+    def resetCounters(self) -> None:
+        lib.counters(self)[0] = Counters()
+
+    def trace(self, events: list[tuple[Event, bool]] | None) -> None:
+        # Keep the callback alive as long as it is set
+        self.traceCb = Trace(lambda e, b: events.append((Event(e), b))) if events is not None else Trace()
+        lib.trace(self, self.traceCb)
 
     def dump(self, prefix: str = "") -> None:
         return print(self.__repr__(prefix))
 
     def __repr__(self, prefix: str = "") -> str:
-        buf = create_string_buffer(1024)
+        buf = create_string_buffer(16384)
         n = lib.dumpFS(self, buf, len(buf), prefix.encode())
         d = buf[:n]
         assert isinstance(d, bytes)
@@ -218,18 +411,45 @@ class LockFsP(c_void_p):
 lib.loadAll.argtypes = (LockFsP, ContextP)
 lib.loadAll.restype = c_bool
 
+lib.loadRest.argtypes = (LockFsP, ContextP)
+lib.loadRest.restype = c_bool
+
 lib.startWrite.argtypes = (LockFsP, ContextP, c_uint8, Addr, RamHeaderP)
 lib.startWrite.restype = c_bool
 
 lib.write.argtypes = (LockFsP, RamHeaderP, c_byte_p, c_size_t)
 lib.write.restype = c_bool
 
-lib.finishWrite.argtypes = (LockFsP, RamHeaderP)
+lib.finishWrite.argtypes = (LockFsP, ContextP, RamHeaderP)
 lib.finishWrite.restype = c_bool
 
+lib.writePacked.argtypes = (LockFsP, ContextP, c_uint8, c_byte_p, c_size_t)
+lib.writePacked.restype = c_bool
+
+lib.scan.argtypes = (LockFsP, ContextP)
+lib.scan.restype = c_bool
+
+lib.eraseStep.argtypes = (LockFsP, ContextP, EraserP, Addr, POINTER(Addr))
+lib.eraseStep.restype = c_bool
+
+lib.openRead.argtypes = (LockFsP, ContextP, c_uint8, ReaderP)
+lib.openRead.restype = c_bool
+
+lib.read.argtypes = (LockFsP, ReaderP, c_byte_p, c_size_t, POINTER(Addr))
+lib.read.restype = c_bool
+
+lib.map.argtypes = (LockFsP, ReaderP, POINTER(c_void_p), POINTER(c_size_t))
+lib.map.restype = c_bool
+
 lib.dumpFS.argtypes = (LockFsP, c_byte_p, c_size_t, c_char_p)
 lib.dumpFS.restype = None
 
+lib.counters.argtypes = (LockFsP,)
+lib.counters.restype = CountersP
+
+lib.trace.argtypes = (LockFsP, Trace)
+lib.trace.restype = None
+
 ts = TimeoutStorage(timeout=TimeoutStorage.size)
 ts.dump()
 print("-" * 80)
@@ -237,7 +457,7 @@ for b in range(ts.blocks):
     print("Erase", b, ts.flashErase(b * ts.maxBlockSize))
 ts.dump()
 print("-" * 80)
-ts.timeout = 128
+ts.timeout = 1024
 
 ctx = ContextP(2)
 print(ctx)
@@ -245,9 +465,9 @@ fs = LockFsP(ts)
 print("Load all", fs.loadAll(ctx))
 
 tag = 0
-msg = b"hello"
+msg = b"hello " * 33
 print("timeout", ts.timeout)
-ts.timeout = 128
+ts.timeout = 1024
 print("startWrite")
 rh = fs.startWrite(ctx, tag, len(msg))
 assert rh
@@ -256,11 +476,379 @@ print("timeout", ts.timeout)
 print("Write:")
 print("write", fs.write(rh, msg))
 print("timeout", ts.timeout)
-print("finishWrite", fs.finishWrite(rh))
+print("finishWrite", fs.finishWrite(ctx, rh))
 ts.dump()
 fs.dump()
 
-ts.frozen = False
+
+def reboot(ts: TimeoutStorage) -> None:
+    ts.frozen = False
+    ts.timeout = 1 << 20
+    for i in range(ts.blocks):
+        ts.locked[i] = False
+
+
+reboot(ts)
+ts.reads = 0
+ctx = ContextP(2)
+assert fs.scan(ctx)
+# Each header is read once
+assert ts.reads == ts.blocks, ts.reads
+
+ts.reads = 0
 ctx = ContextP(2)
-fs.loadAll(ctx)
+assert fs.loadAll(ctx)
 print(ctx)
+# Mounted from the index, reading only the headers of the file's blocks
+assert ts.reads < ts.blocks, ts.reads
+assert ctx.headers[tag].size == len(msg)
+assert [bool(locked) for locked in ts.locked] == [b.live for b in ctx.blocks]
+assert any(ts.locked)
+
+dataSize = ts.maxBlockSize - c_uint32.in_dll(lib, "headerSize").value
+reader = fs.openRead(ctx, tag)
+assert reader
+ts.reads = 0
+assert fs.read(reader, 4) == msg[:4]
+assert fs.read(reader, len(msg)) == msg[4:]
+assert fs.read(reader, 4) == b""
+# Only data reads, the blocks are found from the summaries
+assert ts.reads == 3, ts.reads
+
+# Zero-copy, straight from the backing array
+reader = fs.openRead(ctx, tag)
+assert reader
+ts.reads = 0
+assert fs.map(reader) == msg[:dataSize]
+assert fs.map(reader) == msg[dataSize:]
+assert fs.map(reader) == b""
+assert ts.reads == 0
+
+
+def writeFile(fs: LockFsP, ctx: ContextP, tag: int, data: bytes) -> bool:
+    rh = fs.startWrite(ctx, tag, len(data))
+    return bool(rh) and fs.write(rh, data) and fs.finishWrite(ctx, rh)
+
+
+def readFile(fs: LockFsP, ctx: ContextP, tag: int) -> bytes | None:
+    reader = fs.openRead(ctx, tag)
+    if reader:
+        return fs.read(reader, TimeoutStorage.size)
+
+
+def summary(ctx: ContextP) -> list[tuple[int, ...]]:
+    return [
+        (hdr.startBlock, hdr.current.revision)
+        for hdr in ctx.headers
+        if not hdr.current.flags.value & Header.Erased
+    ] + [
+        (b.blockSize, b.tag, b.flags.value, b.revision, b.eraseCount, b.position)
+        for b in ctx.blocks
+    ]
+
+
+# Power loss at every step of an update, the mount (using the index if it
+# is up to date, else scanning) must find the old or the new file
+old = b"old " * 40
+new = b"NEW!" * 60
+ts = TimeoutStorage(timeout=1 << 20)
+for b in range(ts.blocks):
+    assert ts.flashErase(b * ts.maxBlockSize)
+fs = LockFsP(ts)
+ctx = ContextP(2)
+assert fs.loadAll(ctx)
+assert writeFile(fs, ctx, tag, old)
+base = bytes(ts.backing)
+
+cut = 0
+while True:
+    ts.backing[:] = base
+    reboot(ts)
+    ctx = ContextP(2)
+    assert fs.loadAll(ctx)
+    ts.timeout = cut
+    done = writeFile(fs, ctx, tag, new) and ts.timeout > 0
+
+    reboot(ts)
+    fs.resetCounters()
+    ctx = ContextP(2)
+    assert fs.loadAll(ctx)
+    reads = fs.counters().headerReads
+    got = readFile(fs, ctx, tag)
+    assert got in (old, new), (cut, got)
+    scanned = ContextP(2)
+    assert fs.scan(scanned)
+    assert fs.loadRest(ctx)
+    assert summary(ctx) == summary(scanned), cut
+    if done:
+        assert got == new
+        # From the index, only the file's headers (and the index's and the
+        # next free block's)
+        assert reads == 2 + 1 + 3, reads
+        break
+    cut += 1
+print("Power loss at", cut, "points")
+
+# Background erase of the old revision, one block per step, never touching
+# the locked blocks (TimeoutStorage asserts that)
+reboot(ts)
+ctx = ContextP(2)
+assert fs.loadAll(ctx)
+eraser = Eraser(nextBlock=0, pool=ts.blocks)
+steps = 0
+while fs.eraseStep(ctx, eraser, 1):
+    steps += 1
+assert steps > 0
+assert all(b.live or b.tag == 0xFF for b in ctx.blocks)
+assert readFile(fs, ctx, tag) == new
+# And the space is reusable
+assert writeFile(fs, ctx, 1, old)
+reboot(ts)
+ctx = ContextP(2)
+assert fs.loadAll(ctx)
+assert readFile(fs, ctx, tag) == new
+assert readFile(fs, ctx, 1) == old
+
+# The commit is a single program of the start block's header, the other
+# blocks are finished as they are sealed. Cut anywhere, the mount must find
+# the old or the new file, and a write carrying on from what the cut left
+# behind (without erasing it) must never pick up those blocks.
+old = b"old " * 20
+new = b"NEW!" * 60
+again = b"Again " * 30
+ts = TimeoutStorage(timeout=1 << 20)
+for b in range(ts.blocks):
+    assert ts.flashErase(b * ts.maxBlockSize)
+fs = LockFsP(ts)
+ctx = ContextP(2)
+assert fs.loadAll(ctx)
+assert writeFile(fs, ctx, tag, old)
+base = bytes(ts.backing)
+
+cut = 0
+sealed = 0
+while True:
+    ts.backing[:] = base
+    reboot(ts)
+    ctx = ContextP(2)
+    assert fs.loadAll(ctx)
+    ts.timeout = cut
+    done = writeFile(fs, ctx, tag, new) and ts.timeout > 0
+
+    reboot(ts)
+    ctx = ContextP(2)
+    assert fs.loadAll(ctx)
+    got = readFile(fs, ctx, tag)
+    if done:
+        assert got == new
+        break
+    assert got in (old, new), (cut, got)
+    # Blocks of the new revision finished before the cut, but not committed
+    assert fs.loadRest(ctx)
+    sealed += got == old and any(
+        b.tag == tag and not b.flags.value & Header.Erased and not b.live
+        for b in ctx.blocks
+    )
+    assert writeFile(fs, ctx, tag, again), cut
+    reboot(ts)
+    ctx = ContextP(2)
+    assert fs.loadAll(ctx)
+    assert readFile(fs, ctx, tag) == again, cut
+    scanned = ContextP(2)
+    assert fs.scan(scanned)
+    assert fs.loadRest(ctx)
+    assert summary(ctx) == summary(scanned), cut
+    cut += 1
+print("Commit cut at", cut, "points,", sealed, "after sealing blocks")
+assert sealed > 0
+
+# Small files packed into a block, each a record committed by one program
+# of its flags. Cut anywhere while adding one to the block (opened since
+# the mount, so the index records where the next record goes), the mount
+# must find the old or the new file and the other file as it was.
+old = b"old " * 10
+new = b"NEW!" * 12
+ts = TimeoutStorage(timeout=1 << 20)
+for b in range(ts.blocks):
+    assert ts.flashErase(b * ts.maxBlockSize)
+fs = LockFsP(ts)
+ctx = ContextP(2)
+assert fs.loadAll(ctx)
+assert fs.writePacked(ctx, 0, old)
+base = bytes(ts.backing)
+
+cut = 0
+while True:
+    ts.backing[:] = base
+    reboot(ts)
+    ctx = ContextP(2)
+    assert fs.loadAll(ctx)
+    assert fs.writePacked(ctx, 1, b"other")
+    ts.timeout = cut
+    done = fs.writePacked(ctx, 0, new) and ts.timeout > 0
+
+    reboot(ts)
+    ctx = ContextP(2)
+    assert fs.loadAll(ctx)
+    got = readFile(fs, ctx, 0)
+    assert got in (old, new), (cut, got)
+    assert readFile(fs, ctx, 1) == b"other", cut
+    scanned = ContextP(2)
+    assert fs.scan(scanned)
+    assert fs.loadRest(ctx)
+    assert summary(ctx) == summary(scanned), cut
+    if done:
+        assert got == new
+        break
+    cut += 1
+print("Packed write cut at", cut, "points")
+# Both files in one block, the old file's block erased once stale
+packed = [b for b in ctx.blocks if b.flags.value & Header.Flags.Packed == 0]
+assert len(packed) == 2 and [b.live for b in packed] == [False, True]
+eraser = Eraser(nextBlock=0, pool=ts.blocks)
+assert fs.eraseStep(ctx, eraser, ts.blocks) == 1
+assert readFile(fs, ctx, 0) == new
+
+# Interleaved writers, cut at random points and carrying on from whatever
+# the cut left behind (the eraser reclaims the unfinished blocks). Each
+# file must always be its last finished version.
+rng = random.Random(0)
+ts = TimeoutStorage(timeout=1 << 20)
+for b in range(ts.blocks):
+    assert ts.flashErase(b * ts.maxBlockSize)
+fs = LockFsP(ts)
+ctx = ContextP(2, writers=2)
+assert fs.loadAll(ctx)
+files = [b"a" * 150, b"b" * 60]
+for t, data in enumerate(files):
+    assert writeFile(fs, ctx, t, data)
+# Only one write per tag
+rh = fs.startWrite(ctx, 0, 10)
+assert rh
+assert not fs.startWrite(ctx, 0, 10)
+
+cuts = 0
+for n in range(200):
+    reboot(ts)
+    ctx = ContextP(2, writers=2)
+    assert fs.loadAll(ctx)
+    for t, data in enumerate(files):
+        assert readFile(fs, ctx, t) == data, (n, t)
+    eraser = Eraser(nextBlock=0, pool=ts.blocks)
+    while fs.eraseStep(ctx, eraser, ts.blocks):
+        pass
+
+    updates = [
+        bytes([65 + n % 26]) * rng.randint(124, 240),
+        bytes([97 + n % 26]) * rng.randint(1, 120),
+    ]
+    ts.timeout = rng.randint(0, 1500)
+    writers = [fs.startWrite(ctx, t, len(data)) for t, data in enumerate(updates)]
+    if not all(writers):
+        cuts += 1
+        continue
+    offsets = [0, 0]
+    order = [t for t, data in enumerate(updates) for _ in range(0, len(data), 16)]
+    rng.shuffle(order)
+    ok = True
+    for t in order:
+        chunk = updates[t][offsets[t]:offsets[t] + 16]
+        offsets[t] += len(chunk)
+        ok = ok and fs.write(writers[t], chunk)
+    attempted = []
+    for t in rng.sample(range(2), 2):
+        if ok:
+            attempted.append(t)
+            ok = fs.finishWrite(ctx, writers[t]) and ts.timeout > 0
+            if ok:
+                files[t] = updates[t]
+    if not ok:
+        # Only the write being finished at the cut may have gone either way
+        cuts += 1
+        reboot(ts)
+        check = ContextP(2)
+        assert fs.loadAll(check)
+        for t in range(2):
+            got = readFile(fs, check, t)
+            assert got == files[t] or (t == attempted[-1] and got == updates[t]), (n, t)
+            files[t] = got
+    ts.timeout = 1 << 20
+
+    reboot(ts)
+    scanned = ContextP(2)
+    assert fs.scan(scanned)
+    ctx = ContextP(2)
+    assert fs.loadAll(ctx) and fs.loadRest(ctx)
+    assert summary(ctx) == summary(scanned), n
+print("Interleaved writers cut in", cuts, "of 200 rounds")
+assert 0 < cuts < 200
+
+# Instrumentation counts and traces
+ts = TimeoutStorage(timeout=1 << 20)
+for b in range(ts.blocks):
+    assert ts.flashErase(b * ts.maxBlockSize)
+fs = LockFsP(ts)
+events: list[tuple[Event, bool]] = []
+fs.trace(events)
+ctx = ContextP(2)
+assert fs.loadAll(ctx)
+fs.resetCounters()
+data = b"x" * (2 * dataSize + 1)
+assert writeFile(fs, ctx, 0, data)
+fs.trace(None)
+c = fs.counters()
+c.dump()
+assert events == [
+    (e, begin)
+    for e in (Event.LoadAll, Event.StartWrite, Event.Write, Event.FinishWrite)
+    for begin in (True, False)
+], events
+assert c.bytesProgrammed == len(data)
+assert c.blocksSkipped == 0
+# Reserve and seal each block, commit the start block, then the index
+# (header and commit, the first since the mount scanned)
+assert c.headerWrites == 3 * 2 + 1 + 2, c.headerWrites
+# Only the start block's, to commit it
+assert c.headerReads == 1, c.headerReads
+# Each block, the index has a CRC of its own
+assert c.checksums == 3, c.checksums
+
+reboot(ts)
+fs.resetCounters()
+ctx = ContextP(2)
+assert fs.loadAll(ctx)
+c = fs.counters()
+# Both index headers, the next free block's and the file's, instead of
+# every header
+assert c.headerReads == 2 + 1 + 3, c.headerReads
+assert c.locks == 3
+assert c.checksums == 0
+
+# Sparse tag table, sorted and only as big as the number of files, also
+# mounted from the index
+ts = TimeoutStorage(timeout=1 << 20)
+for b in range(ts.blocks):
+    assert ts.flashErase(b * ts.maxBlockSize)
+fs = LockFsP(ts)
+ctx = ContextP(2, sparse=True)
+assert fs.loadAll(ctx)
+assert writeFile(fs, ctx, 200, b"two hundred")
+assert writeFile(fs, ctx, 3, b"three")
+assert not fs.startWrite(ctx, 100, 10)
+assert writeFile(fs, ctx, 200, b"two hundred and one")
+reboot(ts)
+ts.reads = 0
+ctx = ContextP(2, sparse=True)
+assert fs.scan(ctx)
+assert ts.reads == ts.blocks, ts.reads
+assert [hdr.current.tag for hdr in ctx.headers] == [3, 200]
+
+reboot(ts)
+ts.reads = 0
+ctx = ContextP(2, sparse=True)
+assert fs.loadAll(ctx)
+assert ts.reads < ts.blocks, ts.reads
+assert [hdr.current.tag for hdr in ctx.headers] == [3, 200]
+assert readFile(fs, ctx, 3) == b"three"
+assert readFile(fs, ctx, 200) == b"two hundred and one"
+assert readFile(fs, ctx, 100) is None
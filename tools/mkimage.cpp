@@ -0,0 +1,226 @@
+// Builds a LockFs flash image from a manifest, for a bulk programmer:
+//
+//     mkimage [-b block size] [-s flash size] [-j threads] -o image.bin manifest
+//
+// Each line of the manifest is a tag and the file to store under it
+// (relative to the manifest), blank lines and lines starting with # are
+// skipped.
+//
+// Only the block and flash sizes are options (4KiB and 1MiB by default),
+// the rest of Format is fixed, so the images are only for devices whose
+// Storage matches it: uint32_t FlashAddr, uint16_t BlockSize, a uint8_t
+// Checksum summing the bytes, uint8_t tags, the default header layout and
+// no index. Other devices need their own Format, built with ImageBuilder.
+
+#include "lockfs/image.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <numeric>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Format
+{
+    using FlashAddr = uint32_t;
+    using BlockSize = uint16_t;
+    using Checksum = uint8_t;
+
+    BlockSize blockSize = 4096;
+    FlashAddr bytes = 1 << 20;
+
+    BlockSize maxBlockSize() const { return blockSize; }
+    FlashAddr size() const { return bytes; }
+
+    // Sum of the bytes
+    Checksum checksum(std::span<const uint8_t> data) const
+    {
+        return std::accumulate(data.begin(), data.end(), Checksum{0});
+    }
+};
+
+// Runs each part on its own thread
+struct Threaded
+{
+    template<typename Job>
+    void operator()(size_t count, Job && job)
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < count; ++i)
+        {
+            threads.emplace_back(job, i);
+        }
+        for (std::thread & thread : threads)
+        {
+            thread.join();
+        }
+    }
+};
+
+struct Entry
+{
+    uint8_t tag;
+    std::filesystem::path path;
+};
+
+std::optional<std::vector<Entry>> readManifest(const std::filesystem::path & path)
+{
+    std::ifstream in{path};
+    if (!in.is_open())
+    {
+        std::cerr << "failed to open " << path << "\n";
+        return {};
+    }
+    std::vector<Entry> entries;
+    // Line each tag was given on, an image has one file per tag
+    std::array<size_t, 0xFF> lines{};
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); ++number)
+    {
+        std::istringstream fields{line};
+        std::string tag;
+        std::string file;
+        if (!(fields >> tag) || tag.starts_with('#'))
+        {
+            continue;
+        }
+        char * end;
+        const unsigned long value = std::strtoul(tag.c_str(), &end, 0);
+        // All ones is never a valid tag
+        if (*end != '\0' || value >= 0xFF || !(fields >> file))
+        {
+            std::cerr << path.string() << ":" << number << ": expected a tag and a file\n";
+            return {};
+        }
+        if (lines[value] != 0)
+        {
+            std::cerr << path.string() << ":" << number << ": tag " << tag
+                << " already used on line " << lines[value] << "\n";
+            return {};
+        }
+        lines[value] = number;
+        entries.push_back({.tag = uint8_t(value), .path = path.parent_path() / file});
+    }
+    return entries;
+}
+
+std::optional<std::vector<uint8_t>> readFile(const std::filesystem::path & path)
+{
+    std::ifstream in{path, std::ios::binary};
+    if (!in.is_open())
+    {
+        std::cerr << "failed to open " << path << "\n";
+        return {};
+    }
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>{in}, {});
+}
+
+int usage()
+{
+    std::cerr
+        << "usage: mkimage [-b block size] [-s flash size] [-j threads] -o image.bin manifest\n"
+        << "Images are for devices with 16 bit block sizes, 8 bit tags and a checksum\n"
+        << "summing the bytes into 8 bits, with the default header layout and no index.\n"
+        << "Block size defaults to 4096 (at most 65535), flash size to 1MiB.\n";
+    return 2;
+}
+
+int main(int argc, char ** argv)
+{
+    Format format{};
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::optional<std::filesystem::path> output;
+    std::optional<std::filesystem::path> manifest;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg.starts_with('-') && i + 1 == argc)
+        {
+            return usage();
+        }
+        if (arg == "-b")
+        {
+            const unsigned long blockSize = std::strtoul(argv[++i], nullptr, 0);
+            if (blockSize > 0xFFFF)
+            {
+                return usage();
+            }
+            format.blockSize = Format::BlockSize(blockSize);
+        }
+        else if (arg == "-s")
+        {
+            format.bytes = Format::FlashAddr(std::strtoul(argv[++i], nullptr, 0));
+        }
+        else if (arg == "-j")
+        {
+            threads = std::max(1ul, std::strtoul(argv[++i], nullptr, 0));
+        }
+        else if (arg == "-o")
+        {
+            output = argv[++i];
+        }
+        else if (!arg.starts_with('-') && !manifest.has_value())
+        {
+            manifest = arg;
+        }
+        else
+        {
+            return usage();
+        }
+    }
+    if (!output.has_value() || !manifest.has_value()
+        || format.blockSize == 0 || format.bytes == 0 || format.bytes % format.blockSize != 0)
+    {
+        return usage();
+    }
+
+    const auto entries = readManifest(*manifest);
+    if (!entries.has_value())
+    {
+        return 1;
+    }
+    LockFs::ImageBuilder<Format> builder{format, entries->size()};
+    for (const Entry & entry : *entries)
+    {
+        const auto data = readFile(entry.path);
+        if (!data.has_value())
+        {
+            return 1;
+        }
+        if (!builder.add(entry.tag, *data))
+        {
+            std::cerr << "no room for " << entry.path << "\n";
+            return 1;
+        }
+    }
+    if (!builder.seal(Threaded{}, threads))
+    {
+        std::cerr << "sealed image failed to mount\n";
+        return 1;
+    }
+    if (!builder.writeIndex())
+    {
+        std::cerr << "failed to write the index\n";
+        return 1;
+    }
+
+    std::ofstream out{*output, std::ios::binary | std::ios::trunc};
+    const auto image = builder.image();
+    out.write(reinterpret_cast<const char *>(image.data()), image.size());
+    if (!out)
+    {
+        std::cerr << "failed to write " << *output << "\n";
+        return 1;
+    }
+    return 0;
+}